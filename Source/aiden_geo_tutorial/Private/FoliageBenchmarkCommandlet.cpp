@@ -0,0 +1,304 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "FoliageBenchmarkCommandlet.h"
+
+#include "Async/TaskGraphInterfaces.h"
+#include "Engine/Engine.h"
+#include "Engine/StaticMesh.h"
+#include "Engine/TextureRenderTarget2D.h"
+#include "FoliageCaptureActor.h"
+#include "FoliagePixelBuffer.h"
+#include "HAL/FileManager.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+
+UFoliageBenchmarkCommandlet::UFoliageBenchmarkCommandlet()
+{
+	IsClient = false;
+	IsEditor = true;
+	IsServer = false;
+	LogToConsole = true;
+}
+
+int32 UFoliageBenchmarkCommandlet::Main(const FString& Params)
+{
+	int32 Size = 2048;
+	FParse::Value(*Params, TEXT("Size="), Size);
+	int32 BlockSize = 16;
+	FParse::Value(*Params, TEXT("BlockSize="), BlockSize);
+	int32 Iterations = 5;
+	FParse::Value(*Params, TEXT("Iterations="), Iterations);
+	int32 Seed = 0;
+	FParse::Value(*Params, TEXT("Seed="), Seed);
+	float Density = 0.5f;
+	FParse::Value(*Params, TEXT("Density="), Density);
+	double Timeout = 60.0;
+	FParse::Value(*Params, TEXT("Timeout="), Timeout);
+	FString CsvFileName;
+	FParse::Value(*Params, TEXT("Csv="), CsvFileName);
+
+	FString ClassMixString = TEXT("0.3,0.2,0.1");
+	FParse::Value(*Params, TEXT("ClassMix="), ClassMixString, false);
+	TArray<FString> ClassMixValues;
+	ClassMixString.ParseIntoArray(ClassMixValues, TEXT(","));
+	TArray<float> ClassMix;
+	for (const FString& Value : ClassMixValues)
+	{
+		ClassMix.Add(FMath::Max(FCString::Atof(*Value), 0.f));
+	}
+
+	FString OriginString = TEXT("0,0");
+	FParse::Value(*Params, TEXT("Origin="), OriginString, false);
+	FString LongitudeString;
+	FString LatitudeString;
+	OriginString.Split(TEXT(","), &LongitudeString, &LatitudeString);
+	const double Longitude = FCString::Atod(*LongitudeString);
+	const double Latitude = FCString::Atod(*LatitudeString);
+
+	if (Size <= 0 || BlockSize <= 0 || Iterations <= 0 || ClassMix.Num() == 0 || ClassMix.Num() > 254)
+	{
+		UE_LOG(LogTemp, Error, TEXT("Usage: -run=FoliageBenchmark [-Size=<Pixels>] [-ClassMix=<Fraction>,...] "
+		                            "[-BlockSize=<Pixels>] [-Iterations=<Count>] [-Seed=<Seed>] [-Density=<Density>] "
+		                            "[-Origin=<Longitude>,<Latitude>] [-CommitBudgetMs=<Ms>] [-Timeout=<Seconds>] "
+		                            "[-Csv=<File>]"));
+		return 1;
+	}
+
+	UStaticMesh* Mesh = LoadObject<UStaticMesh>(nullptr, TEXT("/Engine/BasicShapes/Cube.Cube"));
+	if (Mesh == nullptr)
+	{
+		UE_LOG(LogTemp, Error, TEXT("Failed to load the benchmark mesh"));
+		return 1;
+	}
+
+	// One foliage type per class, with a geometry type of its own so every class fills its own HISMs.
+	TArray<FFoliageClassificationType> FoliageTypes;
+	for (int32 ClassIndex = 0; ClassIndex < ClassMix.Num(); ++ClassIndex)
+	{
+		FFoliageClassificationType& FoliageType = FoliageTypes.AddDefaulted_GetRef();
+		FoliageType.Type = FString::Printf(TEXT("Benchmark%d"), ClassIndex);
+		FoliageType.ColourClassification = FLinearColor((ClassIndex + 1) / 255.f, 1.f, 0.f);
+		FoliageType.ClassID = static_cast<uint8>(ClassIndex + 1);
+
+		FFoliageGeometryType& GeometryType = FoliageType.FoliageTypes.AddDefaulted_GetRef();
+		GeometryType.Mesh = Mesh;
+		GeometryType.Density = Density;
+		GeometryType.Scale = FFloatInterval(1.f + ClassIndex, 1.f + ClassIndex);
+		GeometryType.bCollidesWithWorld = false;
+	}
+
+	UWorld* World = UWorld::CreateWorld(EWorldType::Game, false, TEXT("FoliageBenchmark"));
+	FWorldContext& WorldContext = GEngine->CreateNewWorldContext(EWorldType::Game);
+	WorldContext.SetCurrentWorld(World);
+
+	ACesiumGeoreference* Georeference = World->SpawnActor<ACesiumGeoreference>();
+	Georeference->SetGeoreferenceOrigin(FVector(Longitude, Latitude, 0.0));
+
+	// The actor never begins play, it's ticked by hand below so the commit of every tick can be timed on its own.
+	AFoliageCaptureActor* CaptureActor = World->SpawnActor<AFoliageCaptureActor>();
+	CaptureActor->Georeference = Georeference;
+	CaptureActor->FoliageTypes = FoliageTypes;
+	FParse::Value(*Params, TEXT("CommitBudgetMs="), CaptureActor->CommitBudgetMs);
+	const FVector Location = Georeference->TransformLongitudeLatitudeHeightToUnreal(
+		FVector(Longitude, Latitude, CaptureActor->CaptureElevation));
+	CaptureActor->SetActorLocationAndRotation(Location, Georeference->ComputeEastSouthUpToUnreal(Location).Rotator());
+	CaptureActor->ResetAndCreateHISMComponents();
+
+	// Only the size and the format of the render targets are read, the pixels are supplied directly.
+	UTextureRenderTarget2D* FoliageDistributionMap = NewObject<UTextureRenderTarget2D>();
+	FoliageDistributionMap->RenderTargetFormat = RTF_RGBA8;
+	FoliageDistributionMap->SizeX = Size;
+	FoliageDistributionMap->SizeY = Size;
+	UTextureRenderTarget2D* NormalAndDepthMap = NewObject<UTextureRenderTarget2D>();
+	NormalAndDepthMap->RenderTargetFormat = RTF_RGBA32f;
+	NormalAndDepthMap->SizeX = Size;
+	NormalAndDepthMap->SizeY = Size;
+
+	FFoliagePixelBuffer ClassificationPixels;
+	FFoliagePixelBuffer NormalPixels;
+	MakeSyntheticPixels(Size, BlockSize, Seed, ClassMix, FoliageTypes, ClassificationPixels, NormalPixels);
+
+	const double HalfWidth = CaptureActor->CaptureWidth / 2;
+	const FBox RTWorldBounds = FBox::BuildAABB(Location, FVector(HalfWidth, HalfWidth, 0.0));
+
+	TArray<double> ReprojectionMs;
+	TArray<double> CommitTickMs;
+	int64 NumPixels = 0;
+	int64 NumInstancesGenerated = 0;
+	int64 NumInstancesCommitted = 0;
+	int32 NumFailed = 0;
+	const float DeltaSeconds = 1.f / 60.f;
+
+	for (int32 Iteration = 0; Iteration < Iterations; ++Iteration)
+	{
+		const int32 NumBuildsCommitted = CaptureActor->GetCaptureStats().NumBuildsCommitted;
+		CaptureActor->BuildFoliageTransformsFromPixels(ClassificationPixels, NormalPixels, FoliageDistributionMap,
+		                                               NormalAndDepthMap, RTWorldBounds);
+
+		// Reprojection runs on the workers and reports back to the game thread.
+		const double StartTime = FPlatformTime::Seconds();
+		while (CaptureActor->IsBuilding() && FPlatformTime::Seconds() - StartTime < Timeout)
+		{
+			FTaskGraphInterface::Get().ProcessThreadUntilIdle(ENamedThreads::GameThread);
+			FPlatformProcess::Sleep(0.f);
+		}
+
+		const FFoliageCaptureStats Stats = CaptureActor->GetCaptureStats();
+		if (CaptureActor->IsBuilding() || Stats.NumBuildsCommitted == NumBuildsCommitted)
+		{
+			UE_LOG(LogTemp, Warning, TEXT("Benchmark build %d wasn't handed off within %f seconds"), Iteration, Timeout);
+			++NumFailed;
+			continue;
+		}
+		ReprojectionMs.Add(Stats.LastReprojectionMs);
+		NumPixels += Stats.LastPixelsProcessed;
+		NumInstancesGenerated += Stats.LastInstancesGenerated;
+
+		// Tick until nothing has been committed for longer than the actor waits between commits.
+		int32 NumIdleTicks = 0;
+		const double CommitStartTime = FPlatformTime::Seconds();
+		while (NumIdleTicks <= CaptureActor->UpdateFoliageAfterNumFrames + 1 &&
+			FPlatformTime::Seconds() - CommitStartTime < Timeout)
+		{
+			const double TickStartTime = FPlatformTime::Seconds();
+			CaptureActor->Tick(DeltaSeconds);
+			const double TickMs = (FPlatformTime::Seconds() - TickStartTime) * 1000.0;
+			FTaskGraphInterface::Get().ProcessThreadUntilIdle(ENamedThreads::GameThread);
+			++GFrameCounter;
+
+			const int32 NumCommitted = CaptureActor->GetCaptureStats().InstancesCommittedLastTick;
+			if (NumCommitted > 0)
+			{
+				CommitTickMs.Add(TickMs);
+				NumInstancesCommitted += NumCommitted;
+				NumIdleTicks = 0;
+			}
+			else
+			{
+				++NumIdleTicks;
+			}
+		}
+	}
+
+	const FPlatformMemoryStats MemoryStats = FPlatformMemory::GetStats();
+	const double PeakMemoryMB = MemoryStats.PeakUsedPhysical / (1024.0 * 1024.0);
+
+	double TotalReprojectionMs = 0.0;
+	for (const double Ms : ReprojectionMs)
+	{
+		TotalReprojectionMs += Ms;
+	}
+	double TotalCommitMs = 0.0;
+	for (const double Ms : CommitTickMs)
+	{
+		TotalCommitMs += Ms;
+	}
+	CommitTickMs.Sort();
+
+	const double PixelsPerSecond = TotalReprojectionMs > 0.0 ? NumPixels / (TotalReprojectionMs / 1000.0) : 0.0;
+	const double InstancesPerSecond = TotalReprojectionMs > 0.0
+		? NumInstancesGenerated / (TotalReprojectionMs / 1000.0)
+		: 0.0;
+	const double CommittedPerSecond = TotalCommitMs > 0.0 ? NumInstancesCommitted / (TotalCommitMs / 1000.0) : 0.0;
+	const double CommitP50 = GetPercentile(CommitTickMs, 50.0);
+	const double CommitP95 = GetPercentile(CommitTickMs, 95.0);
+	const double CommitP99 = GetPercentile(CommitTickMs, 99.0);
+	const double CommitMax = CommitTickMs.Num() > 0 ? CommitTickMs.Last() : 0.0;
+
+	UE_LOG(LogTemp, Display, TEXT("Foliage benchmark: %dx%d pixels, %d classes, %d of %d builds"), Size, Size,
+	       ClassMix.Num(), ReprojectionMs.Num(), Iterations);
+	UE_LOG(LogTemp, Display, TEXT("  Reprojection: %.2f Mpixels/s, %.2f M instances/s, %.2f ms per build"),
+	       PixelsPerSecond / 1e6, InstancesPerSecond / 1e6,
+	       ReprojectionMs.Num() > 0 ? TotalReprojectionMs / ReprojectionMs.Num() : 0.0);
+	UE_LOG(LogTemp, Display, TEXT("  Commit: %.2f M instances/s over %d ticks, p50 %.2f ms, p95 %.2f ms, p99 %.2f ms, "
+	                              "max %.2f ms"), CommittedPerSecond / 1e6, CommitTickMs.Num(), CommitP50, CommitP95,
+	       CommitP99, CommitMax);
+	UE_LOG(LogTemp, Display, TEXT("  Peak memory: %.1f MB"), PeakMemoryMB);
+
+	if (!CsvFileName.IsEmpty())
+	{
+		FString Csv;
+		if (!IFileManager::Get().FileExists(*CsvFileName))
+		{
+			Csv += TEXT("Size,Classes,Builds,PixelsPerSecond,InstancesPerSecond,CommittedPerSecond,CommitP50Ms,"
+			            "CommitP95Ms,CommitP99Ms,CommitMaxMs,PeakMemoryMB\n");
+		}
+		Csv += FString::Printf(TEXT("%d,%d,%d,%.0f,%.0f,%.0f,%.3f,%.3f,%.3f,%.3f,%.1f\n"), Size, ClassMix.Num(),
+		                       ReprojectionMs.Num(), PixelsPerSecond, InstancesPerSecond, CommittedPerSecond,
+		                       CommitP50, CommitP95, CommitP99, CommitMax, PeakMemoryMB);
+		if (!FFileHelper::SaveStringToFile(Csv, *CsvFileName, FFileHelper::EEncodingOptions::AutoDetect,
+		                                   &IFileManager::Get(), FILEWRITE_Append))
+		{
+			UE_LOG(LogTemp, Warning, TEXT("Failed to write benchmark results to %s"), *CsvFileName);
+		}
+	}
+
+	GEngine->DestroyWorldContext(World);
+	World->DestroyWorld(false);
+	World->RemoveFromRoot();
+
+	return NumFailed > 0 ? 1 : 0;
+}
+
+void UFoliageBenchmarkCommandlet::MakeSyntheticPixels(int32 Size, int32 BlockSize, int32 Seed,
+	const TArray<float>& ClassMix, const TArray<FFoliageClassificationType>& FoliageTypes,
+	FFoliagePixelBuffer& OutClassificationPixels, FFoliagePixelBuffer& OutNormalPixels)
+{
+	FRandomStream Stream(Seed);
+
+	// Weights above one in total leave no pixels unclassified.
+	float TotalWeight = 0.f;
+	for (const float Weight : ClassMix)
+	{
+		TotalWeight += Weight;
+	}
+	TotalWeight = FMath::Max(TotalWeight, 1.f);
+
+	const int32 NumBlocks = FMath::DivideAndRoundUp(Size, BlockSize);
+	TArray<FColor> BlockColours;
+	BlockColours.SetNumUninitialized(NumBlocks * NumBlocks);
+	for (FColor& Colour : BlockColours)
+	{
+		Colour = FColor::Black;
+		float Pick = Stream.FRand() * TotalWeight;
+		for (int32 ClassIndex = 0; ClassIndex < ClassMix.Num(); ++ClassIndex)
+		{
+			Pick -= ClassMix[ClassIndex];
+			if (Pick < 0.f)
+			{
+				Colour = FoliageTypes[ClassIndex].ColourClassification.QuantizeRound();
+				break;
+			}
+		}
+	}
+
+	const int32 NumPixels = Size * Size;
+	OutClassificationPixels.Reset(EFoliagePixelEncoding::Colour8);
+	OutClassificationPixels.Data.SetNumUninitialized(NumPixels * sizeof(FColor));
+	OutNormalPixels.Reset(EFoliagePixelEncoding::LinearColor);
+	OutNormalPixels.Data.SetNumUninitialized(NumPixels * sizeof(FLinearColor));
+
+	FColor* Colours = reinterpret_cast<FColor*>(OutClassificationPixels.Data.GetData());
+	FLinearColor* NormalDepths = reinterpret_cast<FLinearColor*>(OutNormalPixels.Data.GetData());
+	for (int32 Y = 0; Y < Size; ++Y)
+	{
+		for (int32 X = 0; X < Size; ++X)
+		{
+			const int32 Index = Y * Size + X;
+			Colours[Index] = BlockColours[(Y / BlockSize) * NumBlocks + X / BlockSize];
+			NormalDepths[Index] = FLinearColor(0.f, 0.f, 1.f, 0.5f + Stream.FRandRange(-0.01f, 0.01f));
+		}
+	}
+}
+
+double UFoliageBenchmarkCommandlet::GetPercentile(const TArray<double>& SortedValues, double Percent)
+{
+	if (SortedValues.Num() == 0)
+	{
+		return 0.0;
+	}
+	const int32 Index = FMath::Clamp(FMath::CeilToInt(Percent / 100.0 * SortedValues.Num()) - 1, 0,
+	                                 SortedValues.Num() - 1);
+	return SortedValues[Index];
+}
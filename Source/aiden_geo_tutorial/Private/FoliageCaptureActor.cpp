@@ -1,561 +1,2764 @@
-// Fill out your copyright notice in the Description page of Project Settings.
-
-
-#include "FoliageCaptureActor.h"
-
-#include "Kismet/KismetMathLibrary.h"
-
-// Sets default values
-AFoliageCaptureActor::AFoliageCaptureActor()
-{
-	// Set this actor to call Tick() every frame.  You can turn this off to improve performance if you don't need it.
-	PrimaryActorTick.bCanEverTick = true;
-}
-
-// Called when the game starts or when spawned
-void AFoliageCaptureActor::BeginPlay()
-{
-	Super::BeginPlay();
-	ResetAndCreateHISMComponents();
-
-	FCoreDelegates::PreWorldOriginOffset.AddLambda([&](UWorld* World, FIntVector CurrentOrigin, FIntVector NewOrigin) {
-		bIsRebasing = true;
-		
-		WorldOffset = FVector(NewOrigin - CurrentOrigin);
-		});
-
-	FCoreDelegates::PostWorldOriginOffset.AddLambda([&](UWorld* World, FIntVector CurrentOrigin, FIntVector NewOrigin) {
-		bIsRebasing = false;
-		WorldOffset = FVector(0.);
-	});
-}
-
-// Called every frame
-void AFoliageCaptureActor::Tick(float DeltaTime)
-{
-	Super::Tick(DeltaTime);
-
-	if (Ticks > UpdateFoliageAfterNumFrames && !bIsBuilding)
-	{
-		Ticks = 0;
-		int32 ComponentsUpdated = 0;
-
-		for (TPair<FFoliageGeometryType, TArray<UFoliageHISM*>>& FoliageHISMPair : HISMFoliageMap)
-		{
-			for (UFoliageHISM* FoliageHISM : FoliageHISMPair.Value)
-			{
-				// if (!IsValid(FoliageHISM)) { continue; }
-				if (FoliageHISM->bMarkedForClear)
-				{
-#if !FOLIAGE_REDUCE_FLICKER_APPROACH_ENABLED
-					FoliageHISM->ClearInstances();
-					FoliageHISM->bCleared = true;
-					FoliageHISM->bMarkedForClear = false;
-					ComponentsUpdated++;
-#endif
-				}
-				else if (FoliageHISM->bMarkedForAdd)
-				{
-#if FOLIAGE_REDUCE_FLICKER_APPROACH_ENABLED
-					FoliageHISM->ClearInstances();
-#endif
-					FoliageHISM->PreAllocateInstancesMemory(FoliageHISM->Transforms.Num());
-					FoliageHISM->AddInstances(FoliageHISM->Transforms, false);
-					FoliageHISM->bMarkedForAdd = false;
-					FoliageHISM->Transforms.Empty();
-					FoliageHISM->bCleared = false;
-					ComponentsUpdated++;
-				}
-				if (ComponentsUpdated > MaxComponentsToUpdatePerFrame)
-				{
-					break;
-				}
-			}
-			if (ComponentsUpdated > MaxComponentsToUpdatePerFrame)
-			{
-				break;
-			}
-		}
-
-		if (IsValid(Georeference)) {
-			if (AllISMsMarkedAsCleared() && !bInstancesClearedCalled && IsWaiting()) {
-				OnInstancesCleared();
-			}
-		}
-	}
-
-	Ticks++;
-}
-
-void AFoliageCaptureActor::BuildFoliageTransforms(UTextureRenderTarget2D* FoliageDistributionMap,
-	UTextureRenderTarget2D* NormalAndDepthMap, FBox RTWorldBounds)
-{
-	// Need to check whether the CesiumGeoreference actor and input RTs are valid.
-	if (!IsValid(Georeference))
-	{
-		UE_LOG(LogTemp, Warning, TEXT("Georeference is invalid! Not spawning in foliage"));
-		return;
-	}
-	if (!IsValid(NormalAndDepthMap) || !IsValid(FoliageDistributionMap))
-	{
-		UE_LOG(LogTemp, Warning, TEXT("Invaid inputs for FoliageCaptureActor!"));
-		return;
-	}
-	if (FoliageTypes.Num() == 0)
-	{
-		UE_LOG(LogTemp, Warning, TEXT("No foliage types added!"));
-		return;
-	}
-
-	bIsBuilding = true;
-
-	// Find the geographic bounds of the RT
-	const glm::dvec3 MinGeographic = Georeference->TransformUnrealToLongitudeLatitudeHeight(
-		glm::dvec3(
-			RTWorldBounds.Min.X,
-			RTWorldBounds.Min.Y,
-			RTWorldBounds.Min.Z
-		));
-
-	const glm::dvec3 MaxGeographic = Georeference->TransformUnrealToLongitudeLatitudeHeight(
-		glm::dvec3(
-			RTWorldBounds.Max.X,
-			RTWorldBounds.Max.Y,
-			RTWorldBounds.Max.Z
-		)
-	);
-	const glm::dvec4 GeographicExtents2D = glm::dvec4(
-		MinGeographic.x, MinGeographic.y,
-		MaxGeographic.x, MaxGeographic.y
-	);
-
-	// Setup pixel extraction
-	const int32 TotalPixels = FoliageDistributionMap->SizeX * FoliageDistributionMap->SizeY;
-
-	TArray<FLinearColor>* ClassificationPixels = new TArray<FLinearColor>();
-	TArray<FLinearColor>* NormalPixels = new TArray<FLinearColor>();
-
-	FOnRenderTargetRead OnRenderTargetRead;
-	
-	OnRenderTargetRead.BindLambda(
-		[this, FoliageDistributionMap, ClassificationPixels, NormalPixels, GeographicExtents2D, TotalPixels](
-			bool bSuccess) mutable
-		{
-			if (!bSuccess)
-			{
-				bIsBuilding = false;
-				return;
-			}
-
-			const int32 Width = FoliageDistributionMap->SizeX;
-
-			TMap<UFoliageHISM*, int32> NewInstanceCountMap;
-			FFoliageTransforms FoliageTransforms;
-
-			for (int Index = 0; Index < TotalPixels; ++Index)
-			{
-				// Get the 2D pixel coordinates.
-				const double X = (Index % Width);
-				const double Y = (Index / Width);
-
-				// Extract classification, normals and depth from the pixel arrays.
-				const FLinearColor Classification = (*ClassificationPixels)[Index];
-				const FLinearColor NormalDepth = (*NormalPixels)[Index];
-				// Convert the RGB channel in the NormalDepth array to a FVector
-				FVector Normal = FVector(NormalDepth.R, NormalDepth.G, NormalDepth.B);
-				// Project the Alpha channel in NormalDepth to elevation (in metres) 
-				const double Elevation = GetHeightFromDepth(NormalDepth.A);
-				
-				// Project pixel coords to geographic.
-				const FVector GeographicCoords = PixelToGeographicLocation(X, Y, Elevation, FoliageDistributionMap,
-					GeographicExtents2D);
-				// Then project to UE world coordinates
-				FVector Location = Georeference->TransformLongitudeLatitudeHeightToUnreal(GeographicCoords);
-
-				// Compute east north up
-				const FMatrix EastNorthUpEngine = Georeference->ComputeEastSouthUpToUnreal(Location);
-
-				for (FFoliageClassificationType& FoliageType : FoliageTypes)
-				{
-					// If classification pixel colour matches the classification of FoliageType
-					if (Classification == FoliageType.ColourClassification)
-					{
-						bool bHasDoneRaycast = false;
-
-						if (FoliageType.bAlignToSurfaceWithRaycast)
-						{
-							CorrectFoliageTransform(Location, EastNorthUpEngine, Location, Normal, bHasDoneRaycast);
-						}
-						// Iterate through the mesh types inside FoliageType
-						for (FFoliageGeometryType& FoliageGeometryType : FoliageType.FoliageTypes)
-						{
-							if (FMath::FRand() >= FoliageGeometryType.Density)
-							{
-								continue;
-							}
-
-							// Find rotation and scale
-							const float Scale = FoliageGeometryType.Scale.Interpolate(FMath::FRand());
-							FRotator Rotation;
-
-							if (FoliageGeometryType.bAlignToNormal)
-							{
-								Rotation = UKismetMathLibrary::MakeRotFromZ(Normal);
-							}
-							else
-							{
-								Rotation = EastNorthUpEngine.Rotator();
-							}
-
-							// Apply a random angle to the rotation yaw if RandomYaw is true.
-							if (FoliageGeometryType.bRandomYaw)
-							{
-								Rotation = UKismetMathLibrary::RotatorFromAxisAndAngle(
-									Rotation.Quaternion().GetUpVector(), FMath::FRandRange(
-										0.0, 360.0
-									));
-							}
-
-							// Find HISM with minimum amount of transforms.
-
-							UFoliageHISM* MinimumHISM = HISMFoliageMap[FoliageGeometryType][0];
-							for (UFoliageHISM* HISM : HISMFoliageMap[FoliageGeometryType])
-							{
-								if (FoliageTransforms.HISMTransformMap.Contains(HISM) && FoliageTransforms.HISMTransformMap.Contains(MinimumHISM))
-								{
-									if (FoliageTransforms.HISMTransformMap[HISM].Num() < FoliageTransforms.HISMTransformMap[MinimumHISM].Num())
-									{
-										MinimumHISM = HISM;
-									}
-								}
-							}
-							if (!IsValid(MinimumHISM))
-							{
-								UE_LOG(LogTemp, Error, TEXT("MinimumHISM is invalid!"));
-							}
-
-							Location += WorldOffset;
-
-							// Add our transform, and make it relative to the actor.
-							FTransform NewTransform = FTransform(
-								Rotation,
-								Location + (Rotation.Quaternion().
-									GetUpVector() * FoliageGeometryType.ZOffset.
-									Interpolate(FMath::FRand())), FVector(Scale)
-							).GetRelativeTransform(GetTransform());
-
-							if (NewTransform.IsRotationNormalized())
-							{
-								if (!FoliageTransforms.HISMTransformMap.Contains(MinimumHISM))
-								{
-									FoliageTransforms.HISMTransformMap.Add(MinimumHISM, TArray{ NewTransform });
-								}
-								else
-								{
-									FoliageTransforms.HISMTransformMap[MinimumHISM].Add(NewTransform);
-								}
-							}
-						}
-					}
-				}
-			}
-			delete ClassificationPixels;
-			delete NormalPixels;
-			ClassificationPixels = nullptr;
-			NormalPixels = nullptr;
-
-			AsyncTask(ENamedThreads::GameThread, [FoliageTransforms, this]()
-				{
-					// Marked for add
-					for (const TPair<UFoliageHISM*, TArray<FTransform>>& Pair : FoliageTransforms.HISMTransformMap)
-					{
-						Pair.Key->Transforms.Append(Pair.Value);
-						Pair.Key->bMarkedForAdd = true;
-					}
-					bIsBuilding = false;
-				});
-		});
-	// Extract the pixels from the render targets, calling OnRenderTargetRead when complete.
-	ReadLinearColorPixelsAsync(OnRenderTargetRead, TArray<FTextureRenderTargetResource*>{
-		FoliageDistributionMap->GameThread_GetRenderTargetResource(),
-			NormalAndDepthMap->GameThread_GetRenderTargetResource()
-	}, TArray<TArray<FLinearColor>*>{
-		ClassificationPixels, NormalPixels
-	});
-}
-
-void AFoliageCaptureActor::ClearFoliageInstances()
-{
-	// Ensure the transforms array on the HISMs are cleared before building.
-	for (TPair<FFoliageGeometryType, TArray<UFoliageHISM*>>& FoliageHISMPair : HISMFoliageMap)
-	{
-		for (UFoliageHISM* FoliageHISM : FoliageHISMPair.Value)
-		{
-			if (IsValid(FoliageHISM))
-			{
-				FoliageHISM->Transforms.Empty();
-				FoliageHISM->bMarkedForClear = true;
-			}
-		}
-	}
-}
-
-void AFoliageCaptureActor::ResetAndCreateHISMComponents()
-{
-	for (FFoliageClassificationType& FoliageType : FoliageTypes)
-	{
-		for (FFoliageGeometryType& FoliageGeometryType : FoliageType.FoliageTypes)
-		{
-			if (FoliageGeometryType.Mesh == nullptr) { continue; }
-			if (HISMFoliageMap.Contains(FoliageGeometryType))
-			{
-				for (UFoliageHISM* HISM : HISMFoliageMap[FoliageGeometryType])
-				{
-					if (IsValid(HISM))
-					{
-						HISM->DestroyComponent();
-					}
-				}
-				HISMFoliageMap[FoliageGeometryType].Empty();
-			}
-			HISMFoliageMap.Remove(FoliageGeometryType);
-
-			for (int32 i = 0; i < FoliageType.PooledHISMsToCreatePerFoliageType; ++i)
-			{
-				UFoliageHISM* HISM = NewObject<UFoliageHISM>(this);
-				HISM->SetupAttachment(GetRootComponent());
-				HISM->RegisterComponent();
-
-				HISM->SetStaticMesh(FoliageGeometryType.Mesh);
-				HISM->SetCollisionEnabled(FoliageGeometryType.bCollidesWithWorld
-					? ECollisionEnabled::QueryAndPhysics
-					: ECollisionEnabled::NoCollision);
-				HISM->SetCullDistances(FoliageGeometryType.CullingDistances.Min, FoliageGeometryType.CullingDistances.Max);
-
-				// This may cause a slight hitch when enabled.
-				HISM->bAffectDistanceFieldLighting = FoliageGeometryType.bAffectsDistanceFieldLighting;
-				if (!HISMFoliageMap.Contains(FoliageGeometryType))
-				{
-					HISMFoliageMap.Add(FoliageGeometryType, TArray<UFoliageHISM*>{HISM});
-				}
-				else
-				{
-					HISMFoliageMap[FoliageGeometryType].Add(HISM);
-				}
-			}
-		}
-	}
-}
-
-void AFoliageCaptureActor::OnUpdate_Implementation(const FVector& NewLocation)
-{
-	// Align the actor to face the planet surface.
-	// SetActorLocation(NewLocation);
-	NewActorLocation = NewLocation;
-	bInstancesClearedCalled = false;
-	
-
-	const FRotator PlanetAlignedRotation = Georeference->ComputeEastSouthUpToUnreal(NewLocation).Rotator();
-
-	SetActorRotation(
-		PlanetAlignedRotation
-	);
-
-	// Get grid min and max coords.
-	const int32 Size = GridSize.X > 0 ? GridSize.X : 1;
-	const FVector Start = GetActorTransform().TransformPosition(FVector(-(CaptureWidth * Size) / 2, 0, 0));
-	const FVector End = GetActorTransform().TransformPosition(FVector((CaptureWidth * Size) / 2, 0, 0));
-
-	// Find the distance (in degrees) between the grid min and max.
-	glm::dvec3 GeoStart = Georeference->TransformUnrealToLongitudeLatitudeHeight(VectorToDVector(Start));
-	glm::dvec3 GeoEnd = Georeference->TransformUnrealToLongitudeLatitudeHeight(VectorToDVector(End));
-
-	GeoStart.z = CaptureElevation;
-	GeoEnd.z = CaptureElevation;
-
-	CaptureWidthInDegrees = glm::distance(GeoStart, GeoEnd) / 2;
-
-	bIsWaiting = true;
-	
-#if FOLIAGE_REDUCE_FLICKER_APPROACH_ENABLED
-	OnInstancesCleared();
-#else
-	ClearFoliageInstances();
-#endif
-
-}
-
-void AFoliageCaptureActor::OnInstancesCleared_Implementation()
-{
-	if (NewActorLocation.IsSet()) {
-		FVector GeoPosition = Georeference->TransformUnrealToLongitudeLatitudeHeight(
-			*NewActorLocation
-		);
-		GeoPosition.Z = CaptureElevation;
-		FVector EnginePosition = Georeference->TransformLongitudeLatitudeHeightToUnreal(GeoPosition);
-		ActorOffset = EnginePosition - GetActorLocation();
-
-		SetActorLocation(
-		EnginePosition
-		);
-
-#if FOLIAGE_REDUCE_FLICKER_APPROACH_ENABLED
-		OffsetAllInstances(ActorOffset);
-#endif
-
-		NewActorLocation.Reset();
-		bIsWaiting = false;
-	}
-}
-
-bool AFoliageCaptureActor::IsBuilding() const
-{
-	return bIsBuilding;
-}
-
-bool AFoliageCaptureActor::IsWaiting() const
-{
-	return bIsWaiting;
-}
-
-void AFoliageCaptureActor::CorrectFoliageTransform(const FVector& InEngineCoordinates, const FMatrix& InEastNorthUp,
-	FVector& OutCorrectedPosition, FVector& OutSurfaceNormals, bool& bSuccess) const
-{
-	UWorld* World = GetWorld();
-
-	if (IsValid(World))
-	{
-		const FVector Up = InEastNorthUp.ToQuat().GetUpVector();
-		FHitResult HitResult;
-
-		World->LineTraceSingleByChannel(HitResult, InEngineCoordinates + (Up * 6000),
-			InEngineCoordinates - (Up * 6000), ECollisionChannel::ECC_Visibility);
-
-		if (HitResult.bBlockingHit)
-		{
-			bSuccess = true;
-			OutCorrectedPosition = HitResult.ImpactPoint;
-			OutSurfaceNormals = HitResult.ImpactNormal;
-		}
-	}
-}
-
-double AFoliageCaptureActor::GetHeightFromDepth(const double& Value) const
-{
-	return CaptureElevation - (1 - Value) / 0.00001 / 100;
-
-}
-
-FVector AFoliageCaptureActor::PixelToGeographicLocation(const double& X, const double& Y, const double& Altitude,
-	UTextureRenderTarget2D* RT,
-	const glm::dvec4& GeographicExtents) const
-{
-	// Normalize the ranges of the coords
-	const double AX = X / static_cast<double>(RT->SizeX);
-	const double AY = Y / static_cast<double>(RT->SizeY);
-
-	const double Long = FMath::Lerp<double>(
-		GeographicExtents.x,
-		GeographicExtents.z,
-		1 - AY);
-	const double Lat = FMath::Lerp<double>(
-		GeographicExtents.y,
-		GeographicExtents.w,
-		AX);
-
-	return FVector(Long, Lat, Altitude);
-}
-
-FIntPoint AFoliageCaptureActor::GeographicToPixelLocation(const double& Longitude, const double& Latitude,
-	UTextureRenderTarget2D* RT,
-	const glm::dvec4& GeographicExtents) const
-{
-	// Normalize long and lat
-	const double LongitudeRange = GeographicExtents.z - GeographicExtents.x;
-	const double LatitudeRange = GeographicExtents.w - GeographicExtents.y;
-	const double ALongitude = (Longitude - GeographicExtents.x) / LongitudeRange;
-	const double ALatitude = (Latitude - GeographicExtents.y) / LatitudeRange;
-
-	const double X = FMath::Lerp<double>(0, RT->SizeX, ALatitude);
-	const double Y = FMath::Lerp<double>(RT->SizeY, 0, ALongitude);
-
-	return FIntPoint(X, Y);
-}
-
-void AFoliageCaptureActor::ReadLinearColorPixelsAsync(
-	FOnRenderTargetRead OnRenderTargetRead,
-	TArray<FTextureRenderTargetResource*> RTs,
-	TArray<TArray<FLinearColor>*> OutImageData,
-	FReadSurfaceDataFlags InFlags,
-	FIntRect InRect,
-	ENamedThreads::Type ExitThread)
-{
-	if (InRect == FIntRect(0, 0, 0, 0))
-	{
-		InRect = FIntRect(0, 0, RTs[0]->GetSizeXY().X, RTs[0]->GetSizeXY().Y);
-	}
-
-
-	struct FReadSurfaceContext
-	{
-		TArray<FTextureRenderTargetResource*> SrcRenderTargets;
-		TArray<TArray<FLinearColor>*> OutData;
-		FIntRect Rect;
-		FReadSurfaceDataFlags Flags;
-	};
-
-	for (auto DT : OutImageData) { DT->Reset(); }
-	FReadSurfaceContext Context =
-	{
-		RTs,
-		OutImageData,
-		InRect,
-		InFlags
-	};
-
-	if (!Context.OutData[0])
-	{
-		UE_LOG(LogTemp, Error, TEXT("Buffer invalid!"));
-		return;
-	}
-
-	FRenderCommandFence Fence;
-
-	ENQUEUE_RENDER_COMMAND(ReadSurfaceCommand)(
-		[Context, OnRenderTargetRead, ExitThread](FRHICommandListImmediate& RHICmdList)
-		{
-			const FIntRect Rect = Context.Rect;
-			const FReadSurfaceDataFlags Flags = Context.Flags;
-			int i = 0;
-			for (FRenderTarget* RT : Context.SrcRenderTargets)
-			{
-				
-				const FTexture2DRHIRef& RefRenderTarget = RT->
-					GetRenderTargetTexture();
-
-				TArray<FLinearColor>* Buffer = Context.OutData[i];
-				RHICmdList.ReadSurfaceData(
-					RefRenderTarget,
-					Rect,
-					*Buffer,
-					Flags
-				);
-				i++;
-			}
-			// instead of blocking the game thread, execute the delegate when finished.
-			AsyncTask(
-				ExitThread,
-				[OnRenderTargetRead, Context]()
-				{
-					OnRenderTargetRead.Execute((*Context.OutData[0]).Num() > 0);
-				});
-		});
-
-	Fence.BeginFence(true);
-	
-}
-
-glm::dvec3 AFoliageCaptureActor::VectorToDVector(const FVector& InVector)
-{
-	return glm::dvec3(InVector.X, InVector.Y, InVector.Z);
-}
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "FoliageCaptureActor.h"
+
+#include "Algo/StableSort.h"
+#include "Async/ParallelFor.h"
+#include "FoliageCaptureSubsystem.h"
+#include "Kismet/KismetMathLibrary.h"
+#include "Misc/Paths.h"
+#include "RHIGPUReadback.h"
+
+DEFINE_STAT(STAT_FoliageCaptureTick);
+DEFINE_STAT(STAT_FoliageEllipsoidTick);
+DEFINE_STAT(STAT_FoliageBuildSetup);
+DEFINE_STAT(STAT_FoliageReadback);
+DEFINE_STAT(STAT_FoliageReprojection);
+DEFINE_STAT(STAT_FoliageReprojectTile);
+DEFINE_STAT(STAT_FoliageSurfaceTraces);
+DEFINE_STAT(STAT_FoliageCommitBuild);
+DEFINE_STAT(STAT_FoliageHISMAdd);
+DEFINE_STAT(STAT_FoliageClusterTreeBuild);
+DEFINE_STAT(STAT_FoliageFlipHISMs);
+DEFINE_STAT(STAT_FoliageOffsetInstances);
+DEFINE_STAT(STAT_FoliagePixelsProcessed);
+DEFINE_STAT(STAT_FoliageBytesReadBack);
+DEFINE_STAT(STAT_FoliageTracesIssued);
+DEFINE_STAT(STAT_FoliageInstancesGenerated);
+DEFINE_STAT(STAT_FoliageInstancesCommitted);
+DEFINE_STAT(STAT_FoliageBuildsInFlight);
+
+/**
+ * @brief State of a staging texture readback, shared between the game, render and worker threads.
+ */
+struct FFoliageTextureReadback : public FFoliageReadback
+{
+	FOnRenderTargetRead OnRenderTargetRead;
+	TArray<FFoliagePixelBuffer*> OutData;
+	TArray<FIntRect> Rects;
+	ENamedThreads::Type ExitThread = ENamedThreads::AnyBackgroundThreadNormalTask;
+
+	/** One readback per RT and rect, in that order. */
+	TArray<TUniquePtr<FRHIGPUTextureReadback>> Readbacks;
+	TArray<EPixelFormat> Formats;
+
+	/**
+	 * @brief Render thread: if every copy has landed, copies the raw rows out of the staging textures and hands
+	 * them to the output buffers on ExitThread.
+	 */
+	virtual void Poll(FRHICommandListImmediate& RHICmdList) override;
+};
+
+void FFoliageTextureReadback::Poll(FRHICommandListImmediate& RHICmdList)
+{
+	for (const TUniquePtr<FRHIGPUTextureReadback>& Readback : Readbacks)
+	{
+		if (!Readback->IsReady())
+		{
+			return;
+		}
+	}
+
+	FOLIAGE_SCOPE_CYCLE_COUNTER(STAT_FoliageReadback);
+
+	// The output buffers aren't touched by anything else until OnRenderTargetRead runs, so the rows are copied
+	// straight into them. Their allocations are reused between builds.
+	bool bSuccess = true;
+	for (int32 DataIndex = 0; DataIndex < OutData.Num(); ++DataIndex)
+	{
+		EFoliagePixelEncoding Encoding;
+		if (!FFoliagePixelBuffer::GetEncodingForFormat(Formats[DataIndex], Encoding))
+		{
+			UE_LOG(LogTemp, Error, TEXT("Unsupported render target format %s for foliage readback!"),
+			       GPixelFormats[Formats[DataIndex]].Name);
+			bSuccess = false;
+			continue;
+		}
+
+		FFoliagePixelBuffer& Buffer = *OutData[DataIndex];
+		Buffer.Reset(Encoding);
+		const int32 BytesPerPixel = Buffer.GetBytesPerPixel();
+
+		for (int32 RectIndex = 0; RectIndex < Rects.Num(); ++RectIndex)
+		{
+			const FIntRect& Rect = Rects[RectIndex];
+			const int32 RowBytes = Rect.Width() * BytesPerPixel;
+			FRHIGPUTextureReadback& Readback = *Readbacks[DataIndex * Rects.Num() + RectIndex];
+
+			void* Data = nullptr;
+			int32 RowPitchInPixels = 0;
+			Readback.LockTexture(RHICmdList, Data, RowPitchInPixels);
+
+			if (Data != nullptr)
+			{
+				const int32 Offset = Buffer.Data.AddUninitialized(RowBytes * Rect.Height());
+				for (int32 Row = 0; Row < Rect.Height(); ++Row)
+				{
+					FMemory::Memcpy(Buffer.Data.GetData() + Offset + Row * RowBytes,
+					                static_cast<const uint8*>(Data) + Row * RowPitchInPixels * BytesPerPixel, RowBytes);
+				}
+			}
+			else
+			{
+				bSuccess = false;
+			}
+			Readback.Unlock();
+		}
+	}
+	Readbacks.Empty();
+	bFinished = true;
+
+	AsyncTask(ExitThread, [OnRenderTargetRead = OnRenderTargetRead, OutData = OutData, Formats = Formats, bSuccess]()
+	{
+		for (int32 DataIndex = 0; DataIndex < OutData.Num(); ++DataIndex)
+		{
+			if (Formats[DataIndex] == PF_R8G8B8A8)
+			{
+				OutData[DataIndex]->SwizzleRGBA8ToBGRA8(0);
+			}
+		}
+		OnRenderTargetRead.Execute(bSuccess && OutData[0]->Num() > 0);
+	});
+}
+
+void FFoliageBuildBuffers::Reserve(FIntPoint Size, EPixelFormat ClassificationFormat, EPixelFormat NormalFormat)
+{
+	EFoliagePixelEncoding Encoding;
+	if (FFoliagePixelBuffer::GetEncodingForFormat(ClassificationFormat, Encoding))
+	{
+		ClassificationPixels.Reserve(Encoding, Size.X * Size.Y);
+	}
+	if (FFoliagePixelBuffer::GetEncodingForFormat(NormalFormat, Encoding))
+	{
+		NormalPixels.Reserve(Encoding, Size.X * Size.Y);
+	}
+}
+
+void FFoliageBuildBuffers::ResetTransforms()
+{
+	Tiles.Reset();
+	for (FFoliageTransforms& Tile : TileTransforms)
+	{
+		for (TPair<UFoliageHISM*, FFoliageInstanceChunks>& Pair : Tile.HISMTransformMap)
+		{
+			Pair.Value.Reset();
+		}
+		Tile.PendingTraces.Reset();
+		Tile.PendingInstances.Reset();
+	}
+	for (TPair<UFoliageHISM*, FFoliageInstanceChunks>& Pair : FoliageTransforms.HISMTransformMap)
+	{
+		Pair.Value.Reset();
+	}
+	FoliageTransforms.PendingTraces.Reset();
+	FoliageTransforms.PendingInstances.Reset();
+}
+
+float FFoliageGeometryType::GetDensityFalloff(float Distance) const
+{
+	if (!bUseDensityFalloff)
+	{
+		return 1.f;
+	}
+	const FRichCurve* Curve = DensityFalloff.GetRichCurveConst();
+	if (Curve == nullptr || Curve->GetNumKeys() == 0)
+	{
+		// Fade out across the culling range.
+		const float FadeRange = CullingDistances.Max - CullingDistances.Min;
+		return FadeRange > 0.f
+			? 1.f - FMath::Clamp((Distance - CullingDistances.Min) / FadeRange, 0.f, 1.f)
+			: (Distance <= CullingDistances.Max ? 1.f : 0.f);
+	}
+	return FMath::Max(Curve->Eval(Distance), 0.f);
+}
+
+float FFoliageGeometryType::GetDensityFalloffRange() const
+{
+	if (!bUseDensityFalloff)
+	{
+		return MAX_flt;
+	}
+	const FRichCurve* Curve = DensityFalloff.GetRichCurveConst();
+	if (Curve == nullptr || Curve->GetNumKeys() == 0)
+	{
+		return CullingDistances.Max;
+	}
+	// Constant extrapolation holds the last value past the last key.
+	const FRichCurveKey& LastKey = Curve->GetLastKey();
+	return Curve->PostInfinityExtrap == RCCE_Constant && LastKey.Value <= 0.f ? LastKey.Time : MAX_flt;
+}
+
+// Sets default values
+AFoliageCaptureActor::AFoliageCaptureActor()
+{
+	// Set this actor to call Tick() every frame.  You can turn this off to improve performance if you don't need it.
+	PrimaryActorTick.bCanEverTick = true;
+}
+
+// Called when the game starts or when spawned
+void AFoliageCaptureActor::BeginPlay()
+{
+	Super::BeginPlay();
+	ResetAndCreateHISMComponents();
+
+	FCoreDelegates::PreWorldOriginOffset.AddLambda([&](UWorld* World, FIntVector CurrentOrigin, FIntVector NewOrigin) {
+		bIsRebasing = true;
+		
+		WorldOffset = FVector(NewOrigin - CurrentOrigin);
+		});
+
+	FCoreDelegates::PostWorldOriginOffset.AddLambda([&](UWorld* World, FIntVector CurrentOrigin, FIntVector NewOrigin) {
+		bIsRebasing = false;
+		WorldOffset = FVector(0.);
+	});
+}
+
+// Called every frame
+void AFoliageCaptureActor::Tick(float DeltaTime)
+{
+	FOLIAGE_SCOPE_CYCLE_COUNTER(STAT_FoliageCaptureTick);
+	Super::Tick(DeltaTime);
+
+	CaptureStats.InstancesCommittedLastTick = 0;
+	SET_DWORD_STAT(STAT_FoliageBuildsInFlight, NumBuildsInFlight);
+
+	GetReadbackQueue().Poll();
+
+	if (UpdateStartTime >= 0.0 && LastFinishedGeneration > NumBuildsAtUpdate)
+	{
+		const float Latency = static_cast<float>(FPlatformTime::Seconds() - UpdateStartTime);
+		MeasuredBuildLatency = MeasuredBuildLatency > 0.f ? FMath::Lerp(MeasuredBuildLatency, Latency, 0.25f) : Latency;
+		UpdateStartTime = -1.0;
+	}
+
+	// A commit that was cut short by the time budget resumes on the next tick. Pipelined builds don't hold back
+	// the commits of the builds before them.
+	if ((Ticks > UpdateFoliageAfterNumFrames || bIsCommitInProgress) && (!bIsBuilding || MaxBuildsInFlight > 1))
+	{
+		Ticks = 0;
+		int32 ComponentsUpdated = 0;
+		bIsCommitInProgress = false;
+
+		const bool bUseCommitBudget = CommitBudgetMs > 0.f;
+		const double StartTime = FPlatformTime::Seconds();
+
+		for (TPair<FFoliageGeometryType, TArray<UFoliageHISM*>>& FoliageHISMPair : HISMFoliageMap)
+		{
+			for (UFoliageHISM* FoliageHISM : FoliageHISMPair.Value)
+			{
+				// if (!IsValid(FoliageHISM)) { continue; }
+				if (FoliageHISM->bMarkedForClear)
+				{
+					// When double buffered, the hidden component is cleared and the empty result flipped in later.
+					UFoliageHISM* Back = FoliageHISM->GetBack();
+					Back->CancelAsyncReplace();
+					Back->ClearInstances();
+					FoliageHISM->bBackNeedsClear = false;
+					FoliageHISM->bBackReady = FoliageHISM->Twin != nullptr;
+					FoliageHISM->bCleared = true;
+					FoliageHISM->bMarkedForClear = false;
+					ComponentsUpdated++;
+				}
+				else if (FoliageHISM->bMarkedForAdd)
+				{
+					if (bBuildHISMTreesAsync)
+					{
+						// Cheap on the game thread, the tree is built and swapped in later.
+						CaptureStats.InstancesCommittedLastTick += FoliageHISM->Transforms.Num();
+						INC_DWORD_STAT_BY(STAT_FoliageInstancesCommitted, FoliageHISM->Transforms.Num());
+						FoliageHISM->GetBack()->ReplaceInstancesAsync(MoveTemp(FoliageHISM->Transforms),
+						                                              FoliageHISM->PendingAnchor);
+						FoliageHISM->ResetPendingTransforms();
+						FoliageHISM->bBackNeedsClear = false;
+						FoliageHISM->bBackReady = FoliageHISM->Twin != nullptr;
+						FoliageHISM->bMarkedForAdd = false;
+						FoliageHISM->bCleared = false;
+						ComponentsUpdated++;
+					}
+					else if (bUseCommitBudget)
+					{
+						const double ElapsedMs = (FPlatformTime::Seconds() - StartTime) * 1000.0;
+						if (ElapsedMs >= CommitBudgetMs)
+						{
+							bIsCommitInProgress = true;
+							break;
+						}
+						// Always make some progress, even if the measured cost doesn't leave room for a full chunk.
+						const int32 MaxInstances = FMath::Max(
+							FMath::FloorToInt((CommitBudgetMs - ElapsedMs) / CommitCostPerInstanceMs), MinInstancesPerCommit);
+						if (!CommitHISMTransforms(FoliageHISM, MaxInstances))
+						{
+							bIsCommitInProgress = true;
+							break;
+						}
+					}
+					else
+					{
+						CommitHISMTransforms(FoliageHISM, FoliageHISM->Transforms.Num());
+						ComponentsUpdated++;
+					}
+				}
+				if (!bUseCommitBudget && !bBuildHISMTreesAsync && ComponentsUpdated > MaxComponentsToUpdatePerFrame)
+				{
+					break;
+				}
+			}
+			if (bIsCommitInProgress ||
+				(!bUseCommitBudget && !bBuildHISMTreesAsync && ComponentsUpdated > MaxComponentsToUpdatePerFrame))
+			{
+				break;
+			}
+		}
+
+		if (bFlipPending && !bIsCommitInProgress && CanFlipHISMBuffers())
+		{
+			FlipHISMBuffers();
+		}
+		else if (!bIsCommitInProgress)
+		{
+			// Clear the previous front components off the critical path, one per update.
+			for (TPair<FFoliageGeometryType, TArray<UFoliageHISM*>>& FoliageHISMPair : HISMFoliageMap)
+			{
+				UFoliageHISM* const* Stale = FoliageHISMPair.Value.FindByPredicate(
+					[](const UFoliageHISM* FoliageHISM) { return FoliageHISM->bBackNeedsClear && !FoliageHISM->bMarkedForAdd; });
+				if (Stale != nullptr)
+				{
+					(*Stale)->GetBack()->ClearInstances();
+					(*Stale)->bBackNeedsClear = false;
+					break;
+				}
+			}
+		}
+
+		if (IsValid(Georeference)) {
+			if (AllISMsMarkedAsCleared() && !bInstancesClearedCalled && IsWaiting()) {
+				OnInstancesCleared();
+			}
+		}
+	}
+
+	Ticks++;
+}
+
+FFoliageBuildBuffers* AFoliageCaptureActor::BeginBuild(UTextureRenderTarget2D* FoliageDistributionMap,
+	UTextureRenderTarget2D* NormalAndDepthMap, const FBox& RTWorldBounds, bool bReservePixels,
+	FFoliageReprojectionContext& Context)
+{
+	// The leader builds this actor's foliage.
+	if (bIsMerged)
+	{
+		return nullptr;
+	}
+
+	// Need to check whether the CesiumGeoreference actor and input RTs are valid.
+	if (!IsValid(Georeference))
+	{
+		UE_LOG(LogTemp, Warning, TEXT("Georeference is invalid! Not spawning in foliage"));
+		return nullptr;
+	}
+	if (!IsValid(NormalAndDepthMap) || !IsValid(FoliageDistributionMap))
+	{
+		UE_LOG(LogTemp, Warning, TEXT("Invaid inputs for FoliageCaptureActor!"));
+		return nullptr;
+	}
+	if (FoliageTypes.Num() == 0)
+	{
+		UE_LOG(LogTemp, Warning, TEXT("No foliage types added!"));
+		return nullptr;
+	}
+
+	// Find the geographic bounds of the RT
+	const glm::dvec3 MinGeographic = Georeference->TransformUnrealToLongitudeLatitudeHeight(
+		glm::dvec3(
+			RTWorldBounds.Min.X,
+			RTWorldBounds.Min.Y,
+			RTWorldBounds.Min.Z
+		));
+
+	const glm::dvec3 MaxGeographic = Georeference->TransformUnrealToLongitudeLatitudeHeight(
+		glm::dvec3(
+			RTWorldBounds.Max.X,
+			RTWorldBounds.Max.Y,
+			RTWorldBounds.Max.Z
+		)
+	);
+	const glm::dvec4 GeographicExtents2D = glm::dvec4(
+		MinGeographic.x, MinGeographic.y,
+		MaxGeographic.x, MaxGeographic.y
+	);
+
+	// Setup pixel extraction
+	FFoliageBuildBuffers* Buffers = CanStartBuild() ? AcquireBuildBuffers() : nullptr;
+	if (Buffers == nullptr)
+	{
+		UE_LOG(LogTemp, Warning, TEXT("All build buffers are in use! Not spawning in foliage"));
+		return nullptr;
+	}
+	Buffers->Generation = ++NumBuildsStarted;
+	Buffers->bCancelled = false;
+	Buffers->PendingCellHISMs.Reset();
+	Buffers->StartTime = FPlatformTime::Seconds();
+	++CaptureStats.NumBuildsStarted;
+	++NumBuildsInFlight;
+	bIsBuilding = true;
+	if (bReservePixels)
+	{
+		Buffers->Reserve(FIntPoint(FoliageDistributionMap->SizeX, FoliageDistributionMap->SizeY),
+		                 FoliageDistributionMap->GetFormat(), NormalAndDepthMap->GetFormat());
+	}
+	Buffers->ResetTransforms();
+
+	FFoliagePixelBuffer* ClassificationPixels = &Buffers->ClassificationPixels;
+	FFoliagePixelBuffer* NormalPixels = &Buffers->NormalPixels;
+
+	Context.ClassificationPixels = ClassificationPixels;
+	Context.NormalPixels = NormalPixels;
+	Context.FoliageDistributionMap = FoliageDistributionMap;
+	Context.GeographicExtents2D = GeographicExtents2D;
+	Context.ActorTransform = GetTransform();
+	Context.WorldOffset = WorldOffset;
+
+	Context.MaxFalloffRange = 0.f;
+	for (const FFoliageClassificationType& FoliageType : FoliageTypes)
+	{
+		Context.GeometryTypeOffsets.Add(Context.GeometryTypeSeeds.Num());
+		for (const FFoliageGeometryType& FoliageGeometryType : FoliageType.FoliageTypes)
+		{
+			Context.GeometryTypeSeeds.Add(GetGeometryTypeSeed(FoliageGeometryType));
+			Context.GeometryTypePools.Add(HISMFoliageMap.Find(FoliageGeometryType));
+
+			const float FalloffRange = FoliageGeometryType.GetDensityFalloffRange();
+			Context.GeometryTypeFalloffRanges.Add(FalloffRange);
+			Context.MaxFalloffRange = FMath::Max(Context.MaxFalloffRange, FalloffRange);
+		}
+	}
+
+	if (bPrioritizeVisibleTiles && Viewpoint.bValid)
+	{
+		Context.Viewpoint = Viewpoint;
+		Context.OffscreenDensityScale = bPartitionHISMsByGridCell ? 1.f : OffscreenDensityScale;
+	}
+
+	if (bPartitionHISMsByGridCell)
+	{
+		UpdateGridCells(GeographicExtents2D, Context, *Buffers);
+	}
+	CancelSupersededBuilds(*Buffers);
+	Buffers->InstanceBudget = GetAvailableInstanceBudget(*Buffers);
+	Buffers->BudgetDensityScale = 1.f;
+	Buffers->NumInstancesDroppedByBudget = 0;
+	Context.InstanceBudget = Buffers->InstanceBudget;
+
+	// Only read back the strips that contain rebuilt cells when capturing incrementally.
+	if (bIncrementalCapture && bPartitionHISMsByGridCell)
+	{
+		Context.SetPixelRects(FindExposedPixelRects(FoliageDistributionMap, Context));
+	}
+	else
+	{
+		Context.SetPixelRects({FIntRect(0, 0, FoliageDistributionMap->SizeX, FoliageDistributionMap->SizeY)});
+	}
+
+	if (Context.GetNumPixels() == 0 || (bPartitionHISMsByGridCell && Buffers->PendingCellHISMs.Num() == 0))
+	{
+		// Everything overlaps the previous capture or was restored from the cache, nothing to rebuild.
+		bFlipPending = bFlipPending || (bDoubleBufferHISMs && bCellsRestoredFromCache);
+		FinishBuild(Buffers);
+		return nullptr;
+	}
+
+	return Buffers;
+}
+
+void AFoliageCaptureActor::BuildFoliageTransforms(UTextureRenderTarget2D* FoliageDistributionMap,
+	UTextureRenderTarget2D* NormalAndDepthMap, FBox RTWorldBounds)
+{
+	FOLIAGE_SCOPE_CYCLE_COUNTER(STAT_FoliageBuildSetup);
+
+	// The GPU path never reads the pixels back.
+	const bool bPlaceOnGPU = CanUseGPUPlacement();
+	FFoliageReprojectionContext Context;
+	FFoliageBuildBuffers* Buffers = BeginBuild(FoliageDistributionMap, NormalAndDepthMap, RTWorldBounds, !bPlaceOnGPU,
+	                                           Context);
+	if (Buffers == nullptr)
+	{
+		return;
+	}
+
+	if (bPlaceOnGPU)
+	{
+		BuildFoliageTransformsOnGPU(FoliageDistributionMap, NormalAndDepthMap, Buffers, Context);
+		return;
+	}
+
+	FOnRenderTargetRead OnRenderTargetRead;
+	OnRenderTargetRead.BindLambda([this, Buffers, Context](bool bSuccess)
+	{
+		ReprojectBuildBuffers(Buffers, Context, bSuccess);
+	});
+	// Extract the pixels from the render targets, calling OnRenderTargetRead when complete.
+	ReadRenderTargetPixelsAsync(OnRenderTargetRead, TArray<FTextureRenderTargetResource*>{
+		FoliageDistributionMap->GameThread_GetRenderTargetResource(),
+			NormalAndDepthMap->GameThread_GetRenderTargetResource()
+	}, TArray<FFoliagePixelBuffer*>{
+		&Buffers->ClassificationPixels, &Buffers->NormalPixels
+	}, FReadSurfaceDataFlags(RCM_MinMax, CubeFace_MAX), Context.PixelRects);
+}
+
+void AFoliageCaptureActor::BuildFoliageTransformsFromPixels(const FFoliagePixelBuffer& ClassificationPixels,
+	const FFoliagePixelBuffer& NormalPixels, UTextureRenderTarget2D* FoliageDistributionMap,
+	UTextureRenderTarget2D* NormalAndDepthMap, FBox RTWorldBounds)
+{
+	FOLIAGE_SCOPE_CYCLE_COUNTER(STAT_FoliageBuildSetup);
+
+	if (IsValid(FoliageDistributionMap) && IsValid(NormalAndDepthMap))
+	{
+		const int32 NumPixels = FoliageDistributionMap->SizeX * FoliageDistributionMap->SizeY;
+		if (ClassificationPixels.Num() != NumPixels || NormalPixels.Num() != NumPixels ||
+			NormalAndDepthMap->SizeX != FoliageDistributionMap->SizeX ||
+			NormalAndDepthMap->SizeY != FoliageDistributionMap->SizeY)
+		{
+			UE_LOG(LogTemp, Warning, TEXT("Supplied pixels don't match the size of the render targets!"));
+			return;
+		}
+	}
+
+	FFoliageReprojectionContext Context;
+	FFoliageBuildBuffers* Buffers = BeginBuild(FoliageDistributionMap, NormalAndDepthMap, RTWorldBounds, false,
+	                                           Context);
+	if (Buffers == nullptr)
+	{
+		return;
+	}
+
+	// Lay the pixels out like a readback would, one rect after the other.
+	const int32 SizeX = FoliageDistributionMap->SizeX;
+	auto CopyPixelRects = [&Context, SizeX](const FFoliagePixelBuffer& Source, FFoliagePixelBuffer& Target)
+	{
+		const int32 BytesPerPixel = Source.GetBytesPerPixel();
+		Target.Reset(Source.Encoding);
+		Target.Data.Reserve(Context.GetNumPixels() * BytesPerPixel);
+		for (const FIntRect& PixelRect : Context.PixelRects)
+		{
+			for (int32 Y = PixelRect.Min.Y; Y < PixelRect.Max.Y; ++Y)
+			{
+				Target.Data.Append(Source.Data.GetData() + (Y * SizeX + PixelRect.Min.X) * BytesPerPixel,
+				                   PixelRect.Width() * BytesPerPixel);
+			}
+		}
+	};
+	CopyPixelRects(ClassificationPixels, Buffers->ClassificationPixels);
+	CopyPixelRects(NormalPixels, Buffers->NormalPixels);
+
+	AsyncTask(ENamedThreads::AnyBackgroundThreadNormalTask, [this, Buffers, Context]()
+	{
+		ReprojectBuildBuffers(Buffers, Context, true);
+	});
+}
+
+void AFoliageCaptureActor::ReprojectBuildBuffers(FFoliageBuildBuffers* Buffers,
+	const FFoliageReprojectionContext& Context, bool bSuccess)
+{
+	const int32 TotalPixels = Context.GetNumPixels();
+
+	if (bSuccess && (Buffers->ClassificationPixels.Num() < TotalPixels || Buffers->NormalPixels.Num() < TotalPixels))
+	{
+		UE_LOG(LogTemp, Warning, TEXT("Render target readback returned fewer pixels than expected!"));
+		bSuccess = false;
+	}
+
+	if (!bSuccess || Buffers->bCancelled)
+	{
+		AsyncTask(ENamedThreads::GameThread, [this, Buffers]()
+		{
+			AbandonBuild(Buffers);
+		});
+		return;
+	}
+
+	FOLIAGE_SCOPE_CYCLE_COUNTER(STAT_FoliageReprojection);
+	const double ReprojectionStartTime = FPlatformTime::Seconds();
+	Buffers->ReadbackMs = static_cast<float>((ReprojectionStartTime - Buffers->StartTime) * 1000.0);
+	Buffers->NumPixelsProcessed = TotalPixels;
+	Buffers->NumBytesReadBack = Buffers->ClassificationPixels.Data.Num() + Buffers->NormalPixels.Data.Num();
+	INC_DWORD_STAT_BY(STAT_FoliagePixelsProcessed, TotalPixels);
+	INC_DWORD_STAT_BY(STAT_FoliageBytesReadBack, Buffers->NumBytesReadBack);
+
+	// Split the read regions into tiles, each tile reprojects into its own bucket so no locking is required.
+	const int32 TileSize = FMath::Max(ReprojectionTileSize, 16);
+
+	TArray<FFoliageReprojectionTile>& Tiles = Buffers->Tiles;
+	for (int32 PixelRectIndex = 0; PixelRectIndex < Context.PixelRects.Num(); ++PixelRectIndex)
+	{
+		const FIntRect& PixelRect = Context.PixelRects[PixelRectIndex];
+		for (int32 MinY = PixelRect.Min.Y; MinY < PixelRect.Max.Y; MinY += TileSize)
+		{
+			for (int32 MinX = PixelRect.Min.X; MinX < PixelRect.Max.X; MinX += TileSize)
+			{
+				FFoliageReprojectionTile& Tile = Tiles.AddDefaulted_GetRef();
+				Tile.Rect = FIntRect(MinX, MinY, FMath::Min(MinX + TileSize, PixelRect.Max.X),
+				                     FMath::Min(MinY + TileSize, PixelRect.Max.Y));
+				Tile.PixelRectIndex = PixelRectIndex;
+			}
+		}
+	}
+
+	// Buckets of previous builds keep their allocations, only grow the list if there are more tiles.
+	TArray<FFoliageTransforms>& TileTransforms = Buffers->TileTransforms;
+	if (TileTransforms.Num() < Tiles.Num())
+	{
+		TileTransforms.SetNum(Tiles.Num());
+	}
+
+	TArray<int32>& TileOrder = Buffers->TileOrder;
+	TileOrder.Reset(Tiles.Num());
+	for (int32 TileIndex = 0; TileIndex < Tiles.Num(); ++TileIndex)
+	{
+		TileOrder.Add(TileIndex);
+	}
+	const bool bBudgeted = Context.InstanceBudget < MAX_int32;
+	if (Context.Viewpoint.bValid || bBudgeted)
+	{
+		ParallelFor(Tiles.Num(), [&](int32 TileIndex)
+		{
+			RankReprojectionTile(Tiles[TileIndex], Context);
+		});
+		// Stable, so tiles that rank the same keep their order and the result stays deterministic.
+		Algo::StableSort(TileOrder, [&Tiles](int32 A, int32 B)
+		{
+			if (Tiles[A].bVisible != Tiles[B].bVisible)
+			{
+				return Tiles[A].bVisible;
+			}
+			return Tiles[A].ViewDistance < Tiles[B].ViewDistance;
+		});
+	}
+
+	if (bBudgeted)
+	{
+		// Scale every geometry type down by the same factor, so the expected number of instances fits the budget.
+		TArray<double> ExpectedInstances;
+		ExpectedInstances.SetNumZeroed(Tiles.Num());
+		ParallelFor(Tiles.Num(), [&](int32 TileIndex)
+		{
+			ExpectedInstances[TileIndex] = CountExpectedInstances(Tiles[TileIndex], Context);
+		});
+		double TotalExpectedInstances = 0.0;
+		for (const double Expected : ExpectedInstances)
+		{
+			TotalExpectedInstances += Expected;
+		}
+		if (TotalExpectedInstances > Context.InstanceBudget)
+		{
+			Buffers->BudgetDensityScale = static_cast<float>(Context.InstanceBudget / TotalExpectedInstances);
+			for (FFoliageReprojectionTile& Tile : Tiles)
+			{
+				Tile.DensityScale *= Buffers->BudgetDensityScale;
+			}
+		}
+	}
+
+	// Workers pick up the tiles roughly in order, so the highest ranked ones finish first.
+	ParallelFor(TileOrder.Num(), [&](int32 OrderIndex)
+	{
+		// A superseded build skips its remaining tiles, freeing the workers for the newer one.
+		if (!Buffers->bCancelled)
+		{
+			const int32 TileIndex = TileOrder[OrderIndex];
+			ReprojectTile(TileIndex, Tiles[TileIndex], Context, TileTransforms[TileIndex]);
+		}
+	});
+
+	if (Buffers->bCancelled)
+	{
+		AsyncTask(ENamedThreads::GameThread, [this, Buffers]()
+		{
+			AbandonBuild(Buffers);
+		});
+		return;
+	}
+
+	// Merge the buckets in TileOrder, so the result doesn't depend on thread scheduling and the highest ranked
+	// tiles are committed first. Large buckets are moved rather than copied.
+	FFoliageTransforms& FoliageTransforms = Buffers->FoliageTransforms;
+	int64 NumMergedInstances = 0;
+	for (const int32 TileIndex : TileOrder)
+	{
+		FFoliageTransforms& Tile = TileTransforms[TileIndex];
+
+		// The placement rolls can still come out over the budget. Tiles are merged nearest first, a tile that
+		// doesn't fit in what's left is dropped and the smaller ones after it still get their turn.
+		if (bBudgeted)
+		{
+			int32 NumTileInstances = Tile.PendingInstances.Num();
+			for (const TPair<UFoliageHISM*, FFoliageInstanceChunks>& Pair : Tile.HISMTransformMap)
+			{
+				NumTileInstances += Pair.Value.Num();
+			}
+			if (NumMergedInstances + NumTileInstances > Context.InstanceBudget)
+			{
+				Buffers->NumInstancesDroppedByBudget += NumTileInstances;
+				continue;
+			}
+			NumMergedInstances += NumTileInstances;
+		}
+
+		for (TPair<UFoliageHISM*, FFoliageInstanceChunks>& Pair : Tile.HISMTransformMap)
+		{
+			if (Pair.Value.Num() > 0)
+			{
+				FoliageTransforms.HISMTransformMap.FindOrAdd(Pair.Key).Append(MoveTemp(Pair.Value));
+			}
+		}
+
+		const int32 InstanceOffset = FoliageTransforms.PendingInstances.Num();
+		for (const FFoliagePendingTrace& Trace : Tile.PendingTraces)
+		{
+			FoliageTransforms.PendingTraces.Add_GetRef(Trace).FirstInstance += InstanceOffset;
+		}
+		FoliageTransforms.PendingInstances.Append(Tile.PendingInstances);
+	}
+	Buffers->ActorTransform = Context.ActorTransform;
+	Buffers->WorldOffset = Context.WorldOffset;
+	Buffers->ReprojectionMs = static_cast<float>((FPlatformTime::Seconds() - ReprojectionStartTime) * 1000.0);
+
+	AsyncTask(ENamedThreads::GameThread, [this, Buffers]()
+	{
+		// Raycast aligned instances are committed once all of their traces have landed.
+		if (Buffers->bCancelled || !IssueSurfaceTraces(Buffers))
+		{
+			CommitBuildBuffers(Buffers);
+		}
+	});
+}
+
+bool AFoliageCaptureActor::CanUseGPUPlacement() const
+{
+#if FOLIAGE_GPU_PLACEMENT_ENABLED
+	if (!bUseGPUPlacement || bPartitionHISMsByGridCell || GMaxRHIFeatureLevel < ERHIFeatureLevel::SM5)
+	{
+		return false;
+	}
+	for (const FFoliageClassificationType& FoliageType : FoliageTypes)
+	{
+		if (FoliageType.bAlignToSurfaceWithRaycast)
+		{
+			return false;
+		}
+		for (const FFoliageGeometryType& FoliageGeometryType : FoliageType.FoliageTypes)
+		{
+			if (FoliageGeometryType.bUseDensityFalloff)
+			{
+				return false;
+			}
+		}
+	}
+	return true;
+#else
+	return false;
+#endif
+}
+
+void AFoliageCaptureActor::BuildFoliageTransformsOnGPU(UTextureRenderTarget2D* FoliageDistributionMap,
+	UTextureRenderTarget2D* NormalAndDepthMap, FFoliageBuildBuffers* Buffers, const FFoliageReprojectionContext& Context)
+{
+	EFoliagePixelEncoding ClassificationEncoding;
+	EFoliagePixelEncoding NormalEncoding;
+	if (!FFoliagePixelBuffer::GetEncodingForFormat(FoliageDistributionMap->GetFormat(), ClassificationEncoding) ||
+		!FFoliagePixelBuffer::GetEncodingForFormat(NormalAndDepthMap->GetFormat(), NormalEncoding) ||
+		NormalEncoding == EFoliagePixelEncoding::ClassID8)
+	{
+		UE_LOG(LogTemp, Warning, TEXT("Unsupported render target format for GPU foliage placement!"));
+		AbandonBuild(Buffers);
+		return;
+	}
+
+	const FIntPoint TextureSize(FoliageDistributionMap->SizeX, FoliageDistributionMap->SizeY);
+	const FTransform& ActorTransform = Context.ActorTransform;
+
+	TSharedPtr<FFoliageGPUPlacement, ESPMode::ThreadSafe> Placement = MakeShared<
+		FFoliageGPUPlacement, ESPMode::ThreadSafe>();
+	FFoliageGPUPlacementInputs& Inputs = Placement->Inputs;
+
+	for (int32 ClassIndex = 0; ClassIndex < FoliageTypes.Num(); ++ClassIndex)
+	{
+		const FFoliageClassificationType& FoliageType = FoliageTypes[ClassIndex];
+		const FColor Colour = FoliageType.ColourClassification.QuantizeRound();
+
+		FFoliageGPUClass& Class = Inputs.Classes.AddDefaulted_GetRef();
+		Class.ColourAndID = FIntVector4(Colour.R, Colour.G, Colour.B, FoliageType.ClassID);
+		Class.FirstGeometryType = Context.GeometryTypeOffsets[ClassIndex];
+		Class.NumGeometryTypes = FoliageType.FoliageTypes.Num();
+
+		for (const FFoliageGeometryType& FoliageGeometryType : FoliageType.FoliageTypes)
+		{
+			FFoliageGPUGeometryType& GeometryType = Inputs.GeometryTypes.AddDefaulted_GetRef();
+			GeometryType.Density = FoliageGeometryType.Density;
+			GeometryType.ScaleMin = FoliageGeometryType.Scale.Min;
+			GeometryType.ScaleMax = FoliageGeometryType.Scale.Max;
+			GeometryType.ZOffsetMin = FoliageGeometryType.ZOffset.Min;
+			GeometryType.ZOffsetMax = FoliageGeometryType.ZOffset.Max;
+			GeometryType.Seed = Context.GeometryTypeSeeds[Inputs.GeometryTypes.Num() - 1];
+			GeometryType.Flags = (FoliageGeometryType.bAlignToNormal ? FFoliageGPUGeometryType::AlignToNormal : 0) |
+				(FoliageGeometryType.bRandomYaw ? FFoliageGPUGeometryType::RandomYaw : 0);
+		}
+	}
+
+	// One projection across the whole RT, made relative to the actor so it fits in floats. Locations and up
+	// vectors interpolate linearly, so converting the nodes is the same as converting every pixel.
+	FFoliageTileProjection Projection;
+	InitializeTileProjection(FIntRect(FIntPoint::ZeroValue, TextureSize), Context, Projection);
+
+	const FQuat4f ActorInverseRotation(ActorTransform.GetRotation().Inverse());
+	const double ActorInverseScale = 1.0 / FMath::Max(ActorTransform.GetScale3D().X, SMALL_NUMBER);
+
+	const int32 NumNodes = Projection.SurfaceLocations.Num();
+	Inputs.NodeLocations.SetNumUninitialized(NumNodes);
+	Inputs.NodeUpPerMetre.SetNumUninitialized(NumNodes);
+	Inputs.NodeEastSouthUp.SetNumUninitialized(NumNodes);
+	for (int32 NodeIndex = 0; NodeIndex < NumNodes; ++NodeIndex)
+	{
+		const FVector Location = ActorTransform.InverseTransformPosition(
+			Projection.SurfaceLocations[NodeIndex] + Context.WorldOffset);
+		const FVector UpPerMetre = ActorTransform.InverseTransformVector(Projection.UpPerMetre[NodeIndex]);
+		const FQuat4f EastSouthUp(Projection.EastSouthUp[NodeIndex]);
+
+		Inputs.NodeLocations[NodeIndex] = FVector4f(FVector3f(Location), 0.f);
+		Inputs.NodeUpPerMetre[NodeIndex] = FVector4f(FVector3f(UpPerMetre), 0.f);
+		Inputs.NodeEastSouthUp[NodeIndex] = FVector4f(EastSouthUp.X, EastSouthUp.Y, EastSouthUp.Z, EastSouthUp.W);
+	}
+	Inputs.NodeCount = FIntPoint(Projection.NodesX, Projection.NodesY);
+	Inputs.NodeSpacing = Projection.Spacing;
+
+	Inputs.TextureSize = TextureSize;
+	// The shader can't scale its density down, so the budget only caps the buffer.
+	Inputs.MaxInstances = FMath::Max(FMath::Min(GPUMaxInstances, Context.InstanceBudget), 1);
+	Inputs.bClassificationIsClassID = ClassificationEncoding == EFoliagePixelEncoding::ClassID8;
+	Inputs.bNormalDepthIsPacked = NormalEncoding == EFoliagePixelEncoding::Colour8;
+	Inputs.ColourTolerance = GetQuantizedColourTolerance();
+	Inputs.CaptureElevation = CaptureElevation;
+	Inputs.ActorInverseRotation = FVector4f(ActorInverseRotation.X, ActorInverseRotation.Y, ActorInverseRotation.Z,
+	                                        ActorInverseRotation.W);
+	Inputs.ActorInverseScale = static_cast<float>(ActorInverseScale);
+
+	// Same cells as MakePlacementStream, split into an integer base and a small fractional range.
+	const glm::dvec4& Extents = Context.GeographicExtents2D;
+	const double MinCellX = Extents.x / PlacementCellSizeInDegrees;
+	const double MinCellY = Extents.y / PlacementCellSizeInDegrees;
+	Inputs.BaseCell = FIntPoint(static_cast<int32>(FMath::FloorToInt64(MinCellX)),
+	                            static_cast<int32>(FMath::FloorToInt64(MinCellY)));
+	Inputs.CellOrigin = FVector2f(static_cast<float>(MinCellX - Inputs.BaseCell.X),
+	                              static_cast<float>(MinCellY - Inputs.BaseCell.Y));
+	Inputs.CellRange = FVector2f(static_cast<float>((Extents.z - Extents.x) / PlacementCellSizeInDegrees),
+	                             static_cast<float>((Extents.w - Extents.y) / PlacementCellSizeInDegrees));
+	Inputs.PlacementSeedHash = GetTypeHash(PlacementSeed);
+
+	Placement->OnPlaced = [this, Buffers, Pools = Context.GeometryTypePools, ActorTransform,
+			WorldOffset = Context.WorldOffset](bool bSuccess, TArray<FFoliageGPUInstance>&& Instances,
+			                                   int32 NumDropped)
+		{
+			if (!bSuccess || Buffers->bCancelled)
+			{
+				AsyncTask(ENamedThreads::GameThread, [this, Buffers]()
+				{
+					AbandonBuild(Buffers);
+				});
+				return;
+			}
+
+			FOLIAGE_SCOPE_CYCLE_COUNTER(STAT_FoliageReprojection);
+			const double DistributionStartTime = FPlatformTime::Seconds();
+			Buffers->ReadbackMs = static_cast<float>((DistributionStartTime - Buffers->StartTime) * 1000.0);
+			Buffers->NumPixelsProcessed = 0;
+			Buffers->NumBytesReadBack = Instances.Num() * sizeof(FFoliageGPUInstance);
+			Buffers->NumInstancesDroppedByBudget = NumDropped;
+			INC_DWORD_STAT_BY(STAT_FoliageBytesReadBack, Buffers->NumBytesReadBack);
+
+			FFoliageHISMDistributor Distributor;
+			Distributor.Initialize(Pools, 0);
+
+			TMap<UFoliageHISM*, FFoliageInstanceChunks>& HISMTransformMap = Buffers->FoliageTransforms.HISMTransformMap;
+			for (const FFoliageGPUInstance& Instance : Instances)
+			{
+				UFoliageHISM* TargetHISM = Distributor.Next(Instance.GeometryTypeIndex);
+				if (TargetHISM != nullptr)
+				{
+					HISMTransformMap.FindOrAdd(TargetHISM).Add(FVector(Instance.Location),
+						FQuat(Instance.Rotation.X, Instance.Rotation.Y, Instance.Rotation.Z, Instance.Rotation.W),
+						Instance.Scale);
+				}
+			}
+			Buffers->ActorTransform = ActorTransform;
+			Buffers->WorldOffset = WorldOffset;
+			Buffers->ReprojectionMs = static_cast<float>((FPlatformTime::Seconds() - DistributionStartTime) * 1000.0);
+
+			AsyncTask(ENamedThreads::GameThread, [this, Buffers]()
+			{
+				CommitBuildBuffers(Buffers);
+			});
+		};
+
+	FFoliageGPUPlacement::Dispatch(Placement, FoliageDistributionMap->GameThread_GetRenderTargetResource(),
+	                               NormalAndDepthMap->GameThread_GetRenderTargetResource());
+	GetReadbackQueue().Add(Placement.ToSharedRef());
+}
+
+bool AFoliageCaptureActor::CommitHISMTransforms(UFoliageHISM* FoliageHISM, int32 MaxInstances)
+{
+	FOLIAGE_SCOPE_CYCLE_COUNTER(STAT_FoliageHISMAdd);
+
+	const int32 First = FoliageHISM->NumTransformsCommitted;
+	const int32 Count = FMath::Min(FoliageHISM->Transforms.Num() - First, MaxInstances);
+	CaptureStats.InstancesCommittedLastTick += Count;
+	INC_DWORD_STAT_BY(STAT_FoliageInstancesCommitted, Count);
+
+	// The slot itself, unless it's double buffered.
+	UFoliageHISM* Target = FoliageHISM->GetBack();
+
+	const double StartTime = FPlatformTime::Seconds();
+
+	if (First == 0)
+	{
+#if FOLIAGE_REDUCE_FLICKER_APPROACH_ENABLED
+		Target->ClearInstances();
+#else
+		if (FoliageHISM->bBackNeedsClear)
+		{
+			Target->ClearInstances();
+		}
+#endif
+		FoliageHISM->bBackNeedsClear = false;
+		Target->PreAllocateInstancesMemory(FoliageHISM->Transforms.Num());
+
+		// Anchored components are moved along with their first chunk, while they're still empty.
+		if (FoliageHISM->PendingAnchor.IsSet())
+		{
+			Target->SetWorldTransform(*FoliageHISM->PendingAnchor);
+		}
+	}
+	CommitTransforms.Reset();
+	FoliageHISM->Transforms.ExpandTransforms(First, Count, CommitTransforms);
+	Target->AddInstances(CommitTransforms, false);
+	FoliageHISM->NumTransformsCommitted += Count;
+	FoliageHISM->bCleared = false;
+
+	// Track the cost per instance of the previous commits, so the next frames know how much fits their budget.
+	if (Count > 0)
+	{
+		const double CostPerInstanceMs = (FPlatformTime::Seconds() - StartTime) * 1000.0 / Count;
+		CommitCostPerInstanceMs = FMath::Max(FMath::Lerp(CommitCostPerInstanceMs, CostPerInstanceMs, 0.25), 1e-6);
+	}
+
+	if (FoliageHISM->NumTransformsCommitted < FoliageHISM->Transforms.Num())
+	{
+		return false;
+	}
+	FoliageHISM->bMarkedForAdd = false;
+	FoliageHISM->bBackReady = FoliageHISM->Twin != nullptr;
+	FoliageHISM->ResetPendingTransforms();
+	return true;
+}
+
+bool AFoliageCaptureActor::CanFlipHISMBuffers()
+{
+	for (TPair<FFoliageGeometryType, TArray<UFoliageHISM*>>& FoliageHISMPair : HISMFoliageMap)
+	{
+		for (UFoliageHISM* FoliageHISM : FoliageHISMPair.Value)
+		{
+			if (FoliageHISM->bMarkedForAdd || FoliageHISM->bMarkedForClear ||
+				FoliageHISM->GetBack()->IsReplacingInstances())
+			{
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+void AFoliageCaptureActor::FlipHISMBuffers()
+{
+	FOLIAGE_SCOPE_CYCLE_COUNTER(STAT_FoliageFlipHISMs);
+
+	// Only slots that were part of the build flip, kept grid cells stay as they are.
+	for (TPair<FFoliageGeometryType, TArray<UFoliageHISM*>>& FoliageHISMPair : HISMFoliageMap)
+	{
+		for (UFoliageHISM* FoliageHISM : FoliageHISMPair.Value)
+		{
+			if (FoliageHISM->bBackReady)
+			{
+				FoliageHISM->FlipBuffers();
+			}
+		}
+	}
+	bFlipPending = false;
+}
+
+FFoliageBuildBuffers* AFoliageCaptureActor::AcquireBuildBuffers()
+{
+	for (FFoliageBuildBuffers& Buffers : BuildBuffers)
+	{
+		if (!Buffers.bInUse)
+		{
+			Buffers.bInUse = true;
+			return &Buffers;
+		}
+	}
+	return nullptr;
+}
+
+void AFoliageCaptureActor::ReprojectTile(int32 TileIndex, const FFoliageReprojectionTile& Tile,
+	const FFoliageReprojectionContext& Context, FFoliageTransforms& OutTransforms) const
+{
+	FOLIAGE_SCOPE_CYCLE_COUNTER(STAT_FoliageReprojectTile);
+
+	if (Tile.DensityScale <= 0.f)
+	{
+		return;
+	}
+
+	const FIntRect& TileRect = Tile.Rect;
+
+	FFoliageTileProjection Projection;
+
+	FFoliageHISMDistributor Distributor;
+	Distributor.Initialize(Context.GeometryTypePools, TileIndex);
+
+	for (int32 Y = TileRect.Min.Y; Y < TileRect.Max.Y; ++Y)
+	{
+		for (int32 X = TileRect.Min.X; X < TileRect.Max.X; ++X)
+		{
+			const int32 Index = Context.GetPixelIndex(Tile.PixelRectIndex, X, Y);
+
+			// Classify first, pixels without a foliage type don't need to be reprojected.
+			const int32 ClassIndex = FindClassificationIndex(*Context.ClassificationPixels, Index);
+			if (ClassIndex == INDEX_NONE)
+			{
+				continue;
+			}
+			const FFoliageClassificationType& FoliageType = FoliageTypes[ClassIndex];
+
+			// Extract normals and depth from the pixel array.
+			const FVector4 NormalDepth = Context.NormalPixels->GetNormalDepth(Index);
+			// Convert the RGB channel in the NormalDepth array to a FVector
+			FVector Normal = FVector(NormalDepth.X, NormalDepth.Y, NormalDepth.Z);
+			// Project the Alpha channel in NormalDepth to elevation (in metres) 
+			const double Elevation = GetHeightFromDepth(NormalDepth.W);
+
+			// Project pixel coords to geographic.
+			const FVector GeographicCoords = PixelToGeographicLocation(X, Y, Elevation, Context.FoliageDistributionMap,
+				Context.GeographicExtents2D);
+
+			// When partitioned by grid cell, pixels of cells that are kept from the previous build are skipped.
+			const TArray<UFoliageHISM*>* CellHISMs = nullptr;
+			if (Context.IsPartitioned())
+			{
+				CellHISMs = Context.FindCellTargets(GeographicCoords);
+				if (CellHISMs == nullptr)
+				{
+					continue;
+				}
+			}
+
+			// Then project to UE world coordinates and compute east north up
+			FVector Location;
+			FQuat EastNorthUpEngine;
+
+			if (bUseBatchedProjection)
+			{
+				// Only tiles containing classified pixels pay for sampling the georeference.
+				if (!Projection.bInitialized)
+				{
+					InitializeTileProjection(TileRect, Context, Projection);
+				}
+				Projection.Project(X, Y, Elevation, Location, EastNorthUpEngine);
+			}
+			else
+			{
+				Location = Georeference->TransformLongitudeLatitudeHeightToUnreal(GeographicCoords);
+				EastNorthUpEngine = Georeference->ComputeEastSouthUpToUnreal(Location).ToQuat();
+			}
+
+			// Far pixels are dropped before any random streams are created for them.
+			const float Distance = FVector::Dist(Location + Context.WorldOffset, Context.ActorTransform.GetLocation());
+			if (Distance > Context.MaxFalloffRange)
+			{
+				continue;
+			}
+
+			// Raycast aligned pixels are only traced if at least one geometry type spawns, their instances are
+			// resolved on the game thread once the trace has landed.
+			FFoliagePendingTrace* PendingTrace = nullptr;
+
+			// Iterate through the mesh types inside FoliageType
+			for (int32 GeometryIndex = 0; GeometryIndex < FoliageType.FoliageTypes.Num(); ++GeometryIndex)
+			{
+				const FFoliageGeometryType& FoliageGeometryType = FoliageType.FoliageTypes[GeometryIndex];
+				const int32 GeometryTypeIndex = Context.GeometryTypeOffsets[ClassIndex] + GeometryIndex;
+
+				if (Distance > Context.GeometryTypeFalloffRanges[GeometryTypeIndex])
+				{
+					continue;
+				}
+
+				// Seeded from the geographic cell, so the same location always yields the same foliage.
+				FRandomStream Stream = MakePlacementStream(GeographicCoords,
+					Context.GeometryTypeSeeds[GeometryTypeIndex]);
+
+				// The falloff scales the threshold of the same roll, so a lower falloff only removes instances.
+				const float Density = Tile.DensityScale * (FoliageGeometryType.bUseDensityFalloff
+					? FoliageGeometryType.Density * FoliageGeometryType.GetDensityFalloff(Distance)
+					: FoliageGeometryType.Density);
+				if (Stream.FRand() >= Density)
+				{
+					continue;
+				}
+
+				// Find scale, yaw and offset
+				FFoliagePendingInstance Instance;
+				Instance.bAlignToNormal = FoliageGeometryType.bAlignToNormal;
+				Instance.Scale = FoliageGeometryType.Scale.Interpolate(Stream.FRand());
+				Instance.Yaw = FoliageGeometryType.bRandomYaw ? Stream.FRandRange(0.0, 360.0) : -1.f;
+				Instance.ZOffset = FoliageGeometryType.ZOffset.Interpolate(Stream.FRand());
+
+				UFoliageHISM* TargetHISM = nullptr;
+
+				if (FoliageType.bAlignToSurfaceWithRaycast)
+				{
+					if (PendingTrace == nullptr)
+					{
+						const double DepthBelowCapture = FMath::Max(CaptureElevation - Elevation, 0.0) * 100.0;
+
+						PendingTrace = &OutTransforms.PendingTraces.AddDefaulted_GetRef();
+						PendingTrace->Location = Location;
+						PendingTrace->Normal = Normal;
+						PendingTrace->EastSouthUp = EastNorthUpEngine;
+						PendingTrace->TraceStart = Location + EastNorthUpEngine.GetUpVector() * DepthBelowCapture;
+						PendingTrace->TraceEnd = Location - EastNorthUpEngine.GetUpVector() * RaycastDepthMargin * 100.f;
+						PendingTrace->FirstInstance = OutTransforms.PendingInstances.Num();
+					}
+					TargetHISM = CellHISMs ? (*CellHISMs)[GeometryTypeIndex] : Distributor.Next(GeometryTypeIndex);
+					if (TargetHISM != nullptr)
+					{
+						Instance.HISM = TargetHISM;
+						OutTransforms.PendingInstances.Add(Instance);
+						PendingTrace->NumInstances++;
+					}
+					continue;
+				}
+
+				// Add our transform, and make it relative to the actor.
+				FTransform NewTransform;
+				if (MakeInstanceTransform(Location + Context.WorldOffset, Normal, EastNorthUpEngine, Instance,
+				                          Context.ActorTransform, NewTransform))
+				{
+					TargetHISM = CellHISMs
+						? (*CellHISMs)[GeometryTypeIndex]
+						: Distributor.Next(GeometryTypeIndex);
+					if (TargetHISM != nullptr)
+					{
+						OutTransforms.HISMTransformMap.FindOrAdd(TargetHISM).Add(NewTransform);
+					}
+				}
+			}
+		}
+	}
+}
+
+void AFoliageCaptureActor::RankReprojectionTile(FFoliageReprojectionTile& Tile,
+	const FFoliageReprojectionContext& Context) const
+{
+	const FIntRect& Rect = Tile.Rect;
+	const FIntPoint Centre = Rect.Min + Rect.Size() / 2;
+	const FVector4 NormalDepth = Context.NormalPixels->GetNormalDepth(
+		Context.GetPixelIndex(Tile.PixelRectIndex, Centre.X, Centre.Y));
+	const double Elevation = GetHeightFromDepth(NormalDepth.W);
+
+	const FVector CentreLocation = ProjectPixelToEngine(Centre.X, Centre.Y, Elevation, Context) + Context.WorldOffset;
+	if (!Context.Viewpoint.bValid)
+	{
+		Tile.ViewDistance = FVector::Dist(CentreLocation, Context.ActorTransform.GetLocation());
+		return;
+	}
+
+	const double Radius = FVector::Dist(ProjectPixelToEngine(Rect.Min.X, Rect.Min.Y, Elevation, Context),
+	                                    ProjectPixelToEngine(Rect.Max.X, Rect.Max.Y, Elevation, Context)) / 2;
+
+	Tile.ViewDistance = FVector::Dist(CentreLocation, Context.Viewpoint.Location);
+	Tile.bVisible = Context.Viewpoint.IsVisible(CentreLocation, Radius,
+	                                            FFoliageViewpoint::GetHorizonDistance(Elevation));
+	Tile.DensityScale = Tile.bVisible ? 1.f : Context.OffscreenDensityScale;
+}
+
+double AFoliageCaptureActor::CountExpectedInstances(const FFoliageReprojectionTile& Tile,
+	const FFoliageReprojectionContext& Context) const
+{
+	if (Tile.DensityScale <= 0.f)
+	{
+		return 0.0;
+	}
+
+	const FIntRect& TileRect = Tile.Rect;
+	FFoliageTileProjection Projection;
+
+	// Skips the same pixels as ReprojectTile, so kept cells and far pixels don't count against the budget.
+	double Expected = 0.0;
+	for (int32 Y = TileRect.Min.Y; Y < TileRect.Max.Y; ++Y)
+	{
+		for (int32 X = TileRect.Min.X; X < TileRect.Max.X; ++X)
+		{
+			const int32 Index = Context.GetPixelIndex(Tile.PixelRectIndex, X, Y);
+			const int32 ClassIndex = FindClassificationIndex(*Context.ClassificationPixels, Index);
+			if (ClassIndex == INDEX_NONE)
+			{
+				continue;
+			}
+			const FFoliageClassificationType& FoliageType = FoliageTypes[ClassIndex];
+
+			const double Elevation = GetHeightFromDepth(Context.NormalPixels->GetNormalDepth(Index).W);
+			if (Context.IsPartitioned())
+			{
+				const FVector GeographicCoords = PixelToGeographicLocation(X, Y, Elevation,
+					Context.FoliageDistributionMap, Context.GeographicExtents2D);
+				if (Context.FindCellTargets(GeographicCoords) == nullptr)
+				{
+					continue;
+				}
+			}
+
+			FVector Location;
+			if (bUseBatchedProjection)
+			{
+				if (!Projection.bInitialized)
+				{
+					InitializeTileProjection(TileRect, Context, Projection);
+				}
+				FQuat EastSouthUp;
+				Projection.Project(X, Y, Elevation, Location, EastSouthUp);
+			}
+			else
+			{
+				Location = ProjectPixelToEngine(X, Y, Elevation, Context);
+			}
+
+			const float Distance = FVector::Dist(Location + Context.WorldOffset, Context.ActorTransform.GetLocation());
+			if (Distance > Context.MaxFalloffRange)
+			{
+				continue;
+			}
+
+			for (int32 GeometryIndex = 0; GeometryIndex < FoliageType.FoliageTypes.Num(); ++GeometryIndex)
+			{
+				const FFoliageGeometryType& FoliageGeometryType = FoliageType.FoliageTypes[GeometryIndex];
+				if (Distance > Context.GeometryTypeFalloffRanges[Context.GeometryTypeOffsets[ClassIndex] + GeometryIndex])
+				{
+					continue;
+				}
+				const float Density = FoliageGeometryType.bUseDensityFalloff
+					? FoliageGeometryType.Density * FoliageGeometryType.GetDensityFalloff(Distance)
+					: FoliageGeometryType.Density;
+				Expected += FMath::Clamp(Density, 0.f, 1.f);
+			}
+		}
+	}
+	return Expected * Tile.DensityScale;
+}
+
+bool AFoliageCaptureActor::MakeInstanceTransform(const FVector& Location, const FVector& Normal,
+	const FQuat& EastSouthUp, const FFoliagePendingInstance& Instance, const FTransform& ActorTransform,
+	FTransform& OutTransform)
+{
+	FRotator Rotation;
+
+	if (Instance.bAlignToNormal)
+	{
+		Rotation = UKismetMathLibrary::MakeRotFromZ(Normal);
+	}
+	else
+	{
+		Rotation = EastSouthUp.Rotator();
+	}
+
+	// Apply a random angle to the rotation yaw if RandomYaw is true.
+	if (Instance.Yaw >= 0.f)
+	{
+		Rotation = UKismetMathLibrary::RotatorFromAxisAndAngle(
+			Rotation.Quaternion().GetUpVector(), Instance.Yaw);
+	}
+
+	OutTransform = FTransform(
+		Rotation,
+		Location + (Rotation.Quaternion().GetUpVector() * Instance.ZOffset), FVector(Instance.Scale)
+	).GetRelativeTransform(ActorTransform);
+
+	return OutTransform.IsRotationNormalized();
+}
+
+TArray<FIntRect> AFoliageCaptureActor::FindExposedPixelRects(UTextureRenderTarget2D* RT,
+	const FFoliageReprojectionContext& Context) const
+{
+	const FIntRect FullRect(0, 0, RT->SizeX, RT->SizeY);
+
+	// Bounding box (in cell coordinates, max exclusive) of the cells that are kept.
+	FIntRect KeptCells(Context.MinCell + Context.NumCells, Context.MinCell);
+	for (int32 CellY = 0; CellY < Context.NumCells.Y; ++CellY)
+	{
+		for (int32 CellX = 0; CellX < Context.NumCells.X; ++CellX)
+		{
+			if (Context.CellTargets[CellY * Context.NumCells.X + CellX].Num() == 0)
+			{
+				KeptCells.Include(Context.MinCell + FIntPoint(CellX, CellY));
+				KeptCells.Include(Context.MinCell + FIntPoint(CellX + 1, CellY + 1));
+			}
+		}
+	}
+	if (KeptCells.Min.X >= KeptCells.Max.X || KeptCells.Min.Y >= KeptCells.Max.Y)
+	{
+		return {FullRect};
+	}
+
+	// If a rebuilt cell lies inside the box, the kept area isn't a rectangle. This only happens when the
+	// capture jumps, so just read everything.
+	for (int32 CellY = KeptCells.Min.Y; CellY < KeptCells.Max.Y; ++CellY)
+	{
+		for (int32 CellX = KeptCells.Min.X; CellX < KeptCells.Max.X; ++CellX)
+		{
+			const int32 Index = (CellY - Context.MinCell.Y) * Context.NumCells.X + (CellX - Context.MinCell.X);
+			if (Context.CellTargets[Index].Num() > 0)
+			{
+				return {FullRect};
+			}
+		}
+	}
+
+	// Pixel rect of the kept area, shrunk by a pixel so every pixel inside is guaranteed to be in a kept cell.
+	// Pixel X follows latitude and pixel Y follows longitude, so take the min and max of both corners.
+	const FIntPoint CornerA = GeographicToPixelLocation(KeptCells.Min.X * Context.GridCellSize.X,
+		KeptCells.Min.Y * Context.GridCellSize.Y, RT, Context.GeographicExtents2D);
+	const FIntPoint CornerB = GeographicToPixelLocation(KeptCells.Max.X * Context.GridCellSize.X,
+		KeptCells.Max.Y * Context.GridCellSize.Y, RT, Context.GeographicExtents2D);
+
+	FIntRect Kept(
+		FMath::Min(CornerA.X, CornerB.X) + 1, FMath::Min(CornerA.Y, CornerB.Y) + 1,
+		FMath::Max(CornerA.X, CornerB.X) - 1, FMath::Max(CornerA.Y, CornerB.Y) - 1);
+	Kept.Clip(FullRect);
+
+	if (Kept.Width() <= 0 || Kept.Height() <= 0)
+	{
+		return {FullRect};
+	}
+
+	// The exposed strips around the kept area, these never overlap. Pixels in them that still belong to kept
+	// cells are skipped during reprojection.
+	TArray<FIntRect> Strips;
+	const FIntRect Candidates[] = {
+		FIntRect(0, 0, FullRect.Max.X, Kept.Min.Y),
+		FIntRect(0, Kept.Max.Y, FullRect.Max.X, FullRect.Max.Y),
+		FIntRect(0, Kept.Min.Y, Kept.Min.X, Kept.Max.Y),
+		FIntRect(Kept.Max.X, Kept.Min.Y, FullRect.Max.X, Kept.Max.Y)
+	};
+	for (const FIntRect& Candidate : Candidates)
+	{
+		if (Candidate.Width() > 0 && Candidate.Height() > 0)
+		{
+			Strips.Add(Candidate);
+		}
+	}
+	return Strips;
+}
+
+void AFoliageCaptureActor::ClearFoliageInstances()
+{
+	for (TPair<FIntPoint, FFoliageGridCell>& Pair : GridCells)
+	{
+		RecycleGridCell(Pair.Value);
+	}
+	GridCells.Reset();
+
+	// Ensure the transforms array on the HISMs are cleared before building.
+	for (TPair<FFoliageGeometryType, TArray<UFoliageHISM*>>& FoliageHISMPair : HISMFoliageMap)
+	{
+		for (UFoliageHISM* FoliageHISM : FoliageHISMPair.Value)
+		{
+			if (IsValid(FoliageHISM))
+			{
+				FoliageHISM->ResetPendingTransforms();
+				FoliageHISM->bMarkedForClear = true;
+			}
+		}
+	}
+}
+
+void AFoliageCaptureActor::ResetAndCreateHISMComponents()
+{
+	BuildClassificationLUT();
+
+	// Cell HISMs are also registered in HISMFoliageMap, so they are destroyed below.
+	GridCells.Empty();
+	FreeCellHISMs.Empty();
+	GridCellSizeInDegrees = FVector2D::ZeroVector;
+
+	// The scratch buckets are keyed by HISM, drop them along with the components. Builds in flight target the old
+	// components, so they must not commit.
+	for (FFoliageBuildBuffers& Buffers : BuildBuffers)
+	{
+		Buffers.bCancelled = Buffers.bInUse;
+		if (!Buffers.bInUse)
+		{
+			Buffers.TileTransforms.Empty();
+			Buffers.FoliageTransforms.HISMTransformMap.Empty();
+			Buffers.PendingCellHISMs.Empty();
+		}
+	}
+
+	for (FFoliageClassificationType& FoliageType : FoliageTypes)
+	{
+		for (FFoliageGeometryType& FoliageGeometryType : FoliageType.FoliageTypes)
+		{
+			if (FoliageGeometryType.Mesh == nullptr) { continue; }
+			if (HISMFoliageMap.Contains(FoliageGeometryType))
+			{
+				for (UFoliageHISM* HISM : HISMFoliageMap[FoliageGeometryType])
+				{
+					if (IsValid(HISM))
+					{
+						if (IsValid(HISM->Twin))
+						{
+							HISM->Twin->DestroyComponent();
+						}
+						HISM->DestroyComponent();
+					}
+				}
+				HISMFoliageMap[FoliageGeometryType].Empty();
+			}
+			HISMFoliageMap.Remove(FoliageGeometryType);
+
+			// Grid cells create their own HISMs as they enter the capture.
+			if (bPartitionHISMsByGridCell)
+			{
+				HISMFoliageMap.Add(FoliageGeometryType);
+				continue;
+			}
+
+			for (int32 i = 0; i < FoliageType.PooledHISMsToCreatePerFoliageType; ++i)
+			{
+				UFoliageHISM* HISM = CreateHISM(FoliageGeometryType);
+				if (!HISMFoliageMap.Contains(FoliageGeometryType))
+				{
+					HISMFoliageMap.Add(FoliageGeometryType, TArray<UFoliageHISM*>{HISM});
+				}
+				else
+				{
+					HISMFoliageMap[FoliageGeometryType].Add(HISM);
+				}
+			}
+		}
+	}
+}
+
+UFoliageHISM* AFoliageCaptureActor::CreateHISM(const FFoliageGeometryType& FoliageGeometryType)
+{
+	UFoliageHISM* HISM = NewObject<UFoliageHISM>(this);
+	HISM->SetupAttachment(GetRootComponent());
+	HISM->RegisterComponent();
+
+	HISM->SetStaticMesh(FoliageGeometryType.Mesh);
+	HISM->SetCollisionEnabled(FoliageGeometryType.bCollidesWithWorld
+		? ECollisionEnabled::QueryAndPhysics
+		: ECollisionEnabled::NoCollision);
+	HISM->SetCullDistances(FoliageGeometryType.CullingDistances.Min, FoliageGeometryType.CullingDistances.Max);
+
+	// This may cause a slight hitch when enabled.
+	HISM->bAffectDistanceFieldLighting = FoliageGeometryType.bAffectsDistanceFieldLighting;
+	HISM->SetUsingAbsoluteLocation(bAnchorHISMs);
+	HISM->SetUsingAbsoluteRotation(bAnchorHISMs);
+	HISM->SetUsingAbsoluteScale(bAnchorHISMs);
+
+	if (bDoubleBufferHISMs)
+	{
+		UFoliageHISM* Twin = NewObject<UFoliageHISM>(this);
+		Twin->SetupAttachment(GetRootComponent());
+		Twin->SetStaticMesh(FoliageGeometryType.Mesh);
+		Twin->SetCollisionEnabled(ECollisionEnabled::NoCollision);
+		Twin->SetCullDistances(FoliageGeometryType.CullingDistances.Min, FoliageGeometryType.CullingDistances.Max);
+		Twin->bAffectDistanceFieldLighting = FoliageGeometryType.bAffectsDistanceFieldLighting;
+		Twin->SetVisibility(false);
+		Twin->SetUsingAbsoluteLocation(bAnchorHISMs);
+		Twin->SetUsingAbsoluteRotation(bAnchorHISMs);
+		Twin->SetUsingAbsoluteScale(bAnchorHISMs);
+		Twin->RegisterComponent();
+		HISM->Twin = Twin;
+	}
+	return HISM;
+}
+
+void AFoliageCaptureActor::UpdateGridCells(const glm::dvec4& GeographicExtents2D,
+	FFoliageReprojectionContext& OutContext, FFoliageBuildBuffers& Buffers)
+{
+	const double MinLongitude = FMath::Min(GeographicExtents2D.x, GeographicExtents2D.z);
+	const double MaxLongitude = FMath::Max(GeographicExtents2D.x, GeographicExtents2D.z);
+	const double MinLatitude = FMath::Min(GeographicExtents2D.y, GeographicExtents2D.w);
+	const double MaxLatitude = FMath::Max(GeographicExtents2D.y, GeographicExtents2D.w);
+
+	const FIntPoint CellsPerCapture(FMath::Max(GridSize.X, 1), FMath::Max(GridSize.Y, 1));
+
+	// The cell size is fixed on the first build, so cell keys stay the same while the capture moves. It is only
+	// recomputed if the capture size changed so much that the grid no longer makes sense.
+	const auto CountCells = [&]()
+	{
+		const FIntPoint Min = FFoliageGridCell::FromGeographic(MinLongitude, MinLatitude, GridCellSizeInDegrees);
+		const FIntPoint Max = FFoliageGridCell::FromGeographic(MaxLongitude, MaxLatitude, GridCellSizeInDegrees);
+		return (Max.X - Min.X + 1) * (Max.Y - Min.Y + 1);
+	};
+	if (GridCellSizeInDegrees.IsZero() || CountCells() > 4 * (CellsPerCapture.X + 1) * (CellsPerCapture.Y + 1))
+	{
+		for (TPair<FIntPoint, FFoliageGridCell>& Pair : GridCells)
+		{
+			RecycleGridCell(Pair.Value);
+		}
+		GridCells.Reset();
+
+		GridCellSizeInDegrees = FVector2D(
+			FMath::Max(MaxLongitude - MinLongitude, KINDA_SMALL_NUMBER) / CellsPerCapture.X,
+			FMath::Max(MaxLatitude - MinLatitude, KINDA_SMALL_NUMBER) / CellsPerCapture.Y);
+
+		// Cached cells are only found again if the grid doesn't depend on where the first capture was.
+		if (CanUseTileCache())
+		{
+			GridCellSizeInDegrees.X = FMath::Pow(2.0, FMath::FloorToDouble(FMath::Log2(GridCellSizeInDegrees.X)));
+			GridCellSizeInDegrees.Y = FMath::Pow(2.0, FMath::FloorToDouble(FMath::Log2(GridCellSizeInDegrees.Y)));
+		}
+	}
+
+	const FIntPoint MinCell = FFoliageGridCell::FromGeographic(MinLongitude, MinLatitude, GridCellSizeInDegrees);
+	const FIntPoint MaxCell = FFoliageGridCell::FromGeographic(MaxLongitude, MaxLatitude, GridCellSizeInDegrees);
+
+	// Recycle the cells that left the capture.
+	for (auto It = GridCells.CreateIterator(); It; ++It)
+	{
+		const FIntPoint& Key = It.Key();
+		if (Key.X < MinCell.X || Key.X > MaxCell.X || Key.Y < MinCell.Y || Key.Y > MaxCell.Y)
+		{
+			RecycleGridCell(It.Value());
+			It.RemoveCurrent();
+		}
+	}
+
+	int32 NumGeometryTypes = 0;
+	for (const FFoliageClassificationType& FoliageType : FoliageTypes)
+	{
+		NumGeometryTypes += FoliageType.FoliageTypes.Num();
+	}
+	FreeCellHISMs.SetNum(NumGeometryTypes);
+
+	OutContext.GridCellSize = GridCellSizeInDegrees;
+	OutContext.MinCell = MinCell;
+	OutContext.NumCells = MaxCell - MinCell + FIntPoint(1, 1);
+	OutContext.CellTargets.SetNum(OutContext.NumCells.X * OutContext.NumCells.Y);
+
+	const bool bUseCache = CanUseTileCache();
+	bCellsRestoredFromCache = false;
+	if (bUseCache)
+	{
+		const FString DiskDirectory = FPaths::IsRelative(TileCacheDirectory)
+			? FPaths::Combine(FPaths::ProjectSavedDir(), TileCacheDirectory)
+			: TileCacheDirectory;
+		const FString PrebakedDirectory = FPaths::IsRelative(PrebakedTileDirectory)
+			? FPaths::Combine(FPaths::ProjectContentDir(), PrebakedTileDirectory)
+			: PrebakedTileDirectory;
+		TileCache.Configure(MaxCachedTiles, bUseDiskTileCache ? DiskDirectory : FString(),
+		                    PrebakedTileDirectory.IsEmpty() ? FString() : PrebakedDirectory);
+		TileCacheSettingsHash = GetTileCacheSettingsHash();
+		TileCacheResolution = FIntPoint(OutContext.FoliageDistributionMap->SizeX, OutContext.FoliageDistributionMap->SizeY);
+	}
+
+	for (int32 CellY = MinCell.Y; CellY <= MaxCell.Y; ++CellY)
+	{
+		for (int32 CellX = MinCell.X; CellX <= MaxCell.X; ++CellX)
+		{
+			FFoliageGridCell* Cell = GridCells.Find(FIntPoint(CellX, CellY));
+
+			// Complete cells keep their instances, their target stays empty so reprojection skips them.
+			if (Cell != nullptr && Cell->bComplete)
+			{
+				continue;
+			}
+
+			if (Cell == nullptr)
+			{
+				Cell = &GridCells.Add(FIntPoint(CellX, CellY));
+
+				int32 GeometryTypeIndex = 0;
+				for (const FFoliageClassificationType& FoliageType : FoliageTypes)
+				{
+					for (const FFoliageGeometryType& FoliageGeometryType : FoliageType.FoliageTypes)
+					{
+						UFoliageHISM* HISM = nullptr;
+						if (FoliageGeometryType.Mesh != nullptr)
+						{
+							if (FreeCellHISMs[GeometryTypeIndex].Num() > 0)
+							{
+								HISM = FreeCellHISMs[GeometryTypeIndex].Pop(false);
+							}
+							else
+							{
+								HISM = CreateHISM(FoliageGeometryType);
+								HISMFoliageMap.FindOrAdd(FoliageGeometryType).Add(HISM);
+							}
+						}
+						Cell->HISMs.Add(HISM);
+						GeometryTypeIndex++;
+					}
+				}
+			}
+
+			Cell->bComplete =
+				CellX * GridCellSizeInDegrees.X >= MinLongitude && (CellX + 1) * GridCellSizeInDegrees.X <= MaxLongitude &&
+				CellY * GridCellSizeInDegrees.Y >= MinLatitude && (CellY + 1) * GridCellSizeInDegrees.Y <= MaxLatitude;
+
+			// Restored cells are complete, their target stays empty like the target of a kept cell.
+			if (bUseCache && Cell->bComplete &&
+				RestoreGridCellFromCache({FIntPoint(CellX, CellY), TileCacheResolution, TileCacheSettingsHash}, *Cell))
+			{
+				continue;
+			}
+
+			// The cell is rebuilt, discard anything still waiting to be added from an earlier build.
+			for (UFoliageHISM* HISM : Cell->HISMs)
+			{
+				if (HISM != nullptr)
+				{
+					HISM->ResetPendingTransforms();
+					HISM->bMarkedForAdd = false;
+					HISM->BuildGeneration = Buffers.Generation;
+					Buffers.PendingCellHISMs.Add(HISM);
+				}
+			}
+
+			OutContext.CellTargets[(CellY - MinCell.Y) * OutContext.NumCells.X + (CellX - MinCell.X)] = Cell->HISMs;
+		}
+	}
+}
+
+void AFoliageCaptureActor::InvalidatePendingGridCells(const FFoliageBuildBuffers& Buffers)
+{
+	// Cells a newer build took over are left to that build.
+	for (TPair<FIntPoint, FFoliageGridCell>& Pair : GridCells)
+	{
+		for (UFoliageHISM* HISM : Pair.Value.HISMs)
+		{
+			if (HISM != nullptr && HISM->BuildGeneration == Buffers.Generation && Buffers.PendingCellHISMs.Contains(HISM))
+			{
+				Pair.Value.bComplete = false;
+				break;
+			}
+		}
+	}
+}
+
+void AFoliageCaptureActor::RecycleGridCell(FFoliageGridCell& Cell)
+{
+	for (int32 GeometryTypeIndex = 0; GeometryTypeIndex < Cell.HISMs.Num(); ++GeometryTypeIndex)
+	{
+		UFoliageHISM* HISM = Cell.HISMs[GeometryTypeIndex];
+		if (HISM == nullptr)
+		{
+			continue;
+		}
+		HISM->ResetPendingTransforms();
+		HISM->bMarkedForAdd = false;
+		HISM->bMarkedForClear = true;
+		HISM->BuildGeneration = INDEX_NONE;
+
+		if (FreeCellHISMs.IsValidIndex(GeometryTypeIndex))
+		{
+			FreeCellHISMs[GeometryTypeIndex].Add(HISM);
+		}
+	}
+	Cell.HISMs.Empty();
+}
+
+bool AFoliageCaptureActor::CanUseTileCache() const
+{
+	if (!bUseTileCache || !bPartitionHISMsByGridCell || !bAnchorHISMs)
+	{
+		return false;
+	}
+	for (const FFoliageClassificationType& FoliageType : FoliageTypes)
+	{
+		for (const FFoliageGeometryType& FoliageGeometryType : FoliageType.FoliageTypes)
+		{
+			if (FoliageGeometryType.bUseDensityFalloff)
+			{
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+uint32 AFoliageCaptureActor::GetTileCacheSettingsHash() const
+{
+	uint32 Hash = GetTypeHash(GridCellSizeInDegrees);
+	Hash = HashCombine(Hash, GetTypeHash(PlacementSeed));
+	Hash = HashCombine(Hash, GetTypeHash(PlacementCellSizeInDegrees));
+	Hash = HashCombine(Hash, GetTypeHash(CaptureWidth));
+	Hash = HashCombine(Hash, GetTypeHash(CaptureElevation));
+	Hash = HashCombine(Hash, GetTypeHash(ClassificationColourTolerance));
+	Hash = HashCombine(Hash, GetTypeHash(RaycastDepthMargin));
+
+	for (const FFoliageClassificationType& FoliageType : FoliageTypes)
+	{
+		Hash = HashCombine(Hash, GetTypeHash(FoliageType.ColourClassification));
+		Hash = HashCombine(Hash, GetTypeHash(FoliageType.ClassID));
+		Hash = HashCombine(Hash, GetTypeHash(FoliageType.bAlignToSurfaceWithRaycast));
+		Hash = HashCombine(Hash, GetTypeHash(FoliageType.FoliageTypes.Num()));
+
+		for (const FFoliageGeometryType& FoliageGeometryType : FoliageType.FoliageTypes)
+		{
+			Hash = HashCombine(Hash, GetGeometryTypeSeed(FoliageGeometryType));
+			Hash = HashCombine(Hash, GetTypeHash(FoliageGeometryType.bRandomYaw));
+			Hash = HashCombine(Hash, GetTypeHash(FoliageGeometryType.bAlignToNormal));
+		}
+	}
+	return Hash;
+}
+
+uint32 AFoliageCaptureActor::GetCaptureMergeKey() const
+{
+	uint32 Hash = HashCombine(GetTileCacheSettingsHash(), GetTypeHash(GetClass()));
+	Hash = HashCombine(Hash, GetTypeHash(GridSize));
+	Hash = HashCombine(Hash, GetTypeHash(bPartitionHISMsByGridCell));
+	Hash = HashCombine(Hash, GetTypeHash(bAnchorHISMs));
+	Hash = HashCombine(Hash, GetTypeHash(GetInstanceBudget()));
+
+	for (const FFoliageClassificationType& FoliageType : FoliageTypes)
+	{
+		for (const FFoliageGeometryType& FoliageGeometryType : FoliageType.FoliageTypes)
+		{
+			Hash = HashCombine(Hash, GetTypeHash(FoliageGeometryType));
+			Hash = HashCombine(Hash, GetTypeHash(FoliageGeometryType.CullingDistances));
+			Hash = HashCombine(Hash, GetTypeHash(FoliageGeometryType.bUseDensityFalloff));
+			Hash = HashCombine(Hash, GetTypeHash(FoliageGeometryType.GetDensityFalloffRange()));
+		}
+	}
+	return Hash;
+}
+
+void AFoliageCaptureActor::MergeInto(AFoliageCaptureActor* Leader)
+{
+	MergedInto = Leader;
+	if (Leader == nullptr)
+	{
+		// Nothing is shown any more, so the next update captures wherever the view is.
+		bNeedsCapture = bNeedsCapture || bIsMerged;
+		bIsMerged = false;
+		return;
+	}
+	if (bIsMerged)
+	{
+		return;
+	}
+	bIsMerged = true;
+	bIsWaiting = false;
+
+	// The leader shows the same instances, so this actor keeps nothing of its own.
+	for (FFoliageBuildBuffers& Buffers : BuildBuffers)
+	{
+		if (Buffers.bInUse)
+		{
+			Buffers.bCancelled = true;
+		}
+	}
+	for (TPair<FIntPoint, FFoliageGridCell>& Pair : GridCells)
+	{
+		RecycleGridCell(Pair.Value);
+	}
+	GridCells.Reset();
+
+	for (TPair<FFoliageGeometryType, TArray<UFoliageHISM*>>& FoliageHISMPair : HISMFoliageMap)
+	{
+		for (UFoliageHISM* FoliageHISM : FoliageHISMPair.Value)
+		{
+			if (IsValid(FoliageHISM))
+			{
+				FoliageHISM->ResetPendingTransforms();
+				FoliageHISM->bMarkedForAdd = false;
+				FoliageHISM->bMarkedForClear = true;
+				FoliageHISM->BuildGeneration = INDEX_NONE;
+			}
+		}
+	}
+	bFlipPending = bDoubleBufferHISMs;
+}
+
+bool AFoliageCaptureActor::RestoreGridCellFromCache(const FFoliageTileCacheKey& Key, FFoliageGridCell& Cell)
+{
+	const TSharedPtr<const FFoliageCachedTile, ESPMode::ThreadSafe> Tile = TileCache.Find(Key);
+	if (Tile.IsValid())
+	{
+		return RestoreGridCellFromTile(Tile, Cell);
+	}
+	if (!TileCache.IsOnDisk(Key))
+	{
+		return false;
+	}
+
+	// Nothing may fill the cell while its tile loads, the front keeps what it shows until the tile is restored.
+	for (UFoliageHISM* HISM : Cell.HISMs)
+	{
+		if (HISM != nullptr)
+		{
+			HISM->ResetPendingTransforms();
+			HISM->bMarkedForAdd = false;
+			HISM->BuildGeneration = NumBuildsStarted;
+		}
+	}
+
+	const int32 LoadSerial = ++NumTileLoadsStarted;
+	Cell.TileLoadSerial = LoadSerial;
+	TileCache.LoadAsync(Key, [WeakThis = TWeakObjectPtr<AFoliageCaptureActor>(this), Key, LoadSerial](
+		const TSharedPtr<const FFoliageCachedTile, ESPMode::ThreadSafe>& LoadedTile)
+		{
+			if (AFoliageCaptureActor* CaptureActor = WeakThis.Get())
+			{
+				CaptureActor->OnGridCellTileLoaded(Key, LoadSerial, LoadedTile);
+			}
+		});
+	return true;
+}
+
+void AFoliageCaptureActor::OnGridCellTileLoaded(const FFoliageTileCacheKey& Key, int32 LoadSerial,
+	const TSharedPtr<const FFoliageCachedTile, ESPMode::ThreadSafe>& Tile)
+{
+	FFoliageGridCell* Cell = GridCells.Find(Key.Cell);
+	if (Cell == nullptr || Cell->TileLoadSerial != LoadSerial)
+	{
+		return;
+	}
+	Cell->TileLoadSerial = 0;
+
+	if (Key.SettingsHash != TileCacheSettingsHash || Key.Resolution != TileCacheResolution ||
+		!RestoreGridCellFromTile(Tile, *Cell))
+	{
+		Cell->bComplete = false;
+		return;
+	}
+	bFlipPending = bFlipPending || bDoubleBufferHISMs;
+}
+
+bool AFoliageCaptureActor::RestoreGridCellFromTile(const TSharedPtr<const FFoliageCachedTile, ESPMode::ThreadSafe>& Tile,
+	FFoliageGridCell& Cell)
+{
+	if (!Tile.IsValid() || Tile->GetGeometryTypes().Num() != Cell.HISMs.Num())
+	{
+		return false;
+	}
+
+	// Place the anchor again from its geographic location, the world origin may have moved since.
+	const glm::dvec3 AnchorLocation = Georeference->TransformLongitudeLatitudeHeightToUnreal(
+		VectorToDVector(Tile->AnchorLongitudeLatitudeHeight));
+	const FVector Location(AnchorLocation.x, AnchorLocation.y, AnchorLocation.z);
+	const FQuat EastSouthUp = Georeference->ComputeEastSouthUpToUnreal(Location).ToQuat();
+	const FTransform Anchor(EastSouthUp * Tile->AnchorRotation, Location, Tile->AnchorScale);
+
+	for (int32 GeometryTypeIndex = 0; GeometryTypeIndex < Cell.HISMs.Num(); ++GeometryTypeIndex)
+	{
+		UFoliageHISM* HISM = Cell.HISMs[GeometryTypeIndex];
+		if (HISM == nullptr)
+		{
+			continue;
+		}
+		HISM->ResetPendingTransforms();
+		HISM->bMarkedForAdd = false;
+		// Restored while the current build updates its cells, so in flight builds don't fill it afterwards.
+		HISM->BuildGeneration = NumBuildsStarted;
+
+		const FFoliageInstanceView& Instances = Tile->GetGeometryTypes()[GeometryTypeIndex];
+		if (Instances.Num() > 0)
+		{
+			// The HISM reads the tile in place, the reference keeps it alive until the instances are committed.
+			HISM->Transforms.Append(Instances, Tile);
+			HISM->PendingAnchor = Anchor;
+			HISM->bMarkedForAdd = true;
+		}
+		else if (HISM->GetFront()->GetInstanceCount() > 0)
+		{
+			HISM->bMarkedForClear = true;
+		}
+	}
+	bCellsRestoredFromCache = true;
+	return true;
+}
+
+void AFoliageCaptureActor::StoreGridCellsInCache(const FFoliageBuildBuffers& Buffers)
+{
+	TSet<UFoliageHISM*> RebuiltHISMs;
+	for (UFoliageHISM* HISM : Buffers.PendingCellHISMs)
+	{
+		if (HISM->BuildGeneration == Buffers.Generation)
+		{
+			RebuiltHISMs.Add(HISM);
+		}
+	}
+	if (RebuiltHISMs.Num() == 0)
+	{
+		return;
+	}
+
+	// The anchor of every cell of the build is the actor transform it was built at.
+	const FTransform& Anchor = Buffers.ActorTransform;
+	const glm::dvec3 AnchorLocation = Georeference->TransformUnrealToLongitudeLatitudeHeight(
+		VectorToDVector(Anchor.GetLocation()));
+	const FQuat EastSouthUp = Georeference->ComputeEastSouthUpToUnreal(Anchor.GetLocation()).ToQuat();
+
+	for (const TPair<FIntPoint, FFoliageGridCell>& Pair : GridCells)
+	{
+		const FFoliageGridCell& Cell = Pair.Value;
+		UFoliageHISM* const* FirstHISM = Cell.HISMs.FindByPredicate([](const UFoliageHISM* HISM) { return HISM != nullptr; });
+		if (!Cell.bComplete || FirstHISM == nullptr || !RebuiltHISMs.Contains(*FirstHISM))
+		{
+			continue;
+		}
+
+		TSharedRef<FFoliageCachedTile, ESPMode::ThreadSafe> Tile = MakeShared<FFoliageCachedTile, ESPMode::ThreadSafe>();
+		Tile->AnchorLongitudeLatitudeHeight = FVector(AnchorLocation.x, AnchorLocation.y, AnchorLocation.z);
+		Tile->AnchorRotation = EastSouthUp.Inverse() * Anchor.GetRotation();
+		Tile->AnchorScale = Anchor.GetScale3D();
+
+		// The tile takes over the pending instances, a build that produced a single chunk isn't copied at all.
+		TArray<FFoliageInstanceBuffer> GeometryTypes;
+		GeometryTypes.SetNum(Cell.HISMs.Num());
+		for (int32 GeometryTypeIndex = 0; GeometryTypeIndex < Cell.HISMs.Num(); ++GeometryTypeIndex)
+		{
+			UFoliageHISM* HISM = Cell.HISMs[GeometryTypeIndex];
+			if (HISM == nullptr)
+			{
+				continue;
+			}
+			FFoliageInstanceChunks& Pending = HISM->Transforms;
+			FFoliageInstanceBuffer& Instances = GeometryTypes[GeometryTypeIndex];
+			if (Pending.Chunks.Num() == 1 && Pending.SharedChunks.Num() == 0)
+			{
+				Instances = MoveTemp(Pending.Chunks[0]);
+			}
+			else
+			{
+				Instances.Reserve(Pending.Num());
+				Pending.ForEachChunk([&Instances](const auto& Chunk)
+				{
+					FFoliageInstanceView(Chunk).CopyTo(Instances);
+				});
+			}
+		}
+		Tile->SetGeometryTypes(MoveTemp(GeometryTypes));
+
+		// The HISMs commit the same instances, in the same order, from the tile.
+		for (int32 GeometryTypeIndex = 0; GeometryTypeIndex < Cell.HISMs.Num(); ++GeometryTypeIndex)
+		{
+			if (UFoliageHISM* HISM = Cell.HISMs[GeometryTypeIndex])
+			{
+				HISM->Transforms.Empty();
+				HISM->Transforms.Append(Tile->GetGeometryTypes()[GeometryTypeIndex], Tile);
+			}
+		}
+
+		TileCache.Add({Pair.Key, TileCacheResolution, TileCacheSettingsHash}, Tile);
+	}
+}
+
+void AFoliageCaptureActor::BuildClassificationLUT()
+{
+	ClassificationLUT.Reset();
+	ClassIDLUT.Init(INDEX_NONE, 256);
+
+	for (int32 ClassIndex = FoliageTypes.Num() - 1; ClassIndex >= 0; --ClassIndex)
+	{
+		if (FoliageTypes[ClassIndex].ClassID != 0)
+		{
+			ClassIDLUT[FoliageTypes[ClassIndex].ClassID] = ClassIndex;
+		}
+	}
+
+	const int32 Tolerance = GetQuantizedColourTolerance();
+
+	for (int32 ClassIndex = 0; ClassIndex < FoliageTypes.Num(); ++ClassIndex)
+	{
+		const FColor Colour = FoliageTypes[ClassIndex].ColourClassification.QuantizeRound();
+
+		// Add every quantized colour within the tolerance box around the classification colour.
+		for (int32 R = FMath::Max(Colour.R - Tolerance, 0); R <= FMath::Min(Colour.R + Tolerance, 255); ++R)
+		{
+			for (int32 G = FMath::Max(Colour.G - Tolerance, 0); G <= FMath::Min(Colour.G + Tolerance, 255); ++G)
+			{
+				for (int32 B = FMath::Max(Colour.B - Tolerance, 0); B <= FMath::Min(Colour.B + Tolerance, 255); ++B)
+				{
+					const uint32 Key = (static_cast<uint32>(R) << 16) | (static_cast<uint32>(G) << 8) | B;
+					if (!ClassificationLUT.Contains(Key))
+					{
+						ClassificationLUT.Add(Key, ClassIndex);
+					}
+				}
+			}
+		}
+	}
+}
+
+int32 AFoliageCaptureActor::GetQuantizedColourTolerance() const
+{
+	// Same limit as the ClampMax of ClassificationColourTolerance, which bounds the LUT box to 27^3 colours.
+	constexpr float MaxColourTolerance = 0.05f;
+	return FMath::CeilToInt(FMath::Clamp(ClassificationColourTolerance, 0.f, MaxColourTolerance) * 255.f);
+}
+
+int32 AFoliageCaptureActor::FindClassificationIndex(const FFoliagePixelBuffer& Pixels, int32 Index) const
+{
+	if (Pixels.Encoding == EFoliagePixelEncoding::ClassID8)
+	{
+		return ClassIDLUT.Num() > 0 ? ClassIDLUT[Pixels.GetClassID(Index)] : INDEX_NONE;
+	}
+	const int32* ClassIndex = ClassificationLUT.Find(Pixels.GetColourKey(Index));
+	return ClassIndex ? *ClassIndex : INDEX_NONE;
+}
+
+void AFoliageCaptureActor::OnUpdate_Implementation(const FVector& NewLocation)
+{
+	// Align the actor to face the planet surface.
+	// SetActorLocation(NewLocation);
+	NewActorLocation = NewLocation;
+	bInstancesClearedCalled = false;
+	bNeedsCapture = false;
+	UpdateStartTime = FPlatformTime::Seconds();
+	NumBuildsAtUpdate = NumBuildsStarted;
+	PreviousActorTransform = GetActorTransform();
+	
+
+	const FRotator PlanetAlignedRotation = Georeference->ComputeEastSouthUpToUnreal(NewLocation).Rotator();
+
+	SetActorRotation(
+		PlanetAlignedRotation
+	);
+
+	// Get grid min and max coords.
+	const int32 Size = GridSize.X > 0 && !bPartitionHISMsByGridCell ? GridSize.X : 1;
+	const FVector Start = GetActorTransform().TransformPosition(FVector(-(CaptureWidth * Size) / 2, 0, 0));
+	const FVector End = GetActorTransform().TransformPosition(FVector((CaptureWidth * Size) / 2, 0, 0));
+
+	// Find the distance (in degrees) between the grid min and max.
+	glm::dvec3 GeoStart = Georeference->TransformUnrealToLongitudeLatitudeHeight(VectorToDVector(Start));
+	glm::dvec3 GeoEnd = Georeference->TransformUnrealToLongitudeLatitudeHeight(VectorToDVector(End));
+
+	GeoStart.z = CaptureElevation;
+	GeoEnd.z = CaptureElevation;
+
+	CaptureWidthInDegrees = glm::distance(GeoStart, GeoEnd) / 2;
+
+	bIsWaiting = true;
+	
+#if FOLIAGE_REDUCE_FLICKER_APPROACH_ENABLED
+	OnInstancesCleared();
+#else
+	// Grid cells are cleared individually once the new capture extents are known.
+	if (bPartitionHISMsByGridCell)
+	{
+		OnInstancesCleared();
+	}
+	else
+	{
+		ClearFoliageInstances();
+	}
+#endif
+
+}
+
+void AFoliageCaptureActor::OnInstancesCleared_Implementation()
+{
+	if (NewActorLocation.IsSet()) {
+		FVector GeoPosition = Georeference->TransformUnrealToLongitudeLatitudeHeight(
+			*NewActorLocation
+		);
+		GeoPosition.Z = CaptureElevation;
+		FVector EnginePosition = Georeference->TransformLongitudeLatitudeHeightToUnreal(GeoPosition);
+		ActorOffset = EnginePosition - GetActorLocation();
+
+		SetActorLocation(
+		EnginePosition
+		);
+
+		// Anchored components stay where their builds placed them, only the actor moves.
+		if (!bAnchorHISMs && (bPartitionHISMsByGridCell || bDoubleBufferHISMs))
+		{
+			// Kept cells and visible front components must stay exactly where they are, including the rotation
+			// applied in OnUpdate.
+			RebaseAllInstances(PreviousActorTransform);
+		}
+#if FOLIAGE_REDUCE_FLICKER_APPROACH_ENABLED
+		else if (!bAnchorHISMs)
+		{
+			OffsetAllInstances(ActorOffset);
+		}
+#endif
+
+		NewActorLocation.Reset();
+		bIsWaiting = false;
+	}
+}
+
+bool AFoliageCaptureActor::IsBuilding() const
+{
+	return bIsBuilding;
+}
+
+void AFoliageCaptureActor::SetViewpoint(const FVector& Location, const FRotator& Rotation, float FOVDegrees,
+	float AspectRatio)
+{
+	Viewpoint.Location = Location;
+	Viewpoint.Direction = Rotation.Vector();
+
+	// A cone through the corners of the frustum contains all of it.
+	const double TanHalfFOV = FMath::Tan(FMath::DegreesToRadians(FMath::Clamp(FOVDegrees, 1.f, 179.f)) / 2.0);
+	Viewpoint.HalfAngle = FMath::Atan(TanHalfFOV * FMath::Sqrt(1.0 + 1.0 / FMath::Square(FMath::Max(AspectRatio, 0.1f))));
+
+	Viewpoint.HorizonDistance = IsValid(Georeference)
+		? FFoliageViewpoint::GetHorizonDistance(Georeference->TransformUnrealToLongitudeLatitudeHeight(
+			VectorToDVector(Location)).z)
+		: MAX_dbl;
+	Viewpoint.bValid = true;
+}
+
+bool AFoliageCaptureActor::CanStartBuild() const
+{
+	return NumBuildsInFlight < FMath::Clamp(MaxBuildsInFlight, 1, static_cast<int32>(UE_ARRAY_COUNT(BuildBuffers)) - 1);
+}
+
+int32 AFoliageCaptureActor::GetNumBuildsStarted() const
+{
+	return NumBuildsStarted;
+}
+
+int32 AFoliageCaptureActor::GetNumBuildsInFlight() const
+{
+	return NumBuildsInFlight;
+}
+
+FFoliageCaptureStats AFoliageCaptureActor::GetCaptureStats() const
+{
+	FFoliageCaptureStats Stats = CaptureStats;
+	Stats.NumBuildsInFlight = NumBuildsInFlight;
+	Stats.NumLiveInstances = 0;
+	for (const FFoliageClassificationType& FoliageType : FoliageTypes)
+	{
+		for (const FFoliageGeometryType& FoliageGeometryType : FoliageType.FoliageTypes)
+		{
+			int32 NumInstances = 0;
+			if (const TArray<UFoliageHISM*>* Pool = HISMFoliageMap.Find(FoliageGeometryType))
+			{
+				for (const UFoliageHISM* Slot : *Pool)
+				{
+					NumInstances += GetBudgetedInstanceCount(Slot);
+				}
+			}
+			Stats.LiveInstancesPerGeometryType.Add(NumInstances);
+			Stats.NumLiveInstances += NumInstances;
+		}
+	}
+	// Like the memory ceiling, a double buffered slot is assumed to hold its instances twice.
+	Stats.EstimatedInstanceMemory = static_cast<int64>(Stats.NumLiveInstances) * EstimatedBytesPerInstance *
+		(bDoubleBufferHISMs ? 2 : 1);
+	Stats.InstanceBudget = GetInstanceBudget();
+	return Stats;
+}
+
+int32 AFoliageCaptureActor::GetInstanceBudget() const
+{
+	int64 Budget = MAX_int32;
+	if (MaxInstances.GetValue() > 0)
+	{
+		Budget = MaxInstances.GetValue();
+	}
+	if (MaxInstanceMemoryMB.GetValue() > 0)
+	{
+		// Both components of a double buffered slot can hold a full set of instances.
+		const int64 BytesPerInstance = EstimatedBytesPerInstance * (bDoubleBufferHISMs ? 2 : 1);
+		Budget = FMath::Min(Budget, static_cast<int64>(MaxInstanceMemoryMB.GetValue()) * 1024 * 1024 / BytesPerInstance);
+	}
+	return static_cast<int32>(Budget);
+}
+
+int32 AFoliageCaptureActor::GetAvailableInstanceBudget(const FFoliageBuildBuffers& NewBuild) const
+{
+	const int32 Budget = GetInstanceBudget();
+	if (Budget == MAX_int32 || !bPartitionHISMsByGridCell)
+	{
+		return Budget;
+	}
+
+	// Cells being rebuilt are replaced, the other builds in flight keep what they were given.
+	TSet<const UFoliageHISM*> RebuiltHISMs;
+	int64 NumReserved = 0;
+	for (const FFoliageBuildBuffers& Buffers : BuildBuffers)
+	{
+		if (!Buffers.bInUse || Buffers.bCancelled)
+		{
+			continue;
+		}
+		for (const UFoliageHISM* CellHISM : Buffers.PendingCellHISMs)
+		{
+			RebuiltHISMs.Add(CellHISM);
+		}
+		if (&Buffers != &NewBuild)
+		{
+			NumReserved += FMath::Min(Buffers.InstanceBudget, Budget);
+		}
+	}
+
+	int64 NumKept = 0;
+	for (const TPair<FFoliageGeometryType, TArray<UFoliageHISM*>>& FoliageHISMPair : HISMFoliageMap)
+	{
+		for (UFoliageHISM* Slot : FoliageHISMPair.Value)
+		{
+			if (!RebuiltHISMs.Contains(Slot))
+			{
+				NumKept += GetBudgetedInstanceCount(Slot);
+			}
+		}
+	}
+	return static_cast<int32>(FMath::Clamp<int64>(Budget - NumKept - NumReserved, 0, Budget));
+}
+
+int32 AFoliageCaptureActor::GetBudgetedInstanceCount(const UFoliageHISM* HISM)
+{
+	if (HISM->bMarkedForClear)
+	{
+		return 0;
+	}
+	return HISM->bMarkedForAdd ? HISM->Transforms.Num() : HISM->GetFront()->GetInstanceCount();
+}
+
+void AFoliageCaptureActor::WaitForTileCacheWrites() const
+{
+	TileCache.WaitForPendingWrites();
+}
+
+bool AFoliageCaptureActor::IsWaiting() const
+{
+	return bIsWaiting;
+}
+
+bool AFoliageCaptureActor::IssueSurfaceTraces(FFoliageBuildBuffers* Buffers)
+{
+	FOLIAGE_SCOPE_CYCLE_COUNTER(STAT_FoliageSurfaceTraces);
+
+	UWorld* World = GetWorld();
+	FFoliageTransforms& FoliageTransforms = Buffers->FoliageTransforms;
+
+	if (!IsValid(World) || FoliageTransforms.PendingTraces.Num() == 0)
+	{
+		return false;
+	}
+
+	// The async trace system batches these and runs them on worker threads during the next frame.
+	FCollisionQueryParams QueryParams(SCENE_QUERY_STAT(FoliageSurfaceTrace), false, this);
+	FTraceDelegate TraceDelegate;
+	TraceDelegate.BindUObject(this, &AFoliageCaptureActor::OnSurfaceTraceDone, Buffers);
+
+	Buffers->NumOutstandingTraces = FoliageTransforms.PendingTraces.Num();
+	INC_DWORD_STAT_BY(STAT_FoliageTracesIssued, FoliageTransforms.PendingTraces.Num());
+	for (int32 TraceIndex = 0; TraceIndex < FoliageTransforms.PendingTraces.Num(); ++TraceIndex)
+	{
+		const FFoliagePendingTrace& Trace = FoliageTransforms.PendingTraces[TraceIndex];
+		World->AsyncLineTraceByChannel(EAsyncTraceType::Single, Trace.TraceStart + Buffers->WorldOffset,
+		                               Trace.TraceEnd + Buffers->WorldOffset,
+		                               ECollisionChannel::ECC_Visibility, QueryParams,
+		                               FCollisionResponseParams::DefaultResponseParam, &TraceDelegate, TraceIndex);
+	}
+	return true;
+}
+
+void AFoliageCaptureActor::OnSurfaceTraceDone(const FTraceHandle& TraceHandle, FTraceDatum& TraceDatum,
+	FFoliageBuildBuffers* Buffers)
+{
+	FOLIAGE_SCOPE_CYCLE_COUNTER(STAT_FoliageSurfaceTraces);
+
+	FFoliageTransforms& FoliageTransforms = Buffers->FoliageTransforms;
+	FFoliagePendingTrace& Trace = FoliageTransforms.PendingTraces[TraceDatum.UserData];
+
+	// Pixels that don't hit anything keep the captured location and normal. Hits already include the world offset.
+	FVector Location = Trace.Location + Buffers->WorldOffset;
+	FVector Normal = Trace.Normal;
+	if (TraceDatum.OutHits.Num() > 0 && TraceDatum.OutHits[0].bBlockingHit)
+	{
+		Location = TraceDatum.OutHits[0].ImpactPoint;
+		Normal = TraceDatum.OutHits[0].ImpactNormal;
+	}
+
+	for (int32 InstanceIndex = Trace.FirstInstance; InstanceIndex < Trace.FirstInstance + Trace.NumInstances; ++InstanceIndex)
+	{
+		FFoliagePendingInstance& Instance = FoliageTransforms.PendingInstances[InstanceIndex];
+		Instance.bResolved = MakeInstanceTransform(Location, Normal, Trace.EastSouthUp, Instance,
+		                                           Buffers->ActorTransform, Instance.Transform);
+	}
+
+	if (--Buffers->NumOutstandingTraces == 0)
+	{
+		CommitBuildBuffers(Buffers);
+	}
+}
+
+void AFoliageCaptureActor::CommitBuildBuffers(FFoliageBuildBuffers* Buffers)
+{
+	FOLIAGE_SCOPE_CYCLE_COUNTER(STAT_FoliageCommitBuild);
+
+	const int32 Generation = Buffers->Generation;
+
+	// Without cells every build covers the whole capture, so a newer build that finished first replaces this one.
+	if (Buffers->bCancelled || (!bPartitionHISMsByGridCell && Generation < LastCommittedGeneration))
+	{
+		Buffers->bCancelled = true;
+		AbandonBuild(Buffers);
+		return;
+	}
+
+	const auto AcceptsInstances = [this, Generation](UFoliageHISM* HISM)
+	{
+		if (bPartitionHISMsByGridCell)
+		{
+			// Cells that were recycled, restored or rebuilt since belong to the build that did so.
+			return HISM->BuildGeneration == Generation;
+		}
+		// Instances of an older build that are still being committed are replaced, not added to.
+		if (HISM->BuildGeneration != Generation)
+		{
+			HISM->ResetPendingTransforms();
+			HISM->BuildGeneration = Generation;
+		}
+		return true;
+	};
+
+	// Instances handed to each HISM, for the stats.
+	TMap<const UFoliageHISM*, int32> HISMInstanceCounts;
+
+	// Marked for add
+	for (TPair<UFoliageHISM*, FFoliageInstanceChunks>& Pair : Buffers->FoliageTransforms.HISMTransformMap)
+	{
+		if (Pair.Value.Num() == 0 || !AcceptsInstances(Pair.Key)) { continue; }
+		HISMInstanceCounts.FindOrAdd(Pair.Key) += Pair.Value.Num();
+		Pair.Key->Transforms.Append(MoveTemp(Pair.Value));
+		Pair.Key->bMarkedForAdd = true;
+		if (bAnchorHISMs)
+		{
+			Pair.Key->PendingAnchor = Buffers->ActorTransform;
+		}
+	}
+	for (const FFoliagePendingInstance& Instance : Buffers->FoliageTransforms.PendingInstances)
+	{
+		if (Instance.bResolved && IsValid(Instance.HISM) && AcceptsInstances(Instance.HISM))
+		{
+			++HISMInstanceCounts.FindOrAdd(Instance.HISM);
+			Instance.HISM->Transforms.Add(Instance.Transform);
+			Instance.HISM->bMarkedForAdd = true;
+			if (bAnchorHISMs)
+			{
+				Instance.HISM->PendingAnchor = Buffers->ActorTransform;
+			}
+		}
+	}
+	// Rebuilt cells that didn't receive any instances still need their old ones removed.
+	for (UFoliageHISM* CellHISM : Buffers->PendingCellHISMs)
+	{
+		if (CellHISM->BuildGeneration == Generation && !CellHISM->bMarkedForAdd &&
+			CellHISM->GetFront()->GetInstanceCount() > 0)
+		{
+			CellHISM->bMarkedForClear = true;
+		}
+	}
+	// Cells thinned out by the budget aren't what the settings produce. They're not cached, and the next build
+	// rebuilds them, so they fill in again once the budget frees up.
+	if (Buffers->BudgetDensityScale < 1.f || Buffers->NumInstancesDroppedByBudget > 0)
+	{
+		InvalidatePendingGridCells(*Buffers);
+	}
+	else if (CanUseTileCache())
+	{
+		StoreGridCellsInCache(*Buffers);
+	}
+	LastCommittedGeneration = FMath::Max(LastCommittedGeneration, Generation);
+	bFlipPending = bDoubleBufferHISMs;
+
+	CaptureStats.LastReadbackMs = Buffers->ReadbackMs;
+	CaptureStats.LastReprojectionMs = Buffers->ReprojectionMs;
+	CaptureStats.LastBuildMs = static_cast<float>((FPlatformTime::Seconds() - Buffers->StartTime) * 1000.0);
+	CaptureStats.LastPixelsProcessed = Buffers->NumPixelsProcessed;
+	CaptureStats.LastBytesReadBack = Buffers->NumBytesReadBack;
+	CaptureStats.LastBudgetDensityScale = Buffers->BudgetDensityScale;
+	CaptureStats.LastInstancesDroppedByBudget = Buffers->NumInstancesDroppedByBudget;
+	CaptureStats.LastInstancesGenerated = 0;
+	CaptureStats.LastInstancesPerGeometryType.Reset();
+	for (const FFoliageClassificationType& FoliageType : FoliageTypes)
+	{
+		for (const FFoliageGeometryType& FoliageGeometryType : FoliageType.FoliageTypes)
+		{
+			int32 NumInstances = 0;
+			if (const TArray<UFoliageHISM*>* Pool = HISMFoliageMap.Find(FoliageGeometryType))
+			{
+				for (const UFoliageHISM* HISM : *Pool)
+				{
+					NumInstances += HISMInstanceCounts.FindRef(HISM);
+				}
+			}
+			CaptureStats.LastInstancesPerGeometryType.Add(NumInstances);
+			CaptureStats.LastInstancesGenerated += NumInstances;
+		}
+	}
+	INC_DWORD_STAT_BY(STAT_FoliageInstancesGenerated, CaptureStats.LastInstancesGenerated);
+	++CaptureStats.NumBuildsCommitted;
+
+	FinishBuild(Buffers);
+}
+
+void AFoliageCaptureActor::FinishBuild(FFoliageBuildBuffers* Buffers)
+{
+	if (Buffers->bCancelled)
+	{
+		++CaptureStats.NumBuildsCancelled;
+	}
+	Buffers->bInUse = false;
+	Buffers->PendingCellHISMs.Reset();
+	LastFinishedGeneration = FMath::Max(LastFinishedGeneration, Buffers->Generation);
+	NumBuildsInFlight = FMath::Max(NumBuildsInFlight - 1, 0);
+	bIsBuilding = NumBuildsInFlight > 0;
+}
+
+void AFoliageCaptureActor::AbandonBuild(FFoliageBuildBuffers* Buffers)
+{
+	// The cells weren't filled, so make sure the next build rebuilds them.
+	InvalidatePendingGridCells(*Buffers);
+	FinishBuild(Buffers);
+}
+
+void AFoliageCaptureActor::CancelSupersededBuilds(const FFoliageBuildBuffers& NewBuild)
+{
+	for (FFoliageBuildBuffers& Buffers : BuildBuffers)
+	{
+		if (!Buffers.bInUse || Buffers.Generation >= NewBuild.Generation || Buffers.bCancelled)
+		{
+			continue;
+		}
+		const bool bSuperseded = !bPartitionHISMsByGridCell || !Buffers.PendingCellHISMs.ContainsByPredicate(
+			[&Buffers](const UFoliageHISM* HISM) { return HISM->BuildGeneration == Buffers.Generation; });
+		if (bSuperseded)
+		{
+			Buffers.bCancelled = true;
+		}
+	}
+}
+
+FVector AFoliageCaptureActor::ProjectPixelToEngine(const double& X, const double& Y, const double& Elevation,
+	const FFoliageReprojectionContext& Context) const
+{
+	return Georeference->TransformLongitudeLatitudeHeightToUnreal(
+		PixelToGeographicLocation(X, Y, Elevation, Context.FoliageDistributionMap, Context.GeographicExtents2D));
+}
+
+void AFoliageCaptureActor::InitializeTileProjection(const FIntRect& TileRect, const FFoliageReprojectionContext& Context,
+	FFoliageTileProjection& OutProjection) const
+{
+	// Halve the node spacing until the midpoint of a cell interpolates to within MaxProjectionError of the exact
+	// projection. The ellipsoid curvature is nearly constant across a tile, so one cell is representative.
+	int32 Spacing = FMath::Max(TileRect.Width(), TileRect.Height());
+	while (Spacing > 1)
+	{
+		const double X0 = TileRect.Min.X;
+		const double Y0 = TileRect.Min.Y;
+		const double X1 = FMath::Min(TileRect.Min.X + Spacing, TileRect.Max.X);
+		const double Y1 = FMath::Min(TileRect.Min.Y + Spacing, TileRect.Max.Y);
+
+		const FVector Interpolated = FMath::BiLerp(
+			ProjectPixelToEngine(X0, Y0, 0.0, Context), ProjectPixelToEngine(X1, Y0, 0.0, Context),
+			ProjectPixelToEngine(X0, Y1, 0.0, Context), ProjectPixelToEngine(X1, Y1, 0.0, Context),
+			0.5, 0.5);
+		const FVector Exact = ProjectPixelToEngine((X0 + X1) * 0.5, (Y0 + Y1) * 0.5, 0.0, Context);
+
+		if (FVector::Dist(Interpolated, Exact) <= MaxProjectionError)
+		{
+			break;
+		}
+		Spacing /= 2;
+	}
+
+	OutProjection.Rect = TileRect;
+	OutProjection.Spacing = Spacing;
+	OutProjection.NodesX = FMath::DivideAndRoundUp(TileRect.Width(), Spacing) + 1;
+	OutProjection.NodesY = FMath::DivideAndRoundUp(TileRect.Height(), Spacing) + 1;
+
+	const int32 NumNodes = OutProjection.NodesX * OutProjection.NodesY;
+	OutProjection.SurfaceLocations.SetNumUninitialized(NumNodes);
+	OutProjection.UpPerMetre.SetNumUninitialized(NumNodes);
+	OutProjection.EastSouthUp.SetNumUninitialized(NumNodes);
+
+	for (int32 NodeY = 0; NodeY < OutProjection.NodesY; ++NodeY)
+	{
+		for (int32 NodeX = 0; NodeX < OutProjection.NodesX; ++NodeX)
+		{
+			const double X = FMath::Min(TileRect.Min.X + NodeX * Spacing, TileRect.Max.X);
+			const double Y = FMath::Min(TileRect.Min.Y + NodeY * Spacing, TileRect.Max.Y);
+			const int32 NodeIndex = NodeY * OutProjection.NodesX + NodeX;
+
+			const FVector Surface = ProjectPixelToEngine(X, Y, 0.0, Context);
+			OutProjection.SurfaceLocations[NodeIndex] = Surface;
+			OutProjection.UpPerMetre[NodeIndex] = ProjectPixelToEngine(X, Y, 1.0, Context) - Surface;
+			OutProjection.EastSouthUp[NodeIndex] = Georeference->ComputeEastSouthUpToUnreal(Surface).ToQuat();
+		}
+	}
+
+	OutProjection.bInitialized = true;
+}
+
+uint32 AFoliageCaptureActor::GetGeometryTypeSeed(const FFoliageGeometryType& FoliageGeometryType)
+{
+	// Hash the mesh by path rather than pointer so the seed survives reloads.
+	uint32 Seed = GetTypeHash(IsValid(FoliageGeometryType.Mesh) ? FoliageGeometryType.Mesh->GetPathName() : FString());
+	Seed = HashCombine(Seed, GetTypeHash(FoliageGeometryType.Density));
+	Seed = HashCombine(Seed, GetTypeHash(FoliageGeometryType.Scale.Min));
+	Seed = HashCombine(Seed, GetTypeHash(FoliageGeometryType.Scale.Max));
+	Seed = HashCombine(Seed, GetTypeHash(FoliageGeometryType.ZOffset.Min));
+	Seed = HashCombine(Seed, GetTypeHash(FoliageGeometryType.ZOffset.Max));
+	return Seed;
+}
+
+FRandomStream AFoliageCaptureActor::MakePlacementStream(const FVector& GeographicCoords, uint32 GeometryTypeSeed) const
+{
+	const int64 CellX = FMath::FloorToInt64(GeographicCoords.X / PlacementCellSizeInDegrees);
+	const int64 CellY = FMath::FloorToInt64(GeographicCoords.Y / PlacementCellSizeInDegrees);
+
+	uint32 Seed = HashCombine(GetTypeHash(CellX), GetTypeHash(CellY));
+	Seed = HashCombine(Seed, GeometryTypeSeed);
+	Seed = HashCombine(Seed, GetTypeHash(PlacementSeed));
+
+	return FRandomStream(static_cast<int32>(Seed));
+}
+
+double AFoliageCaptureActor::GetHeightFromDepth(const double& Value) const
+{
+	return CaptureElevation - (1 - Value) / 0.00001 / 100;
+
+}
+
+FVector AFoliageCaptureActor::PixelToGeographicLocation(const double& X, const double& Y, const double& Altitude,
+	UTextureRenderTarget2D* RT,
+	const glm::dvec4& GeographicExtents) const
+{
+	// Normalize the ranges of the coords
+	const double AX = X / static_cast<double>(RT->SizeX);
+	const double AY = Y / static_cast<double>(RT->SizeY);
+
+	const double Long = FMath::Lerp<double>(
+		GeographicExtents.x,
+		GeographicExtents.z,
+		1 - AY);
+	const double Lat = FMath::Lerp<double>(
+		GeographicExtents.y,
+		GeographicExtents.w,
+		AX);
+
+	return FVector(Long, Lat, Altitude);
+}
+
+FIntPoint AFoliageCaptureActor::GeographicToPixelLocation(const double& Longitude, const double& Latitude,
+	UTextureRenderTarget2D* RT,
+	const glm::dvec4& GeographicExtents) const
+{
+	// Normalize long and lat
+	const double LongitudeRange = GeographicExtents.z - GeographicExtents.x;
+	const double LatitudeRange = GeographicExtents.w - GeographicExtents.y;
+	const double ALongitude = (Longitude - GeographicExtents.x) / LongitudeRange;
+	const double ALatitude = (Latitude - GeographicExtents.y) / LatitudeRange;
+
+	const double X = FMath::Lerp<double>(0, RT->SizeX, ALatitude);
+	const double Y = FMath::Lerp<double>(RT->SizeY, 0, ALongitude);
+
+	return FIntPoint(X, Y);
+}
+
+void AFoliageCaptureActor::ReadRenderTargetPixelsAsync(
+	FOnRenderTargetRead OnRenderTargetRead,
+	TArray<FTextureRenderTargetResource*> RTs,
+	TArray<FFoliagePixelBuffer*> OutImageData,
+	FReadSurfaceDataFlags InFlags,
+	TArray<FIntRect> InRects,
+	ENamedThreads::Type ExitThread)
+{
+	if (InRects.Num() == 0)
+	{
+		InRects.Add(FIntRect(0, 0, RTs[0]->GetSizeXY().X, RTs[0]->GetSizeXY().Y));
+	}
+
+	if (bUseGPUTextureReadback)
+	{
+		ReadRenderTargetPixelsWithGPUReadbackAsync(OnRenderTargetRead, RTs, OutImageData, InRects, ExitThread);
+		return;
+	}
+
+	struct FReadSurfaceContext
+	{
+		TArray<FTextureRenderTargetResource*> SrcRenderTargets;
+		TArray<FFoliagePixelBuffer*> OutData;
+		TArray<FIntRect> Rects;
+		FReadSurfaceDataFlags Flags;
+	};
+
+	FReadSurfaceContext Context =
+	{
+		RTs,
+		OutImageData,
+		InRects,
+		InFlags
+	};
+
+	if (!Context.OutData[0])
+	{
+		UE_LOG(LogTemp, Error, TEXT("Buffer invalid!"));
+		return;
+	}
+
+	FRenderCommandFence Fence;
+
+	ENQUEUE_RENDER_COMMAND(ReadSurfaceCommand)(
+		[Context, OnRenderTargetRead, ExitThread](FRHICommandListImmediate& RHICmdList)
+		{
+			// ReadSurfaceData waits for the GPU, so this is mostly the stall.
+			FOLIAGE_SCOPE_CYCLE_COUNTER(STAT_FoliageReadback);
+			const FReadSurfaceDataFlags Flags = Context.Flags;
+			bool bSuccess = true;
+			int i = 0;
+			for (FRenderTarget* RT : Context.SrcRenderTargets)
+			{
+				
+				const FTexture2DRHIRef& RefRenderTarget = RT->
+					GetRenderTargetTexture();
+
+				EFoliagePixelEncoding Encoding;
+				if (!FFoliagePixelBuffer::GetEncodingForFormat(RefRenderTarget->GetFormat(), Encoding))
+				{
+					// Anything else is read as linear colour.
+					Encoding = EFoliagePixelEncoding::LinearColor;
+				}
+
+				FFoliagePixelBuffer* Buffer = Context.OutData[i];
+				Buffer->Reset(Encoding);
+
+				// Append each region one after another, using the narrowest read the encoding allows.
+				for (const FIntRect& Rect : Context.Rects)
+				{
+					switch (Encoding)
+					{
+					case EFoliagePixelEncoding::Float16Color:
+						{
+							TArray<FFloat16Color> RectData;
+							RHICmdList.ReadSurfaceFloatData(RefRenderTarget, Rect, RectData, CubeFace_PosX, 0, 0);
+							Buffer->Data.Append(reinterpret_cast<const uint8*>(RectData.GetData()),
+							                    RectData.Num() * sizeof(FFloat16Color));
+							break;
+						}
+					case EFoliagePixelEncoding::Colour8:
+						{
+							TArray<FColor> RectData;
+							RHICmdList.ReadSurfaceData(RefRenderTarget, Rect, RectData, Flags);
+							Buffer->Data.Append(reinterpret_cast<const uint8*>(RectData.GetData()),
+							                    RectData.Num() * sizeof(FColor));
+							break;
+						}
+					case EFoliagePixelEncoding::ClassID8:
+						{
+							TArray<FColor> RectData;
+							RHICmdList.ReadSurfaceData(RefRenderTarget, Rect, RectData, Flags);
+							const int32 Offset = Buffer->Data.AddUninitialized(RectData.Num());
+							for (int32 PixelIndex = 0; PixelIndex < RectData.Num(); ++PixelIndex)
+							{
+								Buffer->Data[Offset + PixelIndex] = RectData[PixelIndex].R;
+							}
+							break;
+						}
+					default:
+						{
+							TArray<FLinearColor> RectData;
+							RHICmdList.ReadSurfaceData(RefRenderTarget, Rect, RectData, Flags);
+							Buffer->Data.Append(reinterpret_cast<const uint8*>(RectData.GetData()),
+							                    RectData.Num() * sizeof(FLinearColor));
+							break;
+						}
+					}
+				}
+				bSuccess &= Buffer->Num() > 0;
+				i++;
+			}
+			// instead of blocking the game thread, execute the delegate when finished.
+			AsyncTask(
+				ExitThread,
+				[OnRenderTargetRead, bSuccess]()
+				{
+					OnRenderTargetRead.Execute(bSuccess);
+				});
+		});
+
+	Fence.BeginFence(true);
+	
+}
+
+void AFoliageCaptureActor::ReadRenderTargetPixelsWithGPUReadbackAsync(
+	FOnRenderTargetRead OnRenderTargetRead,
+	TArray<FTextureRenderTargetResource*> RTs,
+	TArray<FFoliagePixelBuffer*> OutImageData,
+	TArray<FIntRect> InRects,
+	ENamedThreads::Type ExitThread)
+{
+	if (OutImageData.Num() == 0 || !OutImageData[0])
+	{
+		UE_LOG(LogTemp, Error, TEXT("Buffer invalid!"));
+		return;
+	}
+
+	TSharedRef<FFoliageTextureReadback, ESPMode::ThreadSafe> Readback = MakeShared<
+		FFoliageTextureReadback, ESPMode::ThreadSafe>();
+	Readback->OnRenderTargetRead = OnRenderTargetRead;
+	Readback->OutData = OutImageData;
+	Readback->Rects = InRects;
+	Readback->ExitThread = ExitThread;
+
+	for (int32 i = 0; i < RTs.Num() * InRects.Num(); ++i)
+	{
+		Readback->Readbacks.Add(MakeUnique<FRHIGPUTextureReadback>(TEXT("FoliageCaptureReadback")));
+	}
+
+	// Queue the copies, the GPU will get to them when it's ready. Nothing waits on them here.
+	ENQUEUE_RENDER_COMMAND(FoliageEnqueueReadback)(
+		[Readback, RTs](FRHICommandListImmediate& RHICmdList)
+		{
+			int32 ReadbackIndex = 0;
+			for (FTextureRenderTargetResource* RT : RTs)
+			{
+				FRHITexture* Texture = RT->GetRenderTargetTexture();
+				Readback->Formats.Add(Texture->GetFormat());
+
+				for (const FIntRect& Rect : Readback->Rects)
+				{
+					Readback->Readbacks[ReadbackIndex++]->EnqueueCopy(RHICmdList, Texture,
+						FResolveRect(Rect.Min.X, Rect.Min.Y, Rect.Max.X, Rect.Max.Y));
+				}
+			}
+		});
+
+	GetReadbackQueue().Add(Readback);
+}
+
+FFoliageReadbackQueue& AFoliageCaptureActor::GetReadbackQueue()
+{
+	UWorld* World = GetWorld();
+	UFoliageCaptureSubsystem* Subsystem = World != nullptr ? World->GetSubsystem<UFoliageCaptureSubsystem>() : nullptr;
+	return Subsystem != nullptr ? Subsystem->GetReadbackQueue() : LocalReadbackQueue;
+}
+
+glm::dvec3 AFoliageCaptureActor::VectorToDVector(const FVector& InVector)
+{
+	return glm::dvec3(InVector.X, InVector.Y, InVector.Z);
+}
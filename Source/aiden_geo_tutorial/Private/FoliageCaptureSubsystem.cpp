@@ -0,0 +1,239 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "FoliageCaptureSubsystem.h"
+
+#include "Camera/PlayerCameraManager.h"
+#include "Engine/Engine.h"
+#include "Engine/LocalPlayer.h"
+#include "GameFramework/PlayerController.h"
+#include "HAL/IConsoleManager.h"
+#include "ProceduralFoliageEllipsoid.h"
+
+static TAutoConsoleVariable<int32> CVarMaxSharedBuildsInFlight(
+	TEXT("foliage.MaxSharedBuildsInFlight"),
+	2,
+	TEXT("Most foliage builds, counted across all capture actors, that can be waiting for a capture or in flight at ")
+	TEXT("once. 0 for no limit, each actor's MaxBuildsInFlight still applies."));
+
+static TAutoConsoleVariable<int32> CVarMergeCaptureActors(
+	TEXT("foliage.MergeCaptureActors"),
+	1,
+	TEXT("If 1, capture actors that would build the same foliage from the same view are merged, only the first one ")
+	TEXT("captures and instances it."));
+
+void UFoliageCaptureSubsystem::RegisterTileset(AProceduralFoliageEllipsoid* Tileset)
+{
+	Tilesets.AddUnique(Tileset);
+}
+
+void UFoliageCaptureSubsystem::UnregisterTileset(AProceduralFoliageEllipsoid* Tileset)
+{
+	Tilesets.Remove(Tileset);
+}
+
+void UFoliageCaptureSubsystem::Update(float DeltaSeconds)
+{
+	if (LastUpdateFrame == GFrameCounter)
+	{
+		return;
+	}
+	LastUpdateFrame = GFrameCounter;
+
+	UpdateViewers(DeltaSeconds);
+
+	Tilesets.RemoveAll([](const TWeakObjectPtr<AProceduralFoliageEllipsoid>& Tileset) { return !Tileset.IsValid(); });
+
+	// A capture actor shared by several tilesets belongs to the first one that registered it. Every capture actor is
+	// gathered before any is updated, so the build slots are counted over all of them.
+	CaptureActors.Reset();
+	TArray<TPair<AFoliageCaptureActor*, AProceduralFoliageEllipsoid*>, TInlineAllocator<8>> Owners;
+	for (const TWeakObjectPtr<AProceduralFoliageEllipsoid>& Tileset : Tilesets)
+	{
+		TArray<AFoliageCaptureActor*, TInlineAllocator<4>> TilesetCaptureActors{Tileset->FoliageCaptureActor};
+		TilesetCaptureActors.Append(Tileset->FoliageCaptureRings);
+		for (AFoliageCaptureActor* CaptureActor : TilesetCaptureActors)
+		{
+			if (!IsValid(CaptureActor) || CaptureActors.Contains(CaptureActor))
+			{
+				continue;
+			}
+			CaptureActors.Add(CaptureActor);
+			Owners.Emplace(CaptureActor, Tileset.Get());
+		}
+	}
+
+	// Capture actors with the same settings, georeference and viewer would capture and instance the same foliage,
+	// the first one builds it for all of them.
+	using FMergeKey = TTuple<const ACesiumGeoreference*, int32, uint32>;
+	TMap<FMergeKey, AFoliageCaptureActor*> Leaders;
+	const bool bMergeCaptureActors = CVarMergeCaptureActors.GetValueOnGameThread() != 0;
+
+	for (const TPair<AFoliageCaptureActor*, AProceduralFoliageEllipsoid*>& Owner : Owners)
+	{
+		AFoliageCaptureActor* CaptureActor = Owner.Key;
+		ACesiumGeoreference* Geo = Owner.Value->ResolveGeoreference();
+		if (!IsValid(Geo))
+		{
+			continue;
+		}
+
+		AFoliageCaptureActor* Leader = nullptr;
+		if (bMergeCaptureActors)
+		{
+			const FMergeKey Key(Geo, CaptureActor->ViewerIndex, CaptureActor->GetCaptureMergeKey());
+			AFoliageCaptureActor* const* Found = Leaders.Find(Key);
+			if (Found != nullptr)
+			{
+				Leader = *Found;
+			}
+			else
+			{
+				Leaders.Add(Key, CaptureActor);
+			}
+		}
+		CaptureActor->MergeInto(Leader);
+		if (Leader != nullptr)
+		{
+			continue;
+		}
+
+		FFoliageViewer MergedViewer;
+		const FFoliageViewer* Viewer = FindViewer(CaptureActor, MergedViewer);
+		if (Viewer == nullptr)
+		{
+			continue;
+		}
+
+		// Kept current even while builds are in flight, so the next one ranks its tiles against the latest view.
+		// A merged capture ranks against the first of its views.
+		if (CaptureActor->bPrioritizeVisibleTiles)
+		{
+			const FFoliageViewer& View = Viewer == &MergedViewer ? Viewers[0] : *Viewer;
+			CaptureActor->SetViewpoint(View.Location, View.Rotation, View.FOVDegrees, View.AspectRatio);
+		}
+		Owner.Value->UpdateCaptureActor(CaptureActor, Geo, *Viewer);
+	}
+}
+
+bool UFoliageCaptureSubsystem::TryAcquireBuildSlot(const AFoliageCaptureActor* CaptureActor)
+{
+	const int32 MaxBuilds = CVarMaxSharedBuildsInFlight.GetValueOnGameThread();
+	if (MaxBuilds <= 0)
+	{
+		return true;
+	}
+
+	// Actors that stopped asking, e.g. because the camera came back inside their capture, give up their place.
+	BuildQueue.RemoveAll([](const FBuildRequest& Request)
+	{
+		return !Request.CaptureActor.IsValid() || Request.LastRequestFrame + 1 < GFrameCounter;
+	});
+
+	int32 QueueIndex = BuildQueue.IndexOfByPredicate(
+		[CaptureActor](const FBuildRequest& Request) { return Request.CaptureActor == CaptureActor; });
+	if (QueueIndex == INDEX_NONE)
+	{
+		QueueIndex = BuildQueue.Add({CaptureActor, GFrameCounter});
+	}
+	BuildQueue[QueueIndex].LastRequestFrame = GFrameCounter;
+
+	// Captures waiting to be built hold their slot too, their readback is on the way.
+	int32 NumInFlight = 0;
+	for (const TWeakObjectPtr<AFoliageCaptureActor>& Other : CaptureActors)
+	{
+		if (Other.IsValid())
+		{
+			NumInFlight += Other->GetNumBuildsInFlight() + (Other->IsWaiting() ? 1 : 0);
+		}
+	}
+
+	// First come, first served, so a capture that moves every frame can't starve the others.
+	if (NumInFlight + QueueIndex >= MaxBuilds)
+	{
+		return false;
+	}
+	BuildQueue.RemoveAt(QueueIndex);
+	return true;
+}
+
+void UFoliageCaptureSubsystem::UpdateViewers(float DeltaSeconds)
+{
+	TArray<FFoliageViewer> PreviousViewers = MoveTemp(Viewers);
+	Viewers.Reset();
+
+	// In split-screen order, the first viewer is the one the capture actors followed before there were several.
+	for (const ULocalPlayer* LocalPlayer : GEngine->GetGamePlayers(GetWorld()))
+	{
+		const APlayerController* PlayerController = LocalPlayer != nullptr ? LocalPlayer->PlayerController : nullptr;
+		const APlayerCameraManager* CameraManager = PlayerController != nullptr
+			? PlayerController->PlayerCameraManager
+			: nullptr;
+		if (!IsValid(CameraManager))
+		{
+			continue;
+		}
+
+		FFoliageViewer& Viewer = Viewers.AddDefaulted_GetRef();
+		Viewer.CameraManager = CameraManager;
+		Viewer.Location = CameraManager->GetCameraLocation();
+		Viewer.Rotation = CameraManager->GetCameraRotation();
+		Viewer.FOVDegrees = CameraManager->GetFOVAngle();
+		Viewer.AspectRatio = CameraManager->GetCameraCachePOV().AspectRatio;
+		Viewer.Speed = CameraManager->GetVelocity().Size();
+
+		const FFoliageViewer* Previous = PreviousViewers.FindByPredicate(
+			[CameraManager](const FFoliageViewer& Other) { return Other.CameraManager == CameraManager; });
+		if (Previous != nullptr && DeltaSeconds > 0.f)
+		{
+			// Smoothed, so a single hitch doesn't throw the prediction off.
+			Viewer.Velocity = FMath::Lerp(Previous->Velocity, (Viewer.Location - Previous->Location) / DeltaSeconds, 0.2);
+		}
+	}
+}
+
+const FFoliageViewer* UFoliageCaptureSubsystem::FindViewer(const AFoliageCaptureActor* CaptureActor,
+	FFoliageViewer& OutMergedViewer) const
+{
+	if (Viewers.Num() == 0)
+	{
+		return nullptr;
+	}
+	if (CaptureActor->ViewerIndex >= 0)
+	{
+		return Viewers.IsValidIndex(CaptureActor->ViewerIndex) ? &Viewers[CaptureActor->ViewerIndex] : nullptr;
+	}
+	if (Viewers.Num() == 1)
+	{
+		return &Viewers[0];
+	}
+
+	FVector Centre = FVector::ZeroVector;
+	for (const FFoliageViewer& Viewer : Viewers)
+	{
+		Centre += Viewer.Location;
+	}
+	Centre /= Viewers.Num();
+
+	// Views that fit in a quarter of the capture around their centre share it, it still covers all of them by the
+	// time it's updated again. Views further apart need capture actors of their own, this one follows the first.
+	const double MergeRadius = CaptureActor->CaptureWidth / 4;
+	for (const FFoliageViewer& Viewer : Viewers)
+	{
+		if (FVector::Dist(Viewer.Location, Centre) > MergeRadius)
+		{
+			return &Viewers[0];
+		}
+	}
+
+	OutMergedViewer = Viewers[0];
+	OutMergedViewer.Location = Centre;
+	OutMergedViewer.Velocity = FVector::ZeroVector;
+	OutMergedViewer.Speed = 0.0;
+	for (const FFoliageViewer& Viewer : Viewers)
+	{
+		OutMergedViewer.Velocity += Viewer.Velocity / Viewers.Num();
+		OutMergedViewer.Speed = FMath::Max(OutMergedViewer.Speed, Viewer.Speed);
+	}
+	return &OutMergedViewer;
+}
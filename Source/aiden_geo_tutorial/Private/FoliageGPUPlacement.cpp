@@ -0,0 +1,213 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "FoliageGPUPlacement.h"
+
+#include "Algo/Sort.h"
+#include "Async/Async.h"
+#include "Engine/TextureRenderTarget.h"
+#include "RHIGPUReadback.h"
+
+#include "RenderGraphBuilder.h"
+
+#if FOLIAGE_GPU_PLACEMENT_ENABLED
+#include "GlobalShader.h"
+#include "RenderGraphUtils.h"
+#include "RenderTargetPool.h"
+#include "ShaderParameterStruct.h"
+
+/**
+ * @brief One thread per RT pixel: classifies it, then evaluates the rules of every geometry type of its class.
+ */
+class FFoliagePlacementCS : public FGlobalShader
+{
+public:
+	DECLARE_GLOBAL_SHADER(FFoliagePlacementCS);
+	SHADER_USE_PARAMETER_STRUCT(FFoliagePlacementCS, FGlobalShader);
+
+	static constexpr int32 ThreadGroupSize = 8;
+
+	BEGIN_SHADER_PARAMETER_STRUCT(FParameters, )
+		SHADER_PARAMETER_RDG_TEXTURE(Texture2D, ClassificationTexture)
+		SHADER_PARAMETER_RDG_TEXTURE(Texture2D, NormalDepthTexture)
+		SHADER_PARAMETER_RDG_BUFFER_SRV(StructuredBuffer<FFoliageGPUClass>, Classes)
+		SHADER_PARAMETER_RDG_BUFFER_SRV(StructuredBuffer<FFoliageGPUGeometryType>, GeometryTypes)
+		SHADER_PARAMETER_RDG_BUFFER_SRV(StructuredBuffer<float4>, NodeLocations)
+		SHADER_PARAMETER_RDG_BUFFER_SRV(StructuredBuffer<float4>, NodeUpPerMetre)
+		SHADER_PARAMETER_RDG_BUFFER_SRV(StructuredBuffer<float4>, NodeEastSouthUp)
+		SHADER_PARAMETER_RDG_BUFFER_UAV(RWStructuredBuffer<FFoliageGPUInstance>, OutInstances)
+		SHADER_PARAMETER_RDG_BUFFER_UAV(RWBuffer<uint>, OutInstanceCount)
+		SHADER_PARAMETER(FIntPoint, TextureSize)
+		SHADER_PARAMETER(FIntPoint, NodeCount)
+		SHADER_PARAMETER(int32, NodeSpacing)
+		SHADER_PARAMETER(uint32, NumClasses)
+		SHADER_PARAMETER(uint32, MaxInstances)
+		SHADER_PARAMETER(uint32, ClassificationIsClassID)
+		SHADER_PARAMETER(uint32, NormalDepthIsPacked)
+		SHADER_PARAMETER(int32, ColourTolerance)
+		SHADER_PARAMETER(float, CaptureElevation)
+		SHADER_PARAMETER(FVector4f, ActorInverseRotation)
+		SHADER_PARAMETER(float, ActorInverseScale)
+		SHADER_PARAMETER(FIntPoint, BaseCell)
+		SHADER_PARAMETER(FVector2f, CellOrigin)
+		SHADER_PARAMETER(FVector2f, CellRange)
+		SHADER_PARAMETER(uint32, PlacementSeedHash)
+	END_SHADER_PARAMETER_STRUCT()
+
+	static bool ShouldCompilePermutation(const FGlobalShaderPermutationParameters& Parameters)
+	{
+		return IsFeatureLevelSupported(Parameters.Platform, ERHIFeatureLevel::SM5);
+	}
+
+	static void ModifyCompilationEnvironment(const FGlobalShaderPermutationParameters& Parameters,
+	                                         FShaderCompilerEnvironment& OutEnvironment)
+	{
+		FGlobalShader::ModifyCompilationEnvironment(Parameters, OutEnvironment);
+		OutEnvironment.SetDefine(TEXT("THREADGROUP_SIZE"), ThreadGroupSize);
+	}
+};
+
+IMPLEMENT_GLOBAL_SHADER(FFoliagePlacementCS, "/FoliageShaders/Private/FoliagePlacement.usf", "MainCS", SF_Compute);
+
+template <typename T>
+static FRDGBufferSRVRef CreateUploadSRV(FRDGBuilder& GraphBuilder, const TCHAR* Name, const TArray<T>& Data)
+{
+	// Empty arrays still need a valid buffer to bind.
+	static const T Dummy = T();
+	const FRDGBufferRef Buffer = CreateStructuredBuffer(GraphBuilder, Name, sizeof(T), FMath::Max(Data.Num(), 1),
+	                                                    Data.Num() > 0 ? Data.GetData() : &Dummy,
+	                                                    FMath::Max(Data.Num(), 1) * sizeof(T));
+	return GraphBuilder.CreateSRV(Buffer);
+}
+#endif
+
+FFoliageGPUPlacement::FFoliageGPUPlacement() = default;
+
+FFoliageGPUPlacement::~FFoliageGPUPlacement() = default;
+
+void FFoliageGPUPlacement::Dispatch(const TSharedPtr<FFoliageGPUPlacement, ESPMode::ThreadSafe>& Placement,
+	FTextureRenderTargetResource* ClassificationRT, FTextureRenderTargetResource* NormalDepthRT)
+{
+	ENQUEUE_RENDER_COMMAND(FoliageGPUPlacement)(
+		[Placement, ClassificationRT, NormalDepthRT](FRHICommandListImmediate& RHICmdList)
+		{
+			FRDGBuilder GraphBuilder(RHICmdList);
+			Placement->AddPasses(GraphBuilder, ClassificationRT->GetRenderTargetTexture(),
+			                     NormalDepthRT->GetRenderTargetTexture());
+			GraphBuilder.Execute();
+		});
+}
+
+void FFoliageGPUPlacement::AddPasses(FRDGBuilder& GraphBuilder, FRHITexture* ClassificationTexture,
+	FRHITexture* NormalDepthTexture)
+{
+#if FOLIAGE_GPU_PLACEMENT_ENABLED
+	CountReadback = MakeUnique<FRHIGPUBufferReadback>(TEXT("FoliagePlacementCount"));
+	InstanceReadback = MakeUnique<FRHIGPUBufferReadback>(TEXT("FoliagePlacementInstances"));
+
+	const FRDGBufferRef Instances = GraphBuilder.CreateBuffer(
+		FRDGBufferDesc::CreateStructuredDesc(sizeof(FFoliageGPUInstance), FMath::Max<uint32>(Inputs.MaxInstances, 1)),
+		TEXT("FoliagePlacementInstances"));
+	const FRDGBufferRef Count = GraphBuilder.CreateBuffer(
+		FRDGBufferDesc::CreateBufferDesc(sizeof(uint32), 1), TEXT("FoliagePlacementCount"));
+	const FRDGBufferUAVRef CountUAV = GraphBuilder.CreateUAV(Count, PF_R32_UINT);
+	AddClearUAVPass(GraphBuilder, CountUAV, 0u);
+
+	FFoliagePlacementCS::FParameters* Parameters = GraphBuilder.AllocParameters<FFoliagePlacementCS::FParameters>();
+	Parameters->ClassificationTexture = GraphBuilder.RegisterExternalTexture(
+		CreateRenderTarget(ClassificationTexture, TEXT("FoliageDistributionMap")));
+	Parameters->NormalDepthTexture = GraphBuilder.RegisterExternalTexture(
+		CreateRenderTarget(NormalDepthTexture, TEXT("FoliageNormalAndDepthMap")));
+	Parameters->Classes = CreateUploadSRV(GraphBuilder, TEXT("FoliagePlacementClasses"), Inputs.Classes);
+	Parameters->GeometryTypes = CreateUploadSRV(GraphBuilder, TEXT("FoliagePlacementGeometryTypes"),
+	                                            Inputs.GeometryTypes);
+	Parameters->NodeLocations = CreateUploadSRV(GraphBuilder, TEXT("FoliagePlacementNodeLocations"),
+	                                            Inputs.NodeLocations);
+	Parameters->NodeUpPerMetre = CreateUploadSRV(GraphBuilder, TEXT("FoliagePlacementNodeUpPerMetre"),
+	                                             Inputs.NodeUpPerMetre);
+	Parameters->NodeEastSouthUp = CreateUploadSRV(GraphBuilder, TEXT("FoliagePlacementNodeEastSouthUp"),
+	                                              Inputs.NodeEastSouthUp);
+	Parameters->OutInstances = GraphBuilder.CreateUAV(Instances);
+	Parameters->OutInstanceCount = CountUAV;
+	Parameters->TextureSize = Inputs.TextureSize;
+	Parameters->NodeCount = Inputs.NodeCount;
+	Parameters->NodeSpacing = Inputs.NodeSpacing;
+	Parameters->NumClasses = Inputs.Classes.Num();
+	Parameters->MaxInstances = Inputs.MaxInstances;
+	Parameters->ClassificationIsClassID = Inputs.bClassificationIsClassID ? 1 : 0;
+	Parameters->NormalDepthIsPacked = Inputs.bNormalDepthIsPacked ? 1 : 0;
+	Parameters->ColourTolerance = Inputs.ColourTolerance;
+	Parameters->CaptureElevation = Inputs.CaptureElevation;
+	Parameters->ActorInverseRotation = Inputs.ActorInverseRotation;
+	Parameters->ActorInverseScale = Inputs.ActorInverseScale;
+	Parameters->BaseCell = Inputs.BaseCell;
+	Parameters->CellOrigin = Inputs.CellOrigin;
+	Parameters->CellRange = Inputs.CellRange;
+	Parameters->PlacementSeedHash = Inputs.PlacementSeedHash;
+
+	TShaderMapRef<FFoliagePlacementCS> ComputeShader(GetGlobalShaderMap(GMaxRHIFeatureLevel));
+	FComputeShaderUtils::AddPass(GraphBuilder, RDG_EVENT_NAME("FoliagePlacement"), ComputeShader, Parameters,
+	                             FComputeShaderUtils::GetGroupCount(Inputs.TextureSize,
+	                                                                FFoliagePlacementCS::ThreadGroupSize));
+
+	AddEnqueueCopyPass(GraphBuilder, CountReadback.Get(), Count, sizeof(uint32));
+	AddEnqueueCopyPass(GraphBuilder, InstanceReadback.Get(), Instances,
+	                   FMath::Max<uint32>(Inputs.MaxInstances, 1) * sizeof(FFoliageGPUInstance));
+#endif
+}
+
+void FFoliageGPUPlacement::Poll(FRHICommandListImmediate& RHICmdList)
+{
+	if (!CountReadback.IsValid() || !InstanceReadback.IsValid())
+	{
+		bFinished = true;
+		AsyncTask(ENamedThreads::AnyBackgroundThreadNormalTask, [OnPlaced = OnPlaced]()
+		{
+			OnPlaced(false, {}, 0);
+		});
+		return;
+	}
+	if (!CountReadback->IsReady() || !InstanceReadback->IsReady())
+	{
+		return;
+	}
+
+	// The mapped memory is only valid until Unlock.
+	const uint32* CountData = static_cast<const uint32*>(CountReadback->Lock(sizeof(uint32)));
+	const uint32 NumPlaced = CountData != nullptr ? *CountData : 0;
+	CountReadback->Unlock();
+	const uint32 NumInstances = FMath::Min(NumPlaced, Inputs.MaxInstances);
+
+	// Only the written part of the instance buffer is copied out.
+	TArray<FFoliageGPUInstance> Instances;
+	if (NumInstances > 0)
+	{
+		const void* InstanceData = InstanceReadback->Lock(NumInstances * sizeof(FFoliageGPUInstance));
+		if (InstanceData != nullptr)
+		{
+			Instances.SetNumUninitialized(NumInstances);
+			FMemory::Memcpy(Instances.GetData(), InstanceData, NumInstances * sizeof(FFoliageGPUInstance));
+		}
+		InstanceReadback->Unlock();
+	}
+	if (NumPlaced > Inputs.MaxInstances)
+	{
+		UE_LOG(LogTemp, Warning, TEXT("GPU foliage placement produced %u instances, only %u fit the buffer!"),
+		       NumPlaced, Inputs.MaxInstances);
+	}
+	CountReadback.Reset();
+	InstanceReadback.Reset();
+	bFinished = true;
+
+	AsyncTask(ENamedThreads::AnyBackgroundThreadNormalTask,
+	          [OnPlaced = OnPlaced, Instances = MoveTemp(Instances),
+	           NumDropped = static_cast<int32>(NumPlaced - NumInstances)]() mutable
+	{
+		// The shader appends in whatever order its threads run.
+		Algo::Sort(Instances, [](const FFoliageGPUInstance& A, const FFoliageGPUInstance& B)
+		{
+			return A.SortKey != B.SortKey ? A.SortKey < B.SortKey : A.GeometryTypeIndex < B.GeometryTypeIndex;
+		});
+		OnPlaced(true, MoveTemp(Instances), NumDropped);
+	});
+}
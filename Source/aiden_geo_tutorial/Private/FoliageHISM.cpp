@@ -1,4 +1,104 @@
-// Fill out your copyright notice in the Description page of Project Settings.
-
-
-#include "FoliageHISM.h"
\ No newline at end of file
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "FoliageHISM.h"
+#include "Async/Async.h"
+#include "FoliageStats.h"
+
+void UFoliageHISM::ReplaceInstancesAsync(FFoliageInstanceChunks&& InInstances, const TOptional<FTransform>& InAnchor)
+{
+	const int32 Serial = ++AsyncReplaceSerial;
+
+	if (InInstances.Num() == 0 || GetStaticMesh() == nullptr)
+	{
+		bIsReplacingInstances = false;
+		ClearInstances();
+		if (InAnchor.IsSet())
+		{
+			SetWorldTransform(*InAnchor);
+		}
+		return;
+	}
+
+	bIsReplacingInstances = true;
+
+	const FBox MeshBox = GetStaticMesh()->GetBounds().GetBox();
+	const int32 MaxInstancesPerLeaf = DesiredInstancesPerLeaf();
+	TWeakObjectPtr<UFoliageHISM> WeakThis(this);
+
+	// Same approach as the landscape grass builder: build the tree off the game thread, then hand it over.
+	AsyncTask(ENamedThreads::AnyBackgroundThreadNormalTask,
+	          [WeakThis, Serial, MeshBox, MaxInstancesPerLeaf, InAnchor, Instances = MoveTemp(InInstances)]() mutable
+	{
+		FOLIAGE_SCOPE_CYCLE_COUNTER(STAT_FoliageClusterTreeBuild);
+
+		const int32 NumInstances = Instances.Num();
+
+		TArray<FMatrix> InstanceTransforms;
+		InstanceTransforms.Reserve(NumInstances);
+		Instances.ForEachChunk([&InstanceTransforms](const auto& Chunk)
+		{
+			for (int32 InstanceIndex = 0; InstanceIndex < Chunk.Num(); ++InstanceIndex)
+			{
+				InstanceTransforms.Add(Chunk.GetTransform(InstanceIndex).ToMatrixWithScale());
+			}
+		});
+		// Also lets go of the cached tiles the instances were read from.
+		Instances.Empty();
+
+		TArray<float> InstanceCustomData;
+		TArray<FClusterNode> ClusterTree;
+		TArray<int32> SortedInstances;
+		TArray<int32> InstanceReorderTable;
+		int32 OcclusionLayerNum = 0;
+
+		BuildTreeAnyThread(InstanceTransforms, InstanceCustomData, 0, MeshBox, ClusterTree, SortedInstances,
+		                   InstanceReorderTable, OcclusionLayerNum, MaxInstancesPerLeaf, false);
+
+		// Instances are stored in tree order, so the prebuilt tree can index them directly.
+		TArray<FInstancedStaticMeshInstanceData> InstanceData;
+		InstanceData.SetNum(NumInstances);
+		for (int32 InstanceIndex = 0; InstanceIndex < NumInstances; ++InstanceIndex)
+		{
+			InstanceData[InstanceIndex].Transform = InstanceTransforms[SortedInstances[InstanceIndex]];
+		}
+
+		AsyncTask(ENamedThreads::GameThread,
+		          [WeakThis, Serial, NumInstances, OcclusionLayerNum, InAnchor, InstanceData = MoveTemp(InstanceData),
+			          ClusterTree = MoveTemp(ClusterTree)]() mutable
+		{
+			UFoliageHISM* FoliageHISM = WeakThis.Get();
+			if (FoliageHISM == nullptr || FoliageHISM->AsyncReplaceSerial != Serial)
+			{
+				return;
+			}
+			if (InAnchor.IsSet())
+			{
+				FoliageHISM->SetWorldTransform(*InAnchor);
+			}
+			FoliageHISM->AcceptPrebuiltTree(InstanceData, ClusterTree, OcclusionLayerNum, NumInstances);
+			FoliageHISM->bIsReplacingInstances = false;
+		});
+	});
+}
+
+void UFoliageHISM::FlipBuffers()
+{
+	if (Twin == nullptr)
+	{
+		return;
+	}
+
+	UFoliageHISM* OldFront = GetFront();
+	UFoliageHISM* NewFront = GetBack();
+
+	// Hidden components don't collide either.
+	NewFront->SetCollisionEnabled(OldFront->GetCollisionEnabled());
+	OldFront->SetCollisionEnabled(ECollisionEnabled::NoCollision);
+	NewFront->SetVisibility(true);
+	OldFront->SetVisibility(false);
+
+	bTwinIsFront = !bTwinIsFront;
+	bBackReady = false;
+	bBackNeedsClear = OldFront->GetInstanceCount() > 0;
+}
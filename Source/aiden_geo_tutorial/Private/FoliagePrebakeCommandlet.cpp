@@ -0,0 +1,237 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "FoliagePrebakeCommandlet.h"
+
+#include "Components/SceneCaptureComponent.h"
+#include "Containers/Ticker.h"
+#include "Engine/Engine.h"
+#include "EngineUtils.h"
+#include "FoliageCaptureActor.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+
+UFoliagePrebakeCommandlet::UFoliagePrebakeCommandlet()
+{
+	IsClient = false;
+	IsEditor = true;
+	IsServer = false;
+	LogToConsole = true;
+}
+
+int32 UFoliagePrebakeCommandlet::Main(const FString& Params)
+{
+	FString MapName;
+	FString RegionsFileName;
+	if (!FParse::Value(*Params, TEXT("Map="), MapName) || !FParse::Value(*Params, TEXT("Regions="), RegionsFileName))
+	{
+		UE_LOG(LogTemp, Error, TEXT("Usage: -run=FoliagePrebake -Map=<Map> -Regions=<File> [-Output=<Dir>] "
+		                            "[-Spacing=<Degrees>] [-WarmupSeconds=<Seconds>] [-Timeout=<Seconds>]"));
+		return 1;
+	}
+
+	FString OutputDirectory = FPaths::Combine(FPaths::ProjectContentDir(), TEXT("FoliagePacks"));
+	FParse::Value(*Params, TEXT("Output="), OutputDirectory);
+	OutputDirectory = FPaths::ConvertRelativePathToFull(OutputDirectory);
+	double Spacing = 0.0;
+	FParse::Value(*Params, TEXT("Spacing="), Spacing);
+	double WarmupSeconds = 5.0;
+	FParse::Value(*Params, TEXT("WarmupSeconds="), WarmupSeconds);
+	double Timeout = 60.0;
+	FParse::Value(*Params, TEXT("Timeout="), Timeout);
+
+	TArray<FBox2D> Regions;
+	if (!LoadRegions(RegionsFileName, Regions))
+	{
+		return 1;
+	}
+
+	UPackage* Package = LoadPackage(nullptr, *MapName, LOAD_None);
+	UWorld* World = Package != nullptr ? UWorld::FindWorldInPackage(Package) : nullptr;
+	if (World == nullptr)
+	{
+		UE_LOG(LogTemp, Error, TEXT("Failed to load map %s"), *MapName);
+		return 1;
+	}
+
+	World->AddToRoot();
+	World->WorldType = EWorldType::Game;
+	FWorldContext& WorldContext = GEngine->CreateNewWorldContext(EWorldType::Game);
+	WorldContext.SetCurrentWorld(World);
+	if (!World->bIsWorldInitialized)
+	{
+		World->InitWorld(UWorld::InitializationValues()
+		                 .AllowAudioPlayback(false)
+		                 .RequiresHitProxies(false)
+		                 .CreateNavigation(false)
+		                 .CreateAISystem(false));
+	}
+	World->UpdateWorldComponents(true, false);
+
+	TActorIterator<AFoliageCaptureActor> It(World);
+	AFoliageCaptureActor* CaptureActor = It ? *It : nullptr;
+	if (CaptureActor == nullptr)
+	{
+		UE_LOG(LogTemp, Error, TEXT("Map %s has no foliage capture actor"), *MapName);
+		GEngine->DestroyWorldContext(World);
+		World->DestroyWorld(false);
+		World->RemoveFromRoot();
+		return 1;
+	}
+
+	// Every complete cell of every build ends up in the output directory. Partitioning is read in BeginPlay.
+	CaptureActor->bPartitionHISMsByGridCell = true;
+	CaptureActor->bAnchorHISMs = true;
+	CaptureActor->bUseTileCache = true;
+	CaptureActor->bUseDiskTileCache = true;
+	CaptureActor->TileCacheDirectory = OutputDirectory;
+	CaptureActor->PrebakedTileDirectory.Reset();
+
+	const FURL URL;
+	World->SetGameMode(URL);
+	World->InitializeActorsForPlay(URL);
+	World->BeginPlay();
+
+	if (!IsValid(CaptureActor->Georeference))
+	{
+		CaptureActor->Georeference = ACesiumGeoreference::GetDefaultGeoreference(CaptureActor);
+	}
+
+	int32 Result = 0;
+	if (!CaptureActor->CanUseTileCache())
+	{
+		UE_LOG(LogTemp, Error, TEXT("%s can't cache its cells, density falloffs can't be pre-baked"),
+		       *CaptureActor->GetName());
+		Result = 1;
+	}
+
+	int32 NumCaptures = 0;
+	int32 NumFailed = 0;
+	const auto Capture = [&](double Longitude, double Latitude)
+	{
+		const FVector Location = CaptureActor->Georeference->TransformLongitudeLatitudeHeightToUnreal(
+			FVector(Longitude, Latitude, CaptureActor->CaptureElevation));
+
+		// Give the tileset time to stream in the terrain before capturing it.
+		TickWorld(World, WarmupSeconds, []() { return false; });
+
+		const int32 NumBuildsStarted = CaptureActor->GetNumBuildsStarted();
+		CaptureActor->OnUpdate(Location);
+		const bool bBuilt = TickWorld(World, Timeout, [&]()
+		{
+			return CaptureActor->GetNumBuildsStarted() > NumBuildsStarted && !CaptureActor->IsBuilding();
+		});
+
+		++NumCaptures;
+		if (!bBuilt)
+		{
+			++NumFailed;
+			UE_LOG(LogTemp, Warning, TEXT("Capture at %f, %f wasn't built within %f seconds"), Longitude, Latitude,
+			       Timeout);
+		}
+	};
+
+	for (const FBox2D& Region : Regions)
+	{
+		if (Result != 0)
+		{
+			break;
+		}
+		// The capture width in degrees is only known once the actor has been placed.
+		for (double Latitude = Region.Min.Y;;)
+		{
+			for (double Longitude = Region.Min.X;;)
+			{
+				Capture(Longitude, Latitude);
+				const double Step = Spacing > 0.0 ? Spacing : CaptureActor->CaptureWidthInDegrees;
+				if (Longitude >= Region.Max.X || Step <= 0.0)
+				{
+					break;
+				}
+				Longitude = FMath::Min(Longitude + Step, Region.Max.X);
+			}
+			const double Step = Spacing > 0.0 ? Spacing : CaptureActor->CaptureWidthInDegrees;
+			if (Latitude >= Region.Max.Y || Step <= 0.0)
+			{
+				break;
+			}
+			Latitude = FMath::Min(Latitude + Step, Region.Max.Y);
+		}
+	}
+
+	CaptureActor->WaitForTileCacheWrites();
+	UE_LOG(LogTemp, Display, TEXT("Pre-baked %d foliage captures into %s, %d timed out"), NumCaptures - NumFailed,
+	       *OutputDirectory, NumFailed);
+
+	World->EndPlay(EEndPlayReason::Quit);
+	GEngine->DestroyWorldContext(World);
+	World->DestroyWorld(false);
+	World->RemoveFromRoot();
+
+	return Result != 0 || NumFailed > 0 ? 1 : 0;
+}
+
+bool UFoliagePrebakeCommandlet::LoadRegions(const FString& FileName, TArray<FBox2D>& OutRegions)
+{
+	TArray<FString> Lines;
+	if (!FFileHelper::LoadFileToStringArray(Lines, *FileName))
+	{
+		UE_LOG(LogTemp, Error, TEXT("Failed to read regions file %s"), *FileName);
+		return false;
+	}
+
+	for (int32 LineIndex = 0; LineIndex < Lines.Num(); ++LineIndex)
+	{
+		const FString Line = Lines[LineIndex].TrimStartAndEnd();
+		if (Line.IsEmpty() || Line.StartsWith(TEXT("#")))
+		{
+			continue;
+		}
+
+		TArray<FString> Values;
+		Line.ParseIntoArray(Values, TEXT(","));
+		if (Values.Num() != 2 && Values.Num() != 4)
+		{
+			UE_LOG(LogTemp, Error, TEXT("%s:%d: expected 2 or 4 values"), *FileName, LineIndex + 1);
+			return false;
+		}
+
+		const FVector2D Min(FCString::Atod(*Values[0]), FCString::Atod(*Values[1]));
+		const FVector2D Max = Values.Num() == 4
+			? FVector2D(FCString::Atod(*Values[2]), FCString::Atod(*Values[3]))
+			: Min;
+		OutRegions.Add(FBox2D(FVector2D::Min(Min, Max), FVector2D::Max(Min, Max)));
+	}
+
+	if (OutRegions.Num() == 0)
+	{
+		UE_LOG(LogTemp, Error, TEXT("Regions file %s is empty"), *FileName);
+		return false;
+	}
+	return true;
+}
+
+bool UFoliagePrebakeCommandlet::TickWorld(UWorld* World, double Seconds, TFunctionRef<bool()> IsDone)
+{
+	const double StartTime = FPlatformTime::Seconds();
+	double LastTime = StartTime;
+	while (!IsDone())
+	{
+		const double Now = FPlatformTime::Seconds();
+		if (Now - StartTime >= Seconds)
+		{
+			return false;
+		}
+		const float DeltaSeconds = FMath::Max(static_cast<float>(Now - LastTime), 0.001f);
+		LastTime = Now;
+
+		World->Tick(LEVELTICK_All, DeltaSeconds);
+		FTSTicker::GetCoreTicker().Tick(DeltaSeconds);
+		// There's no viewport to render the scene captures, readbacks and async builds report back to the game thread.
+		USceneCaptureComponent::UpdateDeferredCaptures(World->Scene);
+		FlushRenderingCommands();
+		FTaskGraphInterface::Get().ProcessThreadUntilIdle(ENamedThreads::GameThread);
+		++GFrameCounter;
+	}
+	return true;
+}
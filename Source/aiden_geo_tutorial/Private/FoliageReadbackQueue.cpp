@@ -0,0 +1,55 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "FoliageReadbackQueue.h"
+
+#include "HAL/IConsoleManager.h"
+#include "RenderingThread.h"
+
+static TAutoConsoleVariable<int32> CVarMaxReadbacksFinishedPerFrame(
+	TEXT("foliage.MaxReadbacksFinishedPerFrame"),
+	2,
+	TEXT("Most foliage readbacks, counted across all capture actors, that are copied out of their staging buffers ")
+	TEXT("in one frame. The rest wait for the next poll. 0 for no limit."));
+
+void FFoliageReadbackQueue::Add(const TSharedRef<FFoliageReadback, ESPMode::ThreadSafe>& Readback)
+{
+	Pending.Add(Readback);
+}
+
+void FFoliageReadbackQueue::Poll()
+{
+	if (LastPollFrame == GFrameCounter)
+	{
+		return;
+	}
+	LastPollFrame = GFrameCounter;
+
+	Pending.RemoveAll([](const TSharedRef<FFoliageReadback, ESPMode::ThreadSafe>& Readback)
+	{
+		return Readback->bFinished.load();
+	});
+
+	if (Pending.Num() == 0 || bPolling->exchange(true))
+	{
+		return;
+	}
+
+	// Oldest first, so a readback that landed isn't held back by the ones queued after it.
+	const int32 MaxFinished = CVarMaxReadbacksFinishedPerFrame.GetValueOnGameThread();
+	ENQUEUE_RENDER_COMMAND(FoliagePollReadbacks)(
+		[Readbacks = Pending, bPolling = bPolling, MaxFinished](FRHICommandListImmediate& RHICmdList)
+		{
+			int32 NumFinished = 0;
+			for (const TSharedRef<FFoliageReadback, ESPMode::ThreadSafe>& Readback : Readbacks)
+			{
+				if (MaxFinished > 0 && NumFinished >= MaxFinished)
+				{
+					break;
+				}
+				Readback->Poll(RHICmdList);
+				NumFinished += Readback->bFinished ? 1 : 0;
+			}
+			*bPolling = false;
+		});
+}
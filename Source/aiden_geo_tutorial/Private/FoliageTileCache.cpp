@@ -0,0 +1,351 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "FoliageTileCache.h"
+
+#include "Async/Async.h"
+#include "Async/MappedFileHandle.h"
+#include "HAL/FileManager.h"
+#include "HAL/PlatformFileManager.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+
+namespace
+{
+	constexpr uint32 TileMagic = 0x434C4F46; // "FOLC"
+	constexpr uint32 TileVersion = 2;
+
+	/** Arrays start at this alignment relative to the start of the file, so they can be used in place. */
+	constexpr int64 ArrayAlignment = 16;
+
+	template <typename T>
+	void WriteValue(TArray<uint8>& OutData, const T& Value)
+	{
+		OutData.Append(reinterpret_cast<const uint8*>(&Value), sizeof(T));
+	}
+
+	template <typename T>
+	void WriteArray(TArray<uint8>& OutData, const T* Values, int32 Num)
+	{
+		OutData.AddZeroed(Align(OutData.Num(), ArrayAlignment) - OutData.Num());
+		OutData.Append(reinterpret_cast<const uint8*>(Values), Num * sizeof(T));
+	}
+
+	/**
+	 * @brief Bounds checked reads out of a mapped file.
+	 */
+	struct FTileReader
+	{
+		const uint8* Data;
+		int64 Size;
+		int64 Offset = 0;
+
+		template <typename T>
+		bool Read(T& OutValue)
+		{
+			if (Offset + static_cast<int64>(sizeof(T)) > Size)
+			{
+				return false;
+			}
+			FMemory::Memcpy(&OutValue, Data + Offset, sizeof(T));
+			Offset += sizeof(T);
+			return true;
+		}
+
+		/**
+		 * @brief Points OutValues at Num values in place, without copying them.
+		 */
+		template <typename T>
+		bool ReadArray(const T*& OutValues, int32 Num)
+		{
+			const int64 Start = Align(Offset, ArrayAlignment);
+			const int64 NumBytes = static_cast<int64>(Num) * sizeof(T);
+			if (Num < 0 || Start + NumBytes > Size || !IsAligned(Data + Start, alignof(T)))
+			{
+				return false;
+			}
+			OutValues = reinterpret_cast<const T*>(Data + Start);
+			Offset = Start + NumBytes;
+			return true;
+		}
+	};
+}
+
+FString FFoliageTileCacheKey::GetFileName() const
+{
+	return FString::Printf(TEXT("%08x_%dx%d_%d_%d.foliage"), SettingsHash, Resolution.X, Resolution.Y, Cell.X, Cell.Y);
+}
+
+FFoliageCachedTile::FFoliageCachedTile() = default;
+
+FFoliageCachedTile::~FFoliageCachedTile() = default;
+
+void FFoliageCachedTile::SetGeometryTypes(TArray<FFoliageInstanceBuffer>&& InBuffers)
+{
+	Buffers = MoveTemp(InBuffers);
+	GeometryTypes.Reset(Buffers.Num());
+	for (const FFoliageInstanceBuffer& Instances : Buffers)
+	{
+		GeometryTypes.Emplace(Instances);
+	}
+}
+
+void FFoliageCachedTile::Serialize(TArray<uint8>& OutData) const
+{
+	WriteValue(OutData, TileMagic);
+	WriteValue(OutData, TileVersion);
+	WriteValue(OutData, AnchorLongitudeLatitudeHeight);
+	WriteValue(OutData, AnchorRotation);
+	WriteValue(OutData, AnchorScale);
+	WriteValue(OutData, GeometryTypes.Num());
+	for (const FFoliageInstanceView& Instances : GeometryTypes)
+	{
+		WriteValue(OutData, Instances.Num());
+		WriteArray(OutData, Instances.Locations, Instances.Num());
+		WriteArray(OutData, Instances.Rotations, Instances.Num());
+		WriteArray(OutData, Instances.Scales, Instances.Num());
+	}
+}
+
+bool FFoliageCachedTile::Deserialize(const uint8* Data, int64 Size)
+{
+	FTileReader Reader{Data, Size};
+
+	uint32 Magic = 0;
+	uint32 Version = 0;
+	int32 NumGeometryTypes = 0;
+	if (!Reader.Read(Magic) || Magic != TileMagic || !Reader.Read(Version) || Version != TileVersion ||
+		!Reader.Read(AnchorLongitudeLatitudeHeight) || !Reader.Read(AnchorRotation) || !Reader.Read(AnchorScale) ||
+		!Reader.Read(NumGeometryTypes) || NumGeometryTypes < 0)
+	{
+		return false;
+	}
+
+	Buffers.Empty();
+	GeometryTypes.SetNum(NumGeometryTypes);
+	for (FFoliageInstanceView& Instances : GeometryTypes)
+	{
+		if (!Reader.Read(Instances.NumInstances) || !Reader.ReadArray(Instances.Locations, Instances.NumInstances) ||
+			!Reader.ReadArray(Instances.Rotations, Instances.NumInstances) ||
+			!Reader.ReadArray(Instances.Scales, Instances.NumInstances))
+		{
+			GeometryTypes.Empty();
+			return false;
+		}
+	}
+	return true;
+}
+
+bool FFoliageCachedTile::LoadMapped(const FString& FileName)
+{
+	IPlatformFile& PlatformFile = FPlatformFileManager::Get().GetPlatformFile();
+	TUniquePtr<IMappedFileHandle> File(PlatformFile.OpenMapped(*FileName));
+	if (!File.IsValid())
+	{
+		return false;
+	}
+	// Called on a worker thread, so let the pages be read ahead of the commit that reads them.
+	TUniquePtr<IMappedFileRegion> Region(File->MapRegion(0, File->GetFileSize(), true));
+	if (!Region.IsValid() || !Deserialize(Region->GetMappedPtr(), Region->GetMappedSize()))
+	{
+		return false;
+	}
+	MappedRegion = MoveTemp(Region);
+	MappedFile = MoveTemp(File);
+	return true;
+}
+
+FFoliageTileCache::FFoliageTileCache()
+	: MemoryCache(64)
+	, NumPendingWrites(MakeShared<FThreadSafeCounter, ESPMode::ThreadSafe>())
+	, LifetimeToken(MakeShared<bool, ESPMode::ThreadSafe>(true))
+{
+}
+
+void FFoliageTileCache::Configure(int32 InMaxTiles, const FString& InDiskDirectory,
+	const FString& InPrebakedDirectory)
+{
+	const int32 MaxTiles = FMath::Max(InMaxTiles, 1);
+	if (MaxTiles != MemoryCache.Max())
+	{
+		MemoryCache.Empty(MaxTiles);
+	}
+	// Listed on the game thread, but only when a directory changes rather than on every lookup.
+	if (InDiskDirectory != DiskDirectory)
+	{
+		DiskDirectory = InDiskDirectory;
+		DiskFiles = ListTileFiles(DiskDirectory);
+	}
+	if (InPrebakedDirectory != PrebakedDirectory)
+	{
+		PrebakedDirectory = InPrebakedDirectory;
+		PrebakedFiles = ListTileFiles(PrebakedDirectory);
+	}
+}
+
+TSharedPtr<const FFoliageCachedTile, ESPMode::ThreadSafe> FFoliageTileCache::Find(const FFoliageTileCacheKey& Key)
+{
+	const TSharedPtr<const FFoliageCachedTile, ESPMode::ThreadSafe>* Tile = MemoryCache.FindAndTouch(Key);
+	return Tile != nullptr ? *Tile : nullptr;
+}
+
+bool FFoliageTileCache::IsOnDisk(const FFoliageTileCacheKey& Key) const
+{
+	if (DiskFiles.Num() == 0 && PrebakedFiles.Num() == 0)
+	{
+		return false;
+	}
+	const FString FileName = Key.GetFileName();
+	return PrebakedFiles.Contains(FileName) || DiskFiles.Contains(FileName);
+}
+
+void FFoliageTileCache::LoadAsync(const FFoliageTileCacheKey& Key, FOnFoliageTileLoaded&& OnLoaded)
+{
+	if (TArray<FOnFoliageTileLoaded>* Pending = PendingLoads.Find(Key))
+	{
+		Pending->Add(MoveTemp(OnLoaded));
+		return;
+	}
+
+	// Pre-baked tiles are searched before the disk cache.
+	const FString TileFileName = Key.GetFileName();
+	TArray<FString> FileNames;
+	if (PrebakedFiles.Contains(TileFileName))
+	{
+		FileNames.Add(FPaths::Combine(PrebakedDirectory, TileFileName));
+	}
+	if (DiskFiles.Contains(TileFileName))
+	{
+		FileNames.Add(FPaths::Combine(DiskDirectory, TileFileName));
+	}
+	if (FileNames.Num() == 0)
+	{
+		// Still called back later rather than from inside LoadAsync, like a load that comes up empty.
+		AsyncTask(ENamedThreads::GameThread,
+		          [OnLoaded = MoveTemp(OnLoaded), WeakLifetime = TWeakPtr<bool, ESPMode::ThreadSafe>(LifetimeToken)]()
+		{
+			if (WeakLifetime.IsValid())
+			{
+				OnLoaded(nullptr);
+			}
+		});
+		return;
+	}
+	PendingLoads.Add(Key).Add(MoveTemp(OnLoaded));
+
+	AsyncTask(ENamedThreads::AnyBackgroundThreadNormalTask,
+	          [this, Key, FileNames = MoveTemp(FileNames),
+		          WeakLifetime = TWeakPtr<bool, ESPMode::ThreadSafe>(LifetimeToken)]() mutable
+	{
+		TSharedPtr<const FFoliageCachedTile, ESPMode::ThreadSafe> Tile;
+		for (const FString& FileName : FileNames)
+		{
+			Tile = LoadFromDisk(FileName);
+			if (Tile.IsValid())
+			{
+				break;
+			}
+		}
+
+		AsyncTask(ENamedThreads::GameThread, [this, Key, Tile = MoveTemp(Tile), WeakLifetime]()
+		{
+			// The cache is destroyed on the game thread, so it can't go away while this runs.
+			if (!WeakLifetime.IsValid())
+			{
+				return;
+			}
+			if (Tile.IsValid())
+			{
+				MemoryCache.Add(Key, Tile);
+			}
+			else
+			{
+				// Invalid or deleted since it was listed, don't try it again.
+				const FString TileFileName = Key.GetFileName();
+				PrebakedFiles.Remove(TileFileName);
+				DiskFiles.Remove(TileFileName);
+			}
+
+			TArray<FOnFoliageTileLoaded> Callbacks;
+			PendingLoads.RemoveAndCopyValue(Key, Callbacks);
+			for (const FOnFoliageTileLoaded& Callback : Callbacks)
+			{
+				Callback(Tile);
+			}
+		});
+	});
+}
+
+void FFoliageTileCache::Add(const FFoliageTileCacheKey& Key,
+	const TSharedRef<const FFoliageCachedTile, ESPMode::ThreadSafe>& Tile)
+{
+	MemoryCache.Add(Key, Tile);
+
+	// Tiles only depend on their key, so one that is already on disk doesn't need writing again.
+	const FString TileFileName = Key.GetFileName();
+	if (DiskDirectory.IsEmpty() || DiskFiles.Contains(TileFileName))
+	{
+		return;
+	}
+	// Listed right away, a load that comes before the write finished fails and the cell is rebuilt.
+	DiskFiles.Add(TileFileName);
+
+	// Tiles are immutable once cached, so they can be written out while the game thread carries on.
+	NumPendingWrites->Increment();
+	AsyncTask(ENamedThreads::AnyBackgroundThreadNormalTask,
+	          [Tile, FileName = FPaths::Combine(DiskDirectory, TileFileName), NumPendingWrites = NumPendingWrites]()
+	{
+		TArray<uint8> Data;
+		Tile->Serialize(Data);
+
+		// Written under a temporary name first, so a mapped reader never sees a partial file.
+		const FString TempFileName = FileName + TEXT(".tmp");
+		if (!FFileHelper::SaveArrayToFile(Data, *TempFileName) ||
+			!IFileManager::Get().Move(*FileName, *TempFileName, true, true))
+		{
+			UE_LOG(LogTemp, Warning, TEXT("Failed to write foliage tile cache file %s"), *FileName);
+		}
+		NumPendingWrites->Decrement();
+	});
+}
+
+void FFoliageTileCache::Empty()
+{
+	MemoryCache.Empty(MemoryCache.Max());
+}
+
+void FFoliageTileCache::WaitForPendingWrites() const
+{
+	while (NumPendingWrites->GetValue() > 0)
+	{
+		FPlatformProcess::Sleep(0.01f);
+	}
+}
+
+TSharedPtr<const FFoliageCachedTile, ESPMode::ThreadSafe> FFoliageTileCache::LoadFromDisk(const FString& FileName)
+{
+	if (!FPlatformFileManager::Get().GetPlatformFile().FileExists(*FileName))
+	{
+		return nullptr;
+	}
+
+	TSharedRef<FFoliageCachedTile, ESPMode::ThreadSafe> Tile = MakeShared<FFoliageCachedTile, ESPMode::ThreadSafe>();
+	if (!Tile->LoadMapped(FileName))
+	{
+		UE_LOG(LogTemp, Warning, TEXT("Ignoring invalid foliage tile cache file %s"), *FileName);
+		return nullptr;
+	}
+	return Tile;
+}
+
+TSet<FString> FFoliageTileCache::ListTileFiles(const FString& Directory)
+{
+	TSet<FString> FileNames;
+	if (!Directory.IsEmpty())
+	{
+		TArray<FString> Found;
+		IFileManager::Get().FindFiles(Found, *FPaths::Combine(Directory, TEXT("*.foliage")), true, false);
+		FileNames.Append(MoveTemp(Found));
+	}
+	return FileNames;
+}
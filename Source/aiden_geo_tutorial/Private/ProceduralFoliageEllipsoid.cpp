@@ -1,57 +1,96 @@
-// Fill out your copyright notice in the Description page of Project Settings.
-
-
-#include "ProceduralFoliageEllipsoid.h"
-
-#include "Kismet/GameplayStatics.h"
-
-void AProceduralFoliageEllipsoid::Tick(float DeltaSeconds)
-{
-	Super::Tick(DeltaSeconds);
-	ACesiumGeoreference* Geo = this->ResolveGeoreference();
-	if (IsValid(Geo) && IsValid(FoliageCaptureActor))
-	{
-		// Don't start another build while the previous one is still running
-		if (!FoliageCaptureActor->IsBuilding())
-		{
-			APlayerCameraManager* CameraManager = UGameplayStatics::GetPlayerCameraManager(this, 0);
-			if (IsValid(CameraManager))
-			{
-				// Project the camera coordinates to geographic coordinates.
-				const FVector CameraLocation = CameraManager->GetCameraLocation();
-				glm::dvec3 GeographicCameraLocation = Geo->TransformUnrealToLongitudeLatitudeHeight(
-					glm::dvec3(CameraLocation.X, CameraLocation.Y, CameraLocation.Z));
-
-				// Keep original camera elevation as a variable, and swap z with the capture elevation (this will be the new capture location).
-				const double CurrentCameraElevation = GeographicCameraLocation.z;
-				GeographicCameraLocation.z = FoliageCaptureActor->CaptureElevation;
-
-				// Ensure CesiumGeoreference is valid
-				if (!IsValid(FoliageCaptureActor->Georeference))
-				{
-					FoliageCaptureActor->Georeference = Geo;
-				}
-			
-				// Current geographic location of the foliage capture actor (used to measure the distance).
-				const glm::dvec3 CurrentFoliageCaptureGeographicLocation = Geo->TransformUnrealToLongitudeLatitudeHeight(glm::dvec3(
-					FoliageCaptureActor->GetActorLocation().X, FoliageCaptureActor->GetActorLocation().Y, FoliageCaptureActor->GetActorLocation().Z
-				));
-	
-				const double Distance = glm::distance(GeographicCameraLocation, CurrentFoliageCaptureGeographicLocation);
-				const double Speed = CameraManager->GetVelocity().Size();
-
-				// New capture position
-				const glm::dvec3 NewFoliageCaptureUELocation = Geo->TransformLongitudeLatitudeHeightToUnreal(GeographicCameraLocation);
-
-				FoliageCaptureActor->PlayerSpeed = Speed;
-
-				// Only update the foliage capture actor if the player is outside of the capture grid, within elevation and a speed less than 5000.
-				if ((Distance > FoliageCaptureActor->CaptureWidthInDegrees/2 && CurrentCameraElevation <= FoliageCaptureActor->CaptureElevation && Speed < FoliageCaptureActor->PlayerSpeedUpdateThreshold && !FoliageCaptureActor->IsWaiting()) || !bHasFoliageSpawned)
-				{
-					FoliageCaptureActor->OnUpdate(FVector(NewFoliageCaptureUELocation.x, NewFoliageCaptureUELocation.y, NewFoliageCaptureUELocation.z));
-					bHasFoliageSpawned = true;
-				}
-			}
-		}
-	}
-}
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "ProceduralFoliageEllipsoid.h"
+
+#include "FoliageCaptureSubsystem.h"
+
+void AProceduralFoliageEllipsoid::BeginPlay()
+{
+	Super::BeginPlay();
+	if (UFoliageCaptureSubsystem* Subsystem = GetWorld()->GetSubsystem<UFoliageCaptureSubsystem>())
+	{
+		Subsystem->RegisterTileset(this);
+	}
+}
+
+void AProceduralFoliageEllipsoid::EndPlay(const EEndPlayReason::Type EndPlayReason)
+{
+	if (UFoliageCaptureSubsystem* Subsystem = GetWorld()->GetSubsystem<UFoliageCaptureSubsystem>())
+	{
+		Subsystem->UnregisterTileset(this);
+	}
+	Super::EndPlay(EndPlayReason);
+}
+
+void AProceduralFoliageEllipsoid::Tick(float DeltaSeconds)
+{
+	FOLIAGE_SCOPE_CYCLE_COUNTER(STAT_FoliageEllipsoidTick);
+	Super::Tick(DeltaSeconds);
+
+	// Every tileset asks, the subsystem updates all of their capture actors once per frame.
+	if (UFoliageCaptureSubsystem* Subsystem = GetWorld()->GetSubsystem<UFoliageCaptureSubsystem>())
+	{
+		Subsystem->Update(DeltaSeconds);
+	}
+}
+
+void AProceduralFoliageEllipsoid::UpdateCaptureActor(AFoliageCaptureActor* CaptureActor, ACesiumGeoreference* Geo,
+	const FFoliageViewer& Viewer)
+{
+	// Don't start another build while the pipeline is full
+	if (!IsValid(CaptureActor) || !CaptureActor->CanStartBuild())
+	{
+		return;
+	}
+
+	FVector CameraLocation = Viewer.Location;
+	double Speed = Viewer.Speed;
+
+	// Lead the camera by the time the last builds took to show up.
+	if (CaptureActor->bPredictCaptureLocation)
+	{
+		const float LeadTime = FMath::Min(CaptureActor->MeasuredBuildLatency, CaptureActor->MaxPredictionTime);
+		CameraLocation += Viewer.Velocity * LeadTime;
+		Speed = Viewer.Velocity.Size();
+	}
+
+	// Project the camera coordinates to geographic coordinates.
+	glm::dvec3 GeographicCameraLocation = Geo->TransformUnrealToLongitudeLatitudeHeight(
+		glm::dvec3(CameraLocation.X, CameraLocation.Y, CameraLocation.Z));
+
+	// Keep original camera elevation as a variable, and swap z with the capture elevation (this will be the new capture location).
+	const double CurrentCameraElevation = GeographicCameraLocation.z;
+	GeographicCameraLocation.z = CaptureActor->CaptureElevation;
+
+	// Ensure CesiumGeoreference is valid
+	if (!IsValid(CaptureActor->Georeference))
+	{
+		CaptureActor->Georeference = Geo;
+	}
+
+	// Current geographic location of the foliage capture actor (used to measure the distance).
+	const glm::dvec3 CurrentFoliageCaptureGeographicLocation = Geo->TransformUnrealToLongitudeLatitudeHeight(glm::dvec3(
+		CaptureActor->GetActorLocation().X, CaptureActor->GetActorLocation().Y, CaptureActor->GetActorLocation().Z
+	));
+
+	const double Distance = glm::distance(GeographicCameraLocation, CurrentFoliageCaptureGeographicLocation);
+
+	// New capture position
+	const glm::dvec3 NewFoliageCaptureUELocation = Geo->TransformLongitudeLatitudeHeightToUnreal(GeographicCameraLocation);
+
+	CaptureActor->PlayerSpeed = Speed;
+
+	// Only update the foliage capture actor if the player is outside of the capture grid, within elevation and a speed less than 5000.
+	// Predicted captures are placed where the camera will be, so they keep up at any speed.
+	const double UpdateDistance = CaptureActor->CaptureWidthInDegrees / 2 * CaptureActor->UpdateDistanceFraction;
+	const bool bHasFoliageSpawned = SpawnedCaptureActors.Contains(CaptureActor);
+	const bool bSlowEnough = CaptureActor->bPredictCaptureLocation || Speed < CaptureActor->PlayerSpeedUpdateThreshold;
+	const bool bNeedsUpdate = (Distance > UpdateDistance && CurrentCameraElevation <= CaptureActor->CaptureElevation && bSlowEnough && !CaptureActor->IsWaiting()) || !bHasFoliageSpawned || CaptureActor->NeedsCapture();
+	UFoliageCaptureSubsystem* Subsystem = GetWorld()->GetSubsystem<UFoliageCaptureSubsystem>();
+	if (bNeedsUpdate && (Subsystem == nullptr || Subsystem->TryAcquireBuildSlot(CaptureActor)))
+	{
+		CaptureActor->OnUpdate(FVector(NewFoliageCaptureUELocation.x, NewFoliageCaptureUELocation.y, NewFoliageCaptureUELocation.z));
+		SpawnedCaptureActors.Add(CaptureActor);
+	}
+}
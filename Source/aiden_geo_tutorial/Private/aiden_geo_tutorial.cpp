@@ -0,0 +1,17 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "aiden_geo_tutorial.h"
+
+#include "Misc/Paths.h"
+#include "Modules/ModuleManager.h"
+#include "ShaderCore.h"
+
+void FAidenGeoTutorialModule::StartupModule()
+{
+	const FString ShaderDirectory = FPaths::ConvertRelativePathToFull(
+		FPaths::Combine(FPaths::ProjectDir(), TEXT("Shaders")));
+	AddShaderSourceDirectoryMapping(TEXT("/FoliageShaders"), ShaderDirectory);
+}
+
+IMPLEMENT_PRIMARY_GAME_MODULE(FAidenGeoTutorialModule, aiden_geo_tutorial, "aiden_geo_tutorial");
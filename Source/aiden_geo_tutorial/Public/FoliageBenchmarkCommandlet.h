@@ -0,0 +1,50 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Commandlets/Commandlet.h"
+
+#include "FoliageBenchmarkCommandlet.generated.h"
+
+struct FFoliageClassificationType;
+struct FFoliagePixelBuffer;
+
+/**
+ * @brief Benchmarks the CPU build of AFoliageCaptureActor without a renderer or terrain. Synthetic classification
+ * and normal and depth pixels are reprojected against a georeference at a fixed origin, then committed to the HISMs
+ * one tick at a time, so runs are comparable between commits.
+ *
+ * UnrealEditor-Cmd <Project> -run=FoliageBenchmark [-Size=2048] [-ClassMix=0.3,0.2,0.1] [-BlockSize=16]
+ *     [-Iterations=5] [-Seed=0] [-Density=0.5] [-Origin=<Longitude>,<Latitude>] [-CommitBudgetMs=<Ms>]
+ *     [-Timeout=60] [-Csv=<File>]
+ *
+ * ClassMix is the fraction of the capture covered by each foliage type, each with its own cube mesh geometry type,
+ * the rest is unclassified. Classes are painted in square patches of BlockSize pixels. Reports reprojection
+ * throughput in pixels and instances per second, commit throughput, percentiles of the commit time per tick and
+ * peak memory, and appends them to the Csv file if given.
+ */
+UCLASS()
+class AIDEN_GEO_TUTORIAL_API UFoliageBenchmarkCommandlet : public UCommandlet
+{
+	GENERATED_BODY()
+
+public:
+	UFoliageBenchmarkCommandlet();
+
+	virtual int32 Main(const FString& Params) override;
+
+private:
+	/**
+	 * @brief Fills a Size x Size capture with patches of the foliage types, picked with the weights in ClassMix.
+	 * Normals point straight up with a little noise in the depth.
+	 */
+	static void MakeSyntheticPixels(int32 Size, int32 BlockSize, int32 Seed, const TArray<float>& ClassMix,
+	                                const TArray<FFoliageClassificationType>& FoliageTypes,
+	                                FFoliagePixelBuffer& OutClassificationPixels, FFoliagePixelBuffer& OutNormalPixels);
+
+	/**
+	 * @brief Value below which Percent of the sorted Values lie.
+	 */
+	static double GetPercentile(const TArray<double>& SortedValues, double Percent);
+};
@@ -1,374 +1,1611 @@
-// Fill out your copyright notice in the Description page of Project Settings.
-
-#pragma once
-
-#include "CoreMinimal.h"
-#include "GameFramework/Actor.h"
-
-#include "Engine/TextureRenderTarget2D.h"
-#include "FoliageType_InstancedStaticMesh.h"
-#include "CesiumGeoreference.h"
-#include "FoliageHISM.h"
-
-#include "FoliageCaptureActor.generated.h"
-
-// EXPERIMENTAL
-#define FOLIAGE_REDUCE_FLICKER_APPROACH_ENABLED 1
-
-/**
- * @brief Used to store the reprojected points gathered from the RT.
- */
-USTRUCT(BlueprintType)
-struct FFoliageTransforms
-{
-	GENERATED_BODY()
-
-	TMap<UFoliageHISM*, TArray<FTransform>> HISMTransformMap;
-};
-
-/**
- * @brief Array of foliage type transforms gathered from the RT extraction task.
- */
-USTRUCT()
-struct FFoliageTransformsTypeMap
-{
-	GENERATED_BODY()
-	TArray<FFoliageTransforms> FoliageTypes;
-};
-
-/**
- * @brief Foliage geometry container
- */
-USTRUCT(BlueprintType)
-struct FFoliageGeometryType
-{
-	GENERATED_BODY()
-
-	/* Placement */
-	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Placement")
-	float Density = 0.5f;
-
-	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Placement")
-	bool bRandomYaw = false;
-
-	UPROPERTY(EditAnywhere, Category = "Placement")
-	FFloatInterval ZOffset = FFloatInterval(0.0, 0.0);
-
-	UPROPERTY(EditAnywhere, Category = "Placement")
-	FFloatInterval Scale = FFloatInterval(1.0, 1.0);
-
-	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Placement")
-	bool bAlignToNormal = false;
-
-	/* Mesh Settings */
-
-	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Mesh")
-	UStaticMesh* Mesh;
-
-	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Mesh")
-	bool bCollidesWithWorld = true;
-
-	UPROPERTY(EditAnywhere, Category = "Placement")
-	FFloatInterval CullingDistances = FFloatInterval(4096, 32768);
-
-	/* Expensive */
-	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Mesh")
-	bool bAffectsDistanceFieldLighting = false;
-
-	friend uint32 GetTypeHash(const FFoliageGeometryType& A)
-	{
-		return GetTypeHash(A.Density) + GetTypeHash(A.bRandomYaw) + GetTypeHash(A.ZOffset) + GetTypeHash(A.Scale) +
-			GetTypeHash(A.Mesh) + GetTypeHash(A.bCollidesWithWorld) +
-			GetTypeHash(A.bAffectsDistanceFieldLighting);
-	}
-
-	friend bool operator==(const FFoliageGeometryType& A, const FFoliageGeometryType& B)
-	{
-		return A.Density == B.Density && A.Mesh == B.Mesh && A.bCollidesWithWorld == B.bCollidesWithWorld && A.
-			bAffectsDistanceFieldLighting == B.bAffectsDistanceFieldLighting
-			&& A.Scale.Max == B.Scale.Max && A.Scale.Min == B.Scale.Min && A.bRandomYaw == B.bRandomYaw &&
-			A.ZOffset.Min == B.ZOffset.Min && A.ZOffset.Max == B.ZOffset.Max;
-	}
-};
-
-/**
- * @brief Container for a foliage type
- */
-USTRUCT(BlueprintType)
-struct FFoliageClassificationType
-{
-	GENERATED_BODY()
-
-	UPROPERTY(BlueprintReadWrite, EditAnywhere)
-	FString Type;
-	UPROPERTY(BlueprintReadWrite, EditAnywhere)
-	FLinearColor ColourClassification;
-	UPROPERTY(BlueprintReadWrite, EditAnywhere)
-	TArray<FFoliageGeometryType> FoliageTypes;
-
-	/**
-	 * @brief If enabled, a line trace will be casted downwards from each point to determine surface normals.
-	 */
-	UPROPERTY(BlueprintReadWrite, EditAnywhere)
-	bool bAlignToSurfaceWithRaycast = false;
-
-	UPROPERTY(BlueprintReadWrite, EditAnywhere)
-	int32 PooledHISMsToCreatePerFoliageType = 4;
-};
-
-// Called after points have been gathered and reprojected from the classification RT.
-DECLARE_DELEGATE_OneParam(FOnFoliageTransformsGenerated, FFoliageTransformsTypeMap);
-
-// This is called after pixels have been extracted from input RTs
-DECLARE_DELEGATE_OneParam(FOnRenderTargetRead, bool);
-
-UCLASS()
-class AIDEN_GEO_TUTORIAL_API AFoliageCaptureActor : public AActor
-{
-	GENERATED_BODY()
-
-public:
-	// Sets default values for this actor's properties
-	AFoliageCaptureActor();
-
-protected:
-	// Called when the game starts or when spawned
-	virtual void BeginPlay() override;
-
-public:
-	// Called every frame
-	virtual void Tick(float DeltaTime) override;
-
-public:
-	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner")
-	TArray<FFoliageClassificationType> FoliageTypes;
-
-	UPROPERTY()
-	ACesiumGeoreference* Georeference;
-
-	/**
-	 * @brief Elevation (in metres) of the scene capture component that's placed above the player.
-	 */
-	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner")
-	float CaptureElevation = 1024.f;
-
-	/**
-	 * @brief Orthographic width of our scene capture components
-	 */
-	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner")
-	float CaptureWidth = 131072.f;
-
-	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner")
-	int32 UpdateFoliageAfterNumFrames = 2;
-
-	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner")
-	int32 MaxComponentsToUpdatePerFrame = 1;
-
-	/**
-	 * @brief Coverage grid.
-	 */
-	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner")
-	FIntVector GridSize = FIntVector(0, 0, 0);
-
-	/**
-	* @brief Set to true if origin rebasing is enabled within the project.
-	* Set to disabled if not needed to save performance.
-	*/
-	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner")
-	bool bIsRebasing = true;
-
-	/**
-	* @brief Average geographic width in degrees.
-	*/
-	double CaptureWidthInDegrees = 0.01;
-
-	/**
-	* @brief Camera speed
-	*/
-	double PlayerSpeed = 0.0;
-	/**
-	* @brief Camera speed threshold, we should only update if the speed is below this threshold 
-	*/
-	double PlayerSpeedUpdateThreshold = 5000;
-
-public:
-	/**
-	 * @brief Build foliage transforms according to classification types.
-	 * @param FoliageDistributionMap Render Target containing classifications. 
-	 * @param NormalAndDepthMap Render Target with normals in the RGB channel and *normalized* depth in Alpha.
-	 * @param RTWorldBounds UE world extents of the render targets.
-	 */
-	UFUNCTION(BlueprintCallable, Category = "Foliage Spawner")
-	void BuildFoliageTransforms(UTextureRenderTarget2D* FoliageDistributionMap,
-	                            UTextureRenderTarget2D* NormalAndDepthMap, FBox RTWorldBounds);
-	
-	UFUNCTION(BlueprintCallable, Category = "Foliage Spawner")
-	void ClearFoliageInstances();
-
-	/**
-	 * @brief Create required HISM components, removing if outdated
-	 */
-	void ResetAndCreateHISMComponents();
-
-	/**
-	 * @brief Implementable BP event, called when the player moves outside of the capture boundaries.
-	 */
-	UFUNCTION(BlueprintCallable, BlueprintNativeEvent, Category = "Foliage Spawner")
-	void OnUpdate(const FVector& NewLocation);
-
-	UFUNCTION(BlueprintCallable, BlueprintNativeEvent, Category = "Foliage Spawner")
-	void OnInstancesCleared();
-
-	/**
-	 * @brief Is the foliage currently building?
-	 */
-	UFUNCTION(BlueprintCallable, BlueprintPure, Category = "Foliage Spawner")
-	bool IsBuilding() const;
-
-	/*
-	* @brief Are we waiting to be built?
-	*/
-	UFUNCTION(BlueprintCallable, BlueprintPure, Category = "Foliage Spawner")
-	bool IsWaiting() const;
-
-protected:
-	/**
-	 * @brief Attempt to correct normals and elevation by raycasting
-	 */
-	void CorrectFoliageTransform(const FVector& InEngineCoordinates, const FMatrix& InEastNorthUp,
-	                             FVector& OutCorrectedPosition, FVector& OutSurfaceNormals, bool& bSuccess) const;
-
-	/**
-	 * @brief For each static mesh, we also want to have multiple HISM components to reduce
-	 * hitches when updating instances.
-	 */
-	TMap<FFoliageGeometryType, TArray<UFoliageHISM*>> HISMFoliageMap;
-
-	/**
-	 * @brief The scene depth value is multiplied by a small value so it remains within the range of 0.0 to 1.0.
-	 * In this function it is projected back to it's (approximated) original value and then inverted.
-	 * @param Value Depth value
-	 * @return Height in metres.
-	 */
-	double GetHeightFromDepth(const double& Value) const;
-
-
-	/**
-	 * @brief Converts pixel coordinates back to geographic coordinates.
-	 */
-	FVector PixelToGeographicLocation(const double& X, const double& Y, const double& Altitude,
-	                                     UTextureRenderTarget2D* RT, const glm::dvec4& GeographicExtents) const;
-	/**
-	 * @brief Converts geographic coordinates to pixel coordinates.
-	 */
-	FIntPoint GeographicToPixelLocation(const double& Longitude, const double& Latitude, UTextureRenderTarget2D* RT,
-	                                    const glm::dvec4& GeographicExtents) const;
-
-	/**
-	 * @brief Modified version of ReadRenderColorPixels
-	 */
-	void ReadLinearColorPixelsAsync(
-		FOnRenderTargetRead OnRenderTargetRead,
-		TArray<FTextureRenderTargetResource*> RTs,
-		TArray<TArray<FLinearColor>*> OutImageData,
-		FReadSurfaceDataFlags InFlags = FReadSurfaceDataFlags(
-			RCM_MinMax,
-			CubeFace_MAX),
-		FIntRect InRect = FIntRect(0, 0, 0, 0),
-		ENamedThreads::Type ExitThread = ENamedThreads::AnyBackgroundThreadNormalTask);
-
-	/**
-	 * @brief Don't run tick update if true.
-	 */
-	UPROPERTY(BlueprintReadOnly, VisibleAnywhere, Category = "Foliage Spawner")
-	bool bIsBuilding = false;
-
-	/**
-	* @brief If we are waiting to build foliage
-	*/
-	UPROPERTY(BlueprintReadOnly, VisibleAnywhere, Category = "Foliage Spawner")
-	bool bIsWaiting = false;
-
-	/**
-	 * @brief Number of frames that have passed after updating foliage.
-	 */
-	int32 Ticks = 0;
-
-	static glm::dvec3 VectorToDVector(const FVector& InVector);
-
-	/**
-	* @brief Gets the total instance count
-	*/
-	int32 GetInstanceCount();
-
-	/**
-	* @brief Are all ISMs marked as cleared
-	*/
-	bool AllISMsMarkedAsCleared();
-
-	/**
-	* @brief Offset all instances
-	*/
-	void OffsetAllInstances(const FVector& InOffset);
-
-	TOptional<FVector> NewActorLocation;
-
-	bool bInstancesClearedCalled = false;
-
-	/**
-	* @brief Offset between the current world origin and the last world origin. Fixed to 0 if rebasing isn't enabled.
-	*/
-	FVector WorldOffset = FVector(0.f);
-	/**
-	* @brief Offset between last actor position and current actor position.
-	*/
-	FVector ActorOffset = FVector(0.f);
-};
-
-inline int32 AFoliageCaptureActor::GetInstanceCount()
-{
-	int32 Count = 0;
-	for (TPair<FFoliageGeometryType, TArray<UFoliageHISM*>>& FoliageHISMPair : HISMFoliageMap)
-	{
-		for (UFoliageHISM* FoliageHISM : FoliageHISMPair.Value) {
-			Count += FoliageHISM->GetInstanceCount();
-		}
-	}
-	return Count;
-}
-
-inline bool AFoliageCaptureActor::AllISMsMarkedAsCleared()
-{
-	bool bIsCleared = true;
-	for (TPair<FFoliageGeometryType, TArray<UFoliageHISM*>>& FoliageHISMPair : HISMFoliageMap)
-	{
-		for (UFoliageHISM* FoliageHISM : FoliageHISMPair.Value) {
-			if (!FoliageHISM->bCleared) {
-				bIsCleared = false;
-				break;
-			}
-		}
-		if (!bIsCleared) {
-			break;
-		}
-	}
-	return bIsCleared;
-}
-
-inline void AFoliageCaptureActor::OffsetAllInstances(const FVector& InOffset)
-{
-	for (TPair<FFoliageGeometryType, TArray<UFoliageHISM*>>& FoliageHISMPair : HISMFoliageMap)
-	{
-		for (UFoliageHISM* FoliageHISM : FoliageHISMPair.Value) {
-			TArray<FTransform> WorldTransforms;
-			WorldTransforms.SetNum(FoliageHISM->GetInstanceCount());
-			ParallelFor(WorldTransforms.Num(), [&](int32 Index) {
-				FoliageHISM->GetInstanceTransform(Index, WorldTransforms[Index], true);
-				WorldTransforms[Index].SetLocation(
-					WorldTransforms[Index].GetLocation() + InOffset
-				);
-				});
-			FoliageHISM->BatchUpdateInstancesTransforms(0, WorldTransforms, true, true, true);
-		}
-	}
-}
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "GameFramework/Actor.h"
+
+#include "Engine/TextureRenderTarget2D.h"
+#include "FoliageType_InstancedStaticMesh.h"
+#include "CesiumGeoreference.h"
+#include "Curves/CurveFloat.h"
+#include "FoliageGPUPlacement.h"
+#include "FoliageHISM.h"
+#include "FoliagePixelBuffer.h"
+#include "FoliageReadbackQueue.h"
+#include "FoliageStats.h"
+#include "PerPlatformProperties.h"
+#include "FoliageTileCache.h"
+#include "WorldCollision.h"
+
+#include <atomic>
+
+#include "FoliageCaptureActor.generated.h"
+
+// EXPERIMENTAL
+#define FOLIAGE_REDUCE_FLICKER_APPROACH_ENABLED 1
+
+/**
+ * @brief Instance waiting on the surface trace of its pixel. The random values are rolled up front, so the result
+ * only depends on where the trace lands.
+ */
+struct FFoliagePendingInstance
+{
+	UFoliageHISM* HISM = nullptr;
+
+	float Scale = 1.f;
+	/** Random yaw in degrees, negative if the geometry type doesn't use one. */
+	float Yaw = -1.f;
+	float ZOffset = 0.f;
+	bool bAlignToNormal = true;
+
+	/** Set once the trace has landed. */
+	FTransform Transform;
+	bool bResolved = false;
+};
+
+/**
+ * @brief Surface trace of a pixel whose foliage type is raycast aligned. Only issued for pixels that spawn at
+ * least one instance. Locations are as reprojected, without the world offset of the build.
+ */
+struct FFoliagePendingTrace
+{
+	/** Captured location and normal, used if the trace doesn't hit anything. */
+	FVector Location = FVector::ZeroVector;
+	FVector Normal = FVector::UpVector;
+	FQuat EastSouthUp = FQuat::Identity;
+
+	FVector TraceStart = FVector::ZeroVector;
+	FVector TraceEnd = FVector::ZeroVector;
+
+	/** Range of instances in FFoliageTransforms::PendingInstances. */
+	int32 FirstInstance = 0;
+	int32 NumInstances = 0;
+};
+
+/**
+ * @brief Used to store the reprojected points gathered from the RT.
+ */
+USTRUCT(BlueprintType)
+struct FFoliageTransforms
+{
+	GENERATED_BODY()
+
+	TMap<UFoliageHISM*, FFoliageInstanceChunks> HISMTransformMap;
+
+	TArray<FFoliagePendingTrace> PendingTraces;
+	TArray<FFoliagePendingInstance> PendingInstances;
+};
+
+/**
+ * @brief Array of foliage type transforms gathered from the RT extraction task.
+ */
+USTRUCT()
+struct FFoliageTransformsTypeMap
+{
+	GENERATED_BODY()
+	TArray<FFoliageTransforms> FoliageTypes;
+};
+
+/**
+ * @brief Georeference projection sampled on a grid of nodes across one reprojection tile.
+ * Positions and east-south-up rotations of pixels are bilinearly interpolated between the nodes.
+ */
+struct FFoliageTileProjection
+{
+	FIntRect Rect;
+	int32 Spacing = 1;
+	int32 NodesX = 0;
+	int32 NodesY = 0;
+
+	/** Engine location of each node at zero height. */
+	TArray<FVector> SurfaceLocations;
+	/** Engine space offset of one metre of height at each node. */
+	TArray<FVector> UpPerMetre;
+	TArray<FQuat> EastSouthUp;
+
+	bool bInitialized = false;
+
+	/**
+	 * @brief Interpolates the engine location and east-south-up rotation of pixel X, Y at the given elevation (metres).
+	 */
+	void Project(double X, double Y, double Elevation, FVector& OutLocation, FQuat& OutEastSouthUp) const;
+};
+
+inline void FFoliageTileProjection::Project(double X, double Y, double Elevation, FVector& OutLocation,
+                                            FQuat& OutEastSouthUp) const
+{
+	const int32 CellX = FMath::Clamp((FMath::FloorToInt(X) - Rect.Min.X) / Spacing, 0, NodesX - 2);
+	const int32 CellY = FMath::Clamp((FMath::FloorToInt(Y) - Rect.Min.Y) / Spacing, 0, NodesY - 2);
+
+	const double X0 = Rect.Min.X + CellX * Spacing;
+	const double Y0 = Rect.Min.Y + CellY * Spacing;
+	const double AX = (X - X0) / (FMath::Min<double>(X0 + Spacing, Rect.Max.X) - X0);
+	const double AY = (Y - Y0) / (FMath::Min<double>(Y0 + Spacing, Rect.Max.Y) - Y0);
+
+	const int32 I00 = CellY * NodesX + CellX;
+	const int32 I10 = I00 + 1;
+	const int32 I01 = I00 + NodesX;
+	const int32 I11 = I01 + 1;
+
+	OutLocation = FMath::BiLerp(SurfaceLocations[I00], SurfaceLocations[I10], SurfaceLocations[I01],
+	                            SurfaceLocations[I11], AX, AY)
+		+ FMath::BiLerp(UpPerMetre[I00], UpPerMetre[I10], UpPerMetre[I01], UpPerMetre[I11], AX, AY) * Elevation;
+
+	OutEastSouthUp = FQuat::FastLerp(
+		FQuat::FastLerp(EastSouthUp[I00], EastSouthUp[I10], AX),
+		FQuat::FastLerp(EastSouthUp[I01], EastSouthUp[I11], AX),
+		AY).GetNormalized();
+}
+
+/**
+ * @brief Camera that the tiles of a build are ranked against, see AFoliageCaptureActor::bPrioritizeVisibleTiles.
+ */
+struct FFoliageViewpoint
+{
+	/** WGS84 equatorial radius, in UE units. */
+	static constexpr double EllipsoidRadius = 637813700.0;
+
+	FVector Location = FVector::ZeroVector;
+	FVector Direction = FVector::ForwardVector;
+	/** Angle (in radians) between the view direction and the corners of the view frustum. */
+	double HalfAngle = 0.0;
+	/** Distance (in UE units) from the camera to the horizon of the ellipsoid. */
+	double HorizonDistance = MAX_dbl;
+	bool bValid = false;
+
+	/**
+	 * @brief Whether a sphere around Centre is inside the cone around the frustum and above the horizon.
+	 * @param CentreHorizonDistance Distance from Centre to the horizon, see GetHorizonDistance.
+	 */
+	bool IsVisible(const FVector& Centre, double Radius, double CentreHorizonDistance) const;
+
+	/**
+	 * @brief Distance (in UE units) to the horizon from the given height (in metres) above a spherical ellipsoid.
+	 */
+	static double GetHorizonDistance(double Height);
+};
+
+inline bool FFoliageViewpoint::IsVisible(const FVector& Centre, double Radius, double CentreHorizonDistance) const
+{
+	const FVector ToCentre = Centre - Location;
+	const double Distance = ToCentre.Size();
+	if (Distance <= Radius)
+	{
+		return true;
+	}
+	// Both horizons together are the furthest apart two points can be and still see each other.
+	if (Distance - Radius > HorizonDistance + CentreHorizonDistance)
+	{
+		return false;
+	}
+	const double Angle = FMath::Acos(FMath::Clamp(FVector::DotProduct(ToCentre / Distance, Direction), -1.0, 1.0));
+	return Angle <= HalfAngle + FMath::Asin(Radius / Distance);
+}
+
+inline double FFoliageViewpoint::GetHorizonDistance(double Height)
+{
+	const double HeightUU = FMath::Max(Height, 0.0) * 100.0;
+	return FMath::Sqrt(2.0 * EllipsoidRadius * HeightUU + HeightUU * HeightUU);
+}
+
+/**
+ * @brief Inputs shared by every tile of a single reprojection pass.
+ */
+struct FFoliageReprojectionContext
+{
+	const FFoliagePixelBuffer* ClassificationPixels = nullptr;
+	const FFoliagePixelBuffer* NormalPixels = nullptr;
+	UTextureRenderTarget2D* FoliageDistributionMap = nullptr;
+	glm::dvec4 GeographicExtents2D = glm::dvec4(0.0);
+
+	/**
+	 * @brief Regions of the RTs that were read back. The pixel arrays hold each region in turn, row by row.
+	 */
+	TArray<FIntRect> PixelRects;
+	TArray<int32> PixelRectOffsets;
+
+	/**
+	 * @brief Index of pixel X, Y (in RT coordinates) inside the pixel arrays.
+	 */
+	int32 GetPixelIndex(int32 PixelRectIndex, int32 X, int32 Y) const
+	{
+		const FIntRect& Rect = PixelRects[PixelRectIndex];
+		return PixelRectOffsets[PixelRectIndex] + (Y - Rect.Min.Y) * Rect.Width() + (X - Rect.Min.X);
+	}
+
+	void SetPixelRects(const TArray<FIntRect>& InPixelRects)
+	{
+		PixelRects = InPixelRects;
+		PixelRectOffsets.Reset(PixelRects.Num());
+
+		int32 Offset = 0;
+		for (const FIntRect& Rect : PixelRects)
+		{
+			PixelRectOffsets.Add(Offset);
+			Offset += Rect.Area();
+		}
+	}
+
+	int32 GetNumPixels() const
+	{
+		return PixelRects.Num() > 0 ? PixelRectOffsets.Last() + PixelRects.Last().Area() : 0;
+	}
+	FTransform ActorTransform = FTransform::Identity;
+	FVector WorldOffset = FVector(0.f);
+
+	/**
+	 * @brief Index of the first geometry type of each classification type in the flat per geometry type arrays below.
+	 */
+	TArray<int32> GeometryTypeOffsets;
+
+	/**
+	 * @brief Stable per geometry type seeds.
+	 */
+	TArray<uint32> GeometryTypeSeeds;
+
+	/**
+	 * @brief Density falloff range of each geometry type (see FFoliageGeometryType::GetDensityFalloffRange), and the
+	 * largest of them. Pixels further away than MaxFalloffRange don't spawn anything.
+	 */
+	TArray<float> GeometryTypeFalloffRanges;
+	float MaxFalloffRange = MAX_flt;
+
+	/**
+	 * @brief Tiles are ranked against the viewpoint if it's valid, tiles that aren't visible are generated at
+	 * OffscreenDensityScale.
+	 */
+	FFoliageViewpoint Viewpoint;
+	float OffscreenDensityScale = 1.f;
+
+	/**
+	 * @brief Most instances the build may generate, see AFoliageCaptureActor::MaxInstances.
+	 */
+	int32 InstanceBudget = MAX_int32;
+
+	/**
+	 * @brief HISM pool of each geometry type, null if the geometry type has no pool.
+	 */
+	TArray<const TArray<UFoliageHISM*>*> GeometryTypePools;
+
+	/**
+	 * @brief Grid cells covered by the capture, only used when HISMs are partitioned by grid cell.
+	 */
+	FVector2D GridCellSize = FVector2D::ZeroVector;
+	FIntPoint MinCell = FIntPoint::ZeroValue;
+	FIntPoint NumCells = FIntPoint::ZeroValue;
+
+	/**
+	 * @brief HISM of each geometry type for every cell in the capture (row major, starting at MinCell).
+	 * Empty for cells that are kept from a previous build, so their pixels are skipped.
+	 */
+	TArray<TArray<UFoliageHISM*>> CellTargets;
+
+	bool IsPartitioned() const { return CellTargets.Num() > 0; }
+
+	/**
+	 * @brief Target HISMs of the cell containing the geographic location, or null if the cell is kept.
+	 */
+	const TArray<UFoliageHISM*>* FindCellTargets(const FVector& GeographicCoords) const;
+};
+
+/**
+ * @brief A geographic grid cell with its own HISM for each geometry type, used when HISMs are partitioned by grid cell.
+ */
+struct FFoliageGridCell
+{
+	/**
+	 * @brief HISM of each geometry type, indexed like FFoliageReprojectionContext::GeometryTypePools.
+	 */
+	TArray<UFoliageHISM*> HISMs;
+
+	/**
+	 * @brief True if the cell was entirely inside the capture when it was built, and the budget didn't thin it out.
+	 * Complete cells keep their instances while they overlap the capture.
+	 */
+	bool bComplete = false;
+
+	/**
+	 * @brief Non-zero while the cell's tile is being loaded from disk, identifies the load. The cell counts as
+	 * complete meanwhile, so no build fills it.
+	 */
+	int32 TileLoadSerial = 0;
+
+	static FIntPoint FromGeographic(double Longitude, double Latitude, const FVector2D& CellSize);
+};
+
+inline FIntPoint FFoliageGridCell::FromGeographic(double Longitude, double Latitude, const FVector2D& CellSize)
+{
+	return FIntPoint(FMath::FloorToInt(Longitude / CellSize.X), FMath::FloorToInt(Latitude / CellSize.Y));
+}
+
+inline const TArray<UFoliageHISM*>* FFoliageReprojectionContext::FindCellTargets(const FVector& GeographicCoords) const
+{
+	const FIntPoint Cell = FFoliageGridCell::FromGeographic(GeographicCoords.X, GeographicCoords.Y, GridCellSize);
+	const int32 CellX = FMath::Clamp(Cell.X - MinCell.X, 0, NumCells.X - 1);
+	const int32 CellY = FMath::Clamp(Cell.Y - MinCell.Y, 0, NumCells.Y - 1);
+
+	const TArray<UFoliageHISM*>& Targets = CellTargets[CellY * NumCells.X + CellX];
+	return Targets.Num() > 0 ? &Targets : nullptr;
+}
+
+/**
+ * @brief A tile of one of the read back regions, reprojected by a single worker.
+ */
+struct FFoliageReprojectionTile
+{
+	FIntRect Rect;
+	int32 PixelRectIndex = 0;
+
+	/** Ranking against FFoliageReprojectionContext::Viewpoint, visible tiles are reprojected first, nearest first. */
+	bool bVisible = true;
+	double ViewDistance = 0.0;
+	/** Multiplier of the density of every geometry type, 0 skips the tile. */
+	float DensityScale = 1.f;
+};
+
+/**
+ * @brief Readback buffers and reprojection scratch arrays of one build. Owned by the capture actor and reused
+ * between builds, so steady state captures don't make any large allocations.
+ */
+struct FFoliageBuildBuffers
+{
+	FFoliagePixelBuffer ClassificationPixels;
+	FFoliagePixelBuffer NormalPixels;
+
+	TArray<FFoliageReprojectionTile> Tiles;
+	TArray<FFoliageTransforms> TileTransforms;
+	/** Order the tiles are reprojected and merged in, see AFoliageCaptureActor::bPrioritizeVisibleTiles. */
+	TArray<int32> TileOrder;
+
+	/** Instances the build may generate, held back from other builds while it's in flight. */
+	int32 InstanceBudget = MAX_int32;
+	/** Density multiplier the budget imposed on every geometry type, and instances dropped on top of that. */
+	float BudgetDensityScale = 1.f;
+	int32 NumInstancesDroppedByBudget = 0;
+
+	/** Merged result of all tiles, handed to the HISMs on the game thread. */
+	FFoliageTransforms FoliageTransforms;
+
+	/** Build time transforms that pending instances are resolved against. */
+	FTransform ActorTransform;
+	FVector WorldOffset = FVector::ZeroVector;
+
+	/** Only accessed on the game thread. */
+	bool bInUse = false;
+	int32 NumOutstandingTraces = 0;
+
+	/** Number of the build, builds started later have higher numbers. */
+	int32 Generation = 0;
+
+	/**
+	 * @brief Set on the game thread once a newer build has made the result of this one obsolete. Checked by the
+	 * readback, every reprojection tile and the hand-off, which then stop and release the buffers without committing.
+	 */
+	std::atomic<bool> bCancelled{false};
+
+	/** Cell HISMs that are rebuilt by the build. */
+	TArray<UFoliageHISM*> PendingCellHISMs;
+
+	/** Measured by the build for FFoliageCaptureStats, written by whichever thread runs the stage. */
+	double StartTime = 0.0;
+	float ReadbackMs = 0.f;
+	float ReprojectionMs = 0.f;
+	int32 NumPixelsProcessed = 0;
+	int64 NumBytesReadBack = 0;
+
+	/**
+	 * @brief Reserves the pixel buffers for a full read of render targets of the given size and formats.
+	 */
+	void Reserve(FIntPoint Size, EPixelFormat ClassificationFormat, EPixelFormat NormalFormat);
+
+	/**
+	 * @brief Empties the scratch arrays without releasing their memory.
+	 */
+	void ResetTransforms();
+};
+
+/**
+ * @brief Spreads the instances of each geometry type evenly across its pooled HISMs in constant time,
+ * handing out pool slots round-robin.
+ */
+struct FFoliageHISMDistributor
+{
+	/**
+	 * @param InPools HISM pool per geometry type.
+	 * @param StartOffset Starting slot of every counter. Using a different offset per tile spreads the remainders
+	 * of each tile across the pool.
+	 */
+	void Initialize(const TArray<const TArray<UFoliageHISM*>*>& InPools, int32 StartOffset);
+
+	/**
+	 * @brief Next HISM to receive an instance of the given geometry type, or null if it has no pool.
+	 */
+	UFoliageHISM* Next(int32 GeometryTypeIndex);
+
+private:
+	TArray<const TArray<UFoliageHISM*>*> Pools;
+	TArray<uint32> Counters;
+};
+
+inline void FFoliageHISMDistributor::Initialize(const TArray<const TArray<UFoliageHISM*>*>& InPools, int32 StartOffset)
+{
+	Pools = InPools;
+	Counters.Init(static_cast<uint32>(StartOffset), Pools.Num());
+}
+
+inline UFoliageHISM* FFoliageHISMDistributor::Next(int32 GeometryTypeIndex)
+{
+	const TArray<UFoliageHISM*>* Pool = Pools[GeometryTypeIndex];
+	if (Pool == nullptr || Pool->Num() == 0)
+	{
+		return nullptr;
+	}
+	return (*Pool)[Counters[GeometryTypeIndex]++ % Pool->Num()];
+}
+
+/**
+ * @brief Foliage geometry container
+ */
+USTRUCT(BlueprintType)
+struct FFoliageGeometryType
+{
+	GENERATED_BODY()
+
+	/* Placement */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Placement")
+	float Density = 0.5f;
+
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Placement")
+	bool bRandomYaw = false;
+
+	UPROPERTY(EditAnywhere, Category = "Placement")
+	FFloatInterval ZOffset = FFloatInterval(0.0, 0.0);
+
+	UPROPERTY(EditAnywhere, Category = "Placement")
+	FFloatInterval Scale = FFloatInterval(1.0, 1.0);
+
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Placement")
+	bool bAlignToNormal = false;
+
+	/* Mesh Settings */
+
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Mesh")
+	UStaticMesh* Mesh;
+
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Mesh")
+	bool bCollidesWithWorld = true;
+
+	UPROPERTY(EditAnywhere, Category = "Placement")
+	FFloatInterval CullingDistances = FFloatInterval(4096, 32768);
+
+	/**
+	 * @brief If enabled, Density is scaled by DensityFalloff depending on the distance from the capture actor, so
+	 * instances that would be culled anyway are never generated.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Placement")
+	bool bUseDensityFalloff = false;
+
+	/**
+	 * @brief Density multiplier by distance (in UE units) from the capture actor. Without any keys, density fades
+	 * out linearly between CullingDistances.Min and CullingDistances.Max.
+	 * Not part of the HISM key or the placement seed, changing it only thins out the same placement.
+	 */
+	UPROPERTY(EditAnywhere, Category = "Placement", meta = (EditCondition = "bUseDensityFalloff"))
+	FRuntimeFloatCurve DensityFalloff;
+
+	/**
+	 * @brief Density multiplier at the given distance from the capture actor.
+	 */
+	float GetDensityFalloff(float Distance) const;
+
+	/**
+	 * @brief Distance beyond which no instances are generated, MAX_flt if there is none.
+	 */
+	float GetDensityFalloffRange() const;
+
+	/* Expensive */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Mesh")
+	bool bAffectsDistanceFieldLighting = false;
+
+	friend uint32 GetTypeHash(const FFoliageGeometryType& A)
+	{
+		return GetTypeHash(A.Density) + GetTypeHash(A.bRandomYaw) + GetTypeHash(A.ZOffset) + GetTypeHash(A.Scale) +
+			GetTypeHash(A.Mesh) + GetTypeHash(A.bCollidesWithWorld) +
+			GetTypeHash(A.bAffectsDistanceFieldLighting);
+	}
+
+	friend bool operator==(const FFoliageGeometryType& A, const FFoliageGeometryType& B)
+	{
+		return A.Density == B.Density && A.Mesh == B.Mesh && A.bCollidesWithWorld == B.bCollidesWithWorld && A.
+			bAffectsDistanceFieldLighting == B.bAffectsDistanceFieldLighting
+			&& A.Scale.Max == B.Scale.Max && A.Scale.Min == B.Scale.Min && A.bRandomYaw == B.bRandomYaw &&
+			A.ZOffset.Min == B.ZOffset.Min && A.ZOffset.Max == B.ZOffset.Max;
+	}
+};
+
+/**
+ * @brief Container for a foliage type
+ */
+USTRUCT(BlueprintType)
+struct FFoliageClassificationType
+{
+	GENERATED_BODY()
+
+	UPROPERTY(BlueprintReadWrite, EditAnywhere)
+	FString Type;
+	UPROPERTY(BlueprintReadWrite, EditAnywhere)
+	FLinearColor ColourClassification;
+
+	/**
+	 * @brief Value written to single channel (RTF_R8) classification RTs for this type, which are matched by ID
+	 * instead of by colour. 0 is reserved for unclassified pixels.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere)
+	uint8 ClassID = 0;
+
+	UPROPERTY(BlueprintReadWrite, EditAnywhere)
+	TArray<FFoliageGeometryType> FoliageTypes;
+
+	/**
+	 * @brief If enabled, a line trace will be casted downwards from each point that spawns foliage to determine
+	 * surface normals. Traces are batched and run asynchronously, the instances are added once they've landed.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere)
+	bool bAlignToSurfaceWithRaycast = false;
+
+	UPROPERTY(BlueprintReadWrite, EditAnywhere)
+	int32 PooledHISMsToCreatePerFoliageType = 4;
+};
+
+/**
+ * @brief Counters and timings of a capture actor's builds, for telemetry. Timings are of the last committed build,
+ * instance counts per geometry type are in the order of the geometry types across all FoliageTypes.
+ */
+USTRUCT(BlueprintType)
+struct FFoliageCaptureStats
+{
+	GENERATED_BODY()
+
+	UPROPERTY(BlueprintReadOnly, Category = "Foliage Spawner")
+	int32 NumBuildsStarted = 0;
+
+	UPROPERTY(BlueprintReadOnly, Category = "Foliage Spawner")
+	int32 NumBuildsCommitted = 0;
+
+	/** Builds that were superseded, cancelled or failed. */
+	UPROPERTY(BlueprintReadOnly, Category = "Foliage Spawner")
+	int32 NumBuildsCancelled = 0;
+
+	UPROPERTY(BlueprintReadOnly, Category = "Foliage Spawner")
+	int32 NumBuildsInFlight = 0;
+
+	/** Time (in milliseconds) from the start of the build until its pixels were read back. */
+	UPROPERTY(BlueprintReadOnly, Category = "Foliage Spawner")
+	float LastReadbackMs = 0.f;
+
+	/** Time (in milliseconds) the build spent reprojecting on the workers. */
+	UPROPERTY(BlueprintReadOnly, Category = "Foliage Spawner")
+	float LastReprojectionMs = 0.f;
+
+	/** Time (in milliseconds) from the start of the build until it was handed to the HISMs. */
+	UPROPERTY(BlueprintReadOnly, Category = "Foliage Spawner")
+	float LastBuildMs = 0.f;
+
+	UPROPERTY(BlueprintReadOnly, Category = "Foliage Spawner")
+	int32 LastPixelsProcessed = 0;
+
+	UPROPERTY(BlueprintReadOnly, Category = "Foliage Spawner")
+	int64 LastBytesReadBack = 0;
+
+	UPROPERTY(BlueprintReadOnly, Category = "Foliage Spawner")
+	int32 LastInstancesGenerated = 0;
+
+	UPROPERTY(BlueprintReadOnly, Category = "Foliage Spawner")
+	TArray<int32> LastInstancesPerGeometryType;
+
+	/** Instances added to the HISMs during the last tick. */
+	UPROPERTY(BlueprintReadOnly, Category = "Foliage Spawner")
+	int32 InstancesCommittedLastTick = 0;
+
+	/**
+	 * Instances the HISMs hold once their pending commits and clears are applied, counted like the budget. Hidden
+	 * double buffers aren't included.
+	 */
+	UPROPERTY(BlueprintReadOnly, Category = "Foliage Spawner")
+	int32 NumLiveInstances = 0;
+
+	UPROPERTY(BlueprintReadOnly, Category = "Foliage Spawner")
+	TArray<int32> LiveInstancesPerGeometryType;
+
+	/**
+	 * Estimated memory (in bytes) of the live instances, as counted against MaxInstanceMemoryMB. See
+	 * AFoliageCaptureActor::EstimatedBytesPerInstance.
+	 */
+	UPROPERTY(BlueprintReadOnly, Category = "Foliage Spawner")
+	int64 EstimatedInstanceMemory = 0;
+
+	/** Current instance ceiling, see AFoliageCaptureActor::GetInstanceBudget. */
+	UPROPERTY(BlueprintReadOnly, Category = "Foliage Spawner")
+	int32 InstanceBudget = 0;
+
+	/** Density multiplier the budget imposed on the last committed build, 1 if it fit. */
+	UPROPERTY(BlueprintReadOnly, Category = "Foliage Spawner")
+	float LastBudgetDensityScale = 1.f;
+
+	/** Instances of the tiles of the last committed build that still didn't fit the budget. */
+	UPROPERTY(BlueprintReadOnly, Category = "Foliage Spawner")
+	int32 LastInstancesDroppedByBudget = 0;
+};
+
+// Called after points have been gathered and reprojected from the classification RT.
+DECLARE_DELEGATE_OneParam(FOnFoliageTransformsGenerated, FFoliageTransformsTypeMap);
+
+// This is called after pixels have been extracted from input RTs
+DECLARE_DELEGATE_OneParam(FOnRenderTargetRead, bool);
+
+UCLASS()
+class AIDEN_GEO_TUTORIAL_API AFoliageCaptureActor : public AActor
+{
+	GENERATED_BODY()
+
+public:
+	// Sets default values for this actor's properties
+	AFoliageCaptureActor();
+
+protected:
+	// Called when the game starts or when spawned
+	virtual void BeginPlay() override;
+
+public:
+	// Called every frame
+	virtual void Tick(float DeltaTime) override;
+
+public:
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner")
+	TArray<FFoliageClassificationType> FoliageTypes;
+
+	UPROPERTY()
+	ACesiumGeoreference* Georeference;
+
+	/**
+	 * @brief Elevation (in metres) of the scene capture component that's placed above the player.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner")
+	float CaptureElevation = 1024.f;
+
+	/**
+	 * @brief Orthographic width of our scene capture components
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner")
+	float CaptureWidth = 131072.f;
+
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner")
+	int32 UpdateFoliageAfterNumFrames = 2;
+
+	/**
+	 * @brief Maximum number of HISMs that are cleared or filled per update. Ignored when CommitBudgetMs is set.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner")
+	int32 MaxComponentsToUpdatePerFrame = 1;
+
+	/**
+	 * @brief Time (in milliseconds) per frame that adding instances to HISMs may take. Large HISMs are filled in
+	 * chunks over several frames, sized from the measured cost of previous commits. 0 commits whole components,
+	 * throttled by MaxComponentsToUpdatePerFrame instead.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner", meta = (ClampMin = "0"))
+	float CommitBudgetMs = 2.f;
+
+	/**
+	 * @brief Smallest chunk that's committed when the budget is in use, so commits always make progress.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner", meta = (ClampMin = "1", EditCondition = "CommitBudgetMs > 0"))
+	int32 MinInstancesPerCommit = 256;
+
+	/**
+	 * @brief Width and height (in pixels) of the tiles the RTs are split into during reprojection.
+	 * Tiles are processed in parallel, each with its own transform bucket.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner", meta = (ClampMin = "16"))
+	int32 ReprojectionTileSize = 128;
+
+	/**
+	 * @brief Global seed mixed into every placement random stream. Changing this produces a different, but
+	 * still reproducible, distribution.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner")
+	int32 PlacementSeed = 0;
+
+	/**
+	 * @brief Size (in degrees) of the geographic cells used to seed placement random streams.
+	 * Pixels that fall within the same cell will always produce the same foliage.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner", meta = (ClampMin = "0.0000001"))
+	double PlacementCellSizeInDegrees = 0.00001;
+
+	/**
+	 * @brief Maximum per-channel difference (0 to 1) between a pixel and a FFoliageClassificationType colour for the
+	 * pixel to still be classified as that type. Colours are compared after quantizing to 8 bits per channel.
+	 * BuildClassificationLUT applies the same 0.05 limit when the property is set from code.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner", meta = (ClampMin = "0.0", ClampMax = "0.05"))
+	float ClassificationColourTolerance = 0.004f;
+
+	/**
+	 * @brief If enabled, the georeference is only evaluated on a grid of nodes per tile and pixel locations are
+	 * interpolated between them, instead of projecting every pixel through the ellipsoid.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner")
+	bool bUseBatchedProjection = true;
+
+	/**
+	 * @brief Maximum allowed error (in UE units) of an interpolated location when bUseBatchedProjection is enabled.
+	 * Lower values create denser projection grids.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner", meta = (ClampMin = "0.1", EditCondition = "bUseBatchedProjection"))
+	float MaxProjectionError = 5.f;
+
+	/**
+	 * @brief Distance (in metres) below the captured surface that surface traces extend to. Traces start at the
+	 * capture elevation, as nothing above it can have been captured.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner", meta = (ClampMin = "0"))
+	float RaycastDepthMargin = 10.f;
+
+	/**
+	 * @brief Coverage grid.
+	 * When bPartitionHISMsByGridCell is enabled, X and Y are the number of grid cells across the capture
+	 * (in longitude and latitude).
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner")
+	FIntVector GridSize = FIntVector(0, 0, 0);
+
+	/**
+	 * @brief If enabled, HISMs are owned by geographic grid cells (see GridSize) instead of a flat pool per geometry type.
+	 * When the capture moves, only cells leaving and entering the capture are rebuilt, cells that stay keep their
+	 * instances and cluster trees. Must be set before BeginPlay.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner")
+	bool bPartitionHISMsByGridCell = false;
+
+	/**
+	 * @brief If enabled, only the strips of the RTs that contain rebuilt grid cells are read back and reprojected.
+	 * The instances of the area that overlaps the previous capture are kept. Requires bPartitionHISMsByGridCell.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner", meta = (EditCondition = "bPartitionHISMsByGridCell"))
+	bool bIncrementalCapture = false;
+
+	/**
+	 * @brief If enabled, the instances of every complete grid cell are cached, and revisited cells are restored from
+	 * the cache instead of being captured and reprojected again. Cached cells aren't read back at all when
+	 * bIncrementalCapture is enabled. Grid cell sizes are rounded to powers of two degrees so cells line up between
+	 * sessions. Requires bPartitionHISMsByGridCell and bAnchorHISMs. Not used while any geometry type has a density
+	 * falloff, as its result depends on where the capture was.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner", meta = (EditCondition = "bPartitionHISMsByGridCell"))
+	bool bUseTileCache = false;
+
+	/**
+	 * @brief Number of cells kept in memory by the tile cache, the least recently used cell is evicted first.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner", meta = (ClampMin = "1", EditCondition = "bUseTileCache"))
+	int32 MaxCachedTiles = 256;
+
+	/**
+	 * @brief If enabled, cached cells are also written to TileCacheDirectory, so they survive between sessions. Cells
+	 * that aren't in memory are memory mapped on a worker thread and restored once loaded, the HISMs read their
+	 * instances straight from the mapping.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner", meta = (EditCondition = "bUseTileCache"))
+	bool bUseDiskTileCache = false;
+
+	/**
+	 * @brief Directory of the disk tile cache, relative to the project's Saved directory unless absolute.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner", meta = (EditCondition = "bUseDiskTileCache"))
+	FString TileCacheDirectory = TEXT("FoliageTileCache");
+
+	/**
+	 * @brief Read only directory of cells pre-baked by the FoliagePrebake commandlet, relative to the project's
+	 * Content directory unless absolute. Cells found there are restored instead of being captured, before the disk
+	 * tile cache is searched. Only cells baked with the same foliage types and capture resolution are found.
+	 * Empty to disable.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner", meta = (EditCondition = "bUseTileCache"))
+	FString PrebakedTileDirectory;
+
+	/**
+	 * @brief If enabled, RTs are copied into staging textures and mapped once the GPU has finished with them
+	 * (polled every tick), instead of calling ReadSurfaceData which stalls the render thread until the GPU is idle.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner")
+	bool bUseGPUTextureReadback = true;
+
+	/**
+	 * @brief If enabled, HISMs build their instance buffer and cluster tree on a worker thread and swap them in
+	 * once ready, instead of rebuilding the tree on the game thread after AddInstances. The previous instances stay
+	 * visible until the swap, so components don't need to be cleared first. CommitBudgetMs doesn't apply.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner")
+	bool bBuildHISMTreesAsync = false;
+
+	/**
+	 * @brief Number of builds that may be in flight at once. Above 1, the next capture is read back while the
+	 * previous build is still reprojecting, and HISMs keep committing while builds run. Older builds whose result a
+	 * newer one replaces are cancelled (see FFoliageBuildBuffers::bCancelled), and instances meant for cells a newer
+	 * build has taken over are discarded.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner", meta = (ClampMin = "1", ClampMax = "3"))
+	int32 MaxBuildsInFlight = 1;
+
+	/**
+	 * @brief If enabled, every pooled HISM gets a hidden twin. New instances fill the hidden components over as
+	 * many frames as needed, then all of them are shown at once when the build is complete. The previous
+	 * components are hidden in the same step and cleared later, so the ground is never bare in between.
+	 * Takes effect when the HISMs are created. Clears only become visible with the next flip.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner")
+	bool bDoubleBufferHISMs = false;
+
+	/**
+	 * @brief If enabled, HISMs don't follow the actor. Each component is placed at the actor transform of the build
+	 * its instances came from, so moving or rotating the actor never rewrites instance transforms.
+	 * Takes effect when the HISMs are created.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner")
+	bool bAnchorHISMs = false;
+
+	/**
+	 * @brief EXPERIMENTAL, needs FOLIAGE_GPU_PLACEMENT_ENABLED. If enabled, the placement rules run in a compute shader
+	 * straight on the capture RTs and only the placed instances are read back. Falls back to the CPU path when
+	 * partitioning HISMs by grid cell, when any classification type aligns with a raycast or when any geometry type
+	 * uses a density falloff.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner")
+	bool bUseGPUPlacement = false;
+
+	/**
+	 * @brief Size of the GPU placement instance buffer, instances beyond it are dropped.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner", meta = (ClampMin = "1", EditCondition = "bUseGPUPlacement"))
+	int32 GPUMaxInstances = 1000000;
+
+	/**
+	* @brief Set to true if origin rebasing is enabled within the project.
+	* Set to disabled if not needed to save performance.
+	*/
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner")
+	bool bIsRebasing = true;
+
+	/**
+	* @brief Average geographic width in degrees.
+	*/
+	double CaptureWidthInDegrees = 0.01;
+
+	/**
+	 * @brief Fraction of half the capture width the camera has to move before the capture follows it. Lower values
+	 * recapture more often, so an inner high resolution ring can follow the camera closely while a wide outer ring
+	 * rarely moves.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner", meta = (ClampMin = "0.05", ClampMax = "1"))
+	double UpdateDistanceFraction = 1.0;
+
+	/**
+	* @brief Camera speed
+	*/
+	double PlayerSpeed = 0.0;
+	/**
+	* @brief Camera speed threshold, we should only update if the speed is below this threshold 
+	*/
+	double PlayerSpeedUpdateThreshold = 5000;
+
+	/**
+	 * @brief If enabled, the capture is centred where the camera will be once the build has finished, extrapolated
+	 * from the camera velocity and MeasuredBuildLatency, and PlayerSpeedUpdateThreshold is ignored. Keeps fast
+	 * flyovers populated instead of capturing behind the camera.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner")
+	bool bPredictCaptureLocation = false;
+
+	/**
+	 * @brief Local player whose view the capture follows, see UFoliageCaptureSubsystem. -1 follows all of them: the
+	 * capture is centred between the views while they fit in it together, and follows the first one otherwise.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner", meta = (ClampMin = "-1"))
+	int32 ViewerIndex = -1;
+
+	/**
+	 * @brief Upper bound (in seconds) of how far ahead the capture location is predicted, so a slow build or a
+	 * burst of speed doesn't move the capture far away from the camera.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner", meta = (ClampMin = "0", EditCondition = "bPredictCaptureLocation"))
+	float MaxPredictionTime = 5.f;
+
+	/**
+	 * @brief Smoothed time (in seconds) from OnUpdate until the build it triggered was handed to the HISMs.
+	 */
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere, Category = "Foliage Spawner")
+	float MeasuredBuildLatency = 0.f;
+
+	/**
+	 * @brief If enabled, reprojection ranks its tiles against the viewpoint given to SetViewpoint. Tiles inside the
+	 * view frustum and above the horizon are generated and handed to the HISMs first, nearest first, and the rest
+	 * at OffscreenDensityScale. Only applies to the CPU path.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner")
+	bool bPrioritizeVisibleTiles = false;
+
+	/**
+	 * @brief Density multiplier of tiles outside the view or below the horizon, 0 skips them. They stay thinned out
+	 * until the next capture. Ignored when bPartitionHISMsByGridCell is enabled, as kept cells aren't rebuilt once
+	 * they come into view.
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage Spawner", meta = (ClampMin = "0", ClampMax = "1", EditCondition = "bPrioritizeVisibleTiles"))
+	float OffscreenDensityScale = 0.25f;
+
+	/**
+	 * @brief Most instances all geometry types together may hold, per platform, 0 for no limit. A build that would
+	 * exceed it scales down the density of every geometry type to fit, and drops the tiles that don't fit in what's
+	 * left if the placement rolls still come out over, farthest first. Cells restored from the tile cache aren't scaled, but count against later builds.
+	 */
+	UPROPERTY(EditAnywhere, Category = "Foliage Spawner", meta = (ClampMin = "0"))
+	FPerPlatformInt MaxInstances = 0;
+
+	/**
+	 * @brief Most memory (in MB) the instances may use, per platform, 0 for no limit. Turned into an instance
+	 * ceiling with EstimatedBytesPerInstance, twice that when the HISMs are double buffered.
+	 */
+	UPROPERTY(EditAnywhere, Category = "Foliage Spawner", meta = (ClampMin = "0"))
+	FPerPlatformInt MaxInstanceMemoryMB = 0;
+
+	/**
+	 * @brief Rough memory cost of one instance: its game thread and render thread instance data, plus the
+	 * reorder and sort tables of the cluster tree.
+	 */
+	static constexpr int32 EstimatedBytesPerInstance = 2 * sizeof(FInstancedStaticMeshInstanceData) + 2 * sizeof(int32);
+
+public:
+	/**
+	 * @brief Build foliage transforms according to classification types.
+	 * @param FoliageDistributionMap Render Target containing classifications. 
+	 * @param NormalAndDepthMap Render Target with normals in the RGB channel and *normalized* depth in Alpha.
+	 * @param RTWorldBounds UE world extents of the render targets.
+	 */
+	UFUNCTION(BlueprintCallable, Category = "Foliage Spawner")
+	void BuildFoliageTransforms(UTextureRenderTarget2D* FoliageDistributionMap,
+	                            UTextureRenderTarget2D* NormalAndDepthMap, FBox RTWorldBounds);
+
+	/**
+	 * @brief Like BuildFoliageTransforms, but reprojects the given pixels instead of reading back the render targets,
+	 * which only provide the size and format. Used to benchmark the CPU path with synthetic captures.
+	 * @param ClassificationPixels Every pixel of FoliageDistributionMap, row by row.
+	 * @param NormalPixels Every pixel of NormalAndDepthMap, row by row.
+	 */
+	void BuildFoliageTransformsFromPixels(const FFoliagePixelBuffer& ClassificationPixels,
+	                                      const FFoliagePixelBuffer& NormalPixels,
+	                                      UTextureRenderTarget2D* FoliageDistributionMap,
+	                                      UTextureRenderTarget2D* NormalAndDepthMap, FBox RTWorldBounds);
+	
+	UFUNCTION(BlueprintCallable, Category = "Foliage Spawner")
+	void ClearFoliageInstances();
+
+	/**
+	 * @brief Camera that builds started from now on rank their tiles against, see bPrioritizeVisibleTiles.
+	 * @param FOVDegrees Horizontal field of view.
+	 * @param AspectRatio Width over height of the view.
+	 */
+	UFUNCTION(BlueprintCallable, Category = "Foliage Spawner")
+	void SetViewpoint(const FVector& Location, const FRotator& Rotation, float FOVDegrees, float AspectRatio = 1.777778f);
+
+	/**
+	 * @brief Create required HISM components, removing if outdated
+	 */
+	void ResetAndCreateHISMComponents();
+
+	/**
+	 * @brief Implementable BP event, called when the player moves outside of the capture boundaries.
+	 */
+	UFUNCTION(BlueprintCallable, BlueprintNativeEvent, Category = "Foliage Spawner")
+	void OnUpdate(const FVector& NewLocation);
+
+	UFUNCTION(BlueprintCallable, BlueprintNativeEvent, Category = "Foliage Spawner")
+	void OnInstancesCleared();
+
+	/**
+	 * @brief Is the foliage currently building?
+	 */
+	UFUNCTION(BlueprintCallable, BlueprintPure, Category = "Foliage Spawner")
+	bool IsBuilding() const;
+
+	/*
+	* @brief Are we waiting to be built?
+	*/
+	UFUNCTION(BlueprintCallable, BlueprintPure, Category = "Foliage Spawner")
+	bool IsWaiting() const;
+
+	/**
+	 * @brief Number of builds started since the actor was spawned, including builds that had nothing to rebuild.
+	 */
+	UFUNCTION(BlueprintCallable, BlueprintPure, Category = "Foliage Spawner")
+	int32 GetNumBuildsStarted() const;
+
+	/**
+	 * @brief Is there room for another build, see MaxBuildsInFlight?
+	 */
+	UFUNCTION(BlueprintCallable, BlueprintPure, Category = "Foliage Spawner")
+	bool CanStartBuild() const;
+
+	UFUNCTION(BlueprintCallable, BlueprintPure, Category = "Foliage Spawner")
+	int32 GetNumBuildsInFlight() const;
+
+	/**
+	 * @brief Hands this actor's foliage over to Leader, which builds the same foliage from the same view (see
+	 * UFoliageCaptureSubsystem). Builds in flight are cancelled and every HISM is cleared, so each geometry type is
+	 * only instanced once, by the leader. Null to build on its own again, starting with a new capture.
+	 */
+	void MergeInto(AFoliageCaptureActor* Leader);
+
+	/**
+	 * @brief Whether another capture actor builds in place of this one, see MergeInto.
+	 */
+	bool IsMerged() const { return bIsMerged; }
+
+	/**
+	 * @brief Whether the actor needs a capture before its current location shows anything, e.g. after leaving a merge.
+	 */
+	bool NeedsCapture() const { return bNeedsCapture; }
+
+	/**
+	 * @brief Hash of every setting that decides which foliage a capture at a given location builds: the tile cache
+	 * settings, the geometry types and their density falloff, the instance budget and the HISM layout.
+	 */
+	uint32 GetCaptureMergeKey() const;
+
+	/**
+	 * @brief Counters and timings of the builds so far, see FFoliageCaptureStats.
+	 */
+	UFUNCTION(BlueprintCallable, BlueprintPure, Category = "Foliage Spawner")
+	FFoliageCaptureStats GetCaptureStats() const;
+
+	/**
+	 * @brief Instance ceiling on the current platform, the lower of MaxInstances and MaxInstanceMemoryMB, or
+	 * MAX_int32 if neither is set.
+	 */
+	UFUNCTION(BlueprintCallable, BlueprintPure, Category = "Foliage Spawner")
+	int32 GetInstanceBudget() const;
+
+	/**
+	 * @brief Whether complete grid cells are cached with the current settings, see bUseTileCache.
+	 */
+	bool CanUseTileCache() const;
+
+	/**
+	 * @brief Blocks until every cell cached so far has been written to the disk tile cache.
+	 */
+	void WaitForTileCacheWrites() const;
+
+protected:
+	/**
+	 * @brief Attempt to correct normals and elevation of the pending instances by raycasting. Issues one async
+	 * trace per pending trace, false if there's nothing to trace.
+	 */
+	bool IssueSurfaceTraces(FFoliageBuildBuffers* Buffers);
+
+	void OnSurfaceTraceDone(const FTraceHandle& TraceHandle, FTraceDatum& TraceDatum, FFoliageBuildBuffers* Buffers);
+
+	/**
+	 * @brief Game thread: hands the result of a build to the HISMs and releases its buffers.
+	 */
+	void CommitBuildBuffers(FFoliageBuildBuffers* Buffers);
+
+	/**
+	 * @brief Acquires the buffers for a build and fills in Context, updating the grid cells.
+	 * @param bReservePixels Reserve the pixel buffers for a readback of the render targets.
+	 * @return Null if the build can't start or there's nothing to rebuild.
+	 */
+	FFoliageBuildBuffers* BeginBuild(UTextureRenderTarget2D* FoliageDistributionMap,
+	                                 UTextureRenderTarget2D* NormalAndDepthMap, const FBox& RTWorldBounds,
+	                                 bool bReservePixels, FFoliageReprojectionContext& Context);
+
+	/**
+	 * @brief Worker thread: reprojects the pixels in Buffers, then hands the build to the game thread.
+	 * @param bSuccess Whether the pixels were read back.
+	 */
+	void ReprojectBuildBuffers(FFoliageBuildBuffers* Buffers, const FFoliageReprojectionContext& Context,
+	                           bool bSuccess);
+
+	/**
+	 * @brief Game thread: releases the buffers of a build that was committed, dropped or failed.
+	 */
+	void FinishBuild(FFoliageBuildBuffers* Buffers);
+
+	/**
+	 * @brief Game thread: releases the buffers of a build that failed or was cancelled before its commit, leaving
+	 * the cells it was going to rebuild for the next build.
+	 */
+	void AbandonBuild(FFoliageBuildBuffers* Buffers);
+
+	/**
+	 * @brief Cancels the builds in flight whose result NewBuild replaces: all older builds without grid cells, and
+	 * older builds none of whose cells are still waiting for them with grid cells.
+	 */
+	void CancelSupersededBuilds(const FFoliageBuildBuffers& NewBuild);
+
+	/**
+	 * @brief Rotation, offset and scale of an instance at Location, relative to ActorTransform.
+	 * @return False if the rotation couldn't be normalized.
+	 */
+	static bool MakeInstanceTransform(const FVector& Location, const FVector& Normal, const FQuat& EastSouthUp,
+	                                  const FFoliagePendingInstance& Instance, const FTransform& ActorTransform,
+	                                  FTransform& OutTransform);
+
+	/**
+	 * @brief Reprojects every pixel inside the tile, adding the resulting transforms to OutTransforms.
+	 * Safe to call from multiple worker threads as long as each call has its own OutTransforms.
+	 */
+	void ReprojectTile(int32 TileIndex, const FFoliageReprojectionTile& Tile, const FFoliageReprojectionContext& Context,
+	                   FFoliageTransforms& OutTransforms) const;
+
+	/**
+	 * @brief Ranks Tile against Context.Viewpoint, using the height of its centre pixel for the whole tile. Without
+	 * a viewpoint, tiles are only ranked by distance from the actor.
+	 */
+	void RankReprojectionTile(FFoliageReprojectionTile& Tile, const FFoliageReprojectionContext& Context) const;
+
+	/**
+	 * @brief Latest viewpoint given to SetViewpoint.
+	 */
+	FFoliageViewpoint Viewpoint;
+
+	/**
+	 * @brief Instances Tile is expected to generate at its DensityScale, counting only the pixels ReprojectTile
+	 * places foliage on: those of cells being rebuilt, inside the falloff ranges.
+	 */
+	double CountExpectedInstances(const FFoliageReprojectionTile& Tile, const FFoliageReprojectionContext& Context) const;
+
+	/**
+	 * @brief Instances NewBuild may generate: the budget less the instances that stay, and those held back by the
+	 * other builds in flight. Without grid cells every build replaces all instances.
+	 */
+	int32 GetAvailableInstanceBudget(const FFoliageBuildBuffers& NewBuild) const;
+
+	/**
+	 * @brief Instances HISM will hold once its pending clear or commit has been applied.
+	 */
+	static int32 GetBudgetedInstanceCount(const UFoliageHISM* HISM);
+
+	/**
+	 * @brief Regions of the RT that contain grid cells which need to be rebuilt. Falls back to the whole RT if the
+	 * kept cells don't form a rectangle.
+	 */
+	TArray<FIntRect> FindExposedPixelRects(UTextureRenderTarget2D* RT, const FFoliageReprojectionContext& Context) const;
+
+	/**
+	 * @brief Exact engine location of a pixel at the given elevation (metres).
+	 */
+	FVector ProjectPixelToEngine(const double& X, const double& Y, const double& Elevation,
+	                             const FFoliageReprojectionContext& Context) const;
+
+	/**
+	 * @brief Samples the georeference across TileRect, choosing the node spacing so the interpolation error
+	 * stays below MaxProjectionError.
+	 */
+	void InitializeTileProjection(const FIntRect& TileRect, const FFoliageReprojectionContext& Context,
+	                              FFoliageTileProjection& OutProjection) const;
+
+	/**
+	 * @brief Seed for a geometry type that is stable between rebuilds and sessions (doesn't depend on pointers).
+	 */
+	static uint32 GetGeometryTypeSeed(const FFoliageGeometryType& FoliageGeometryType);
+
+	/**
+	 * @brief Creates the random stream for a geometry type at the given geographic location.
+	 */
+	FRandomStream MakePlacementStream(const FVector& GeographicCoords, uint32 GeometryTypeSeed) const;
+
+	/**
+	 * @brief Rebuilds ClassificationLUT from FoliageTypes and ClassificationColourTolerance.
+	 */
+	void BuildClassificationLUT();
+
+	/**
+	 * @brief ClassificationColourTolerance in 8-bit steps, shared by the LUT and the placement shader.
+	 */
+	int32 GetQuantizedColourTolerance() const;
+
+	/**
+	 * @brief Index into FoliageTypes for a pixel of a classification buffer, or INDEX_NONE if no type matches.
+	 */
+	int32 FindClassificationIndex(const FFoliagePixelBuffer& Pixels, int32 Index) const;
+
+	/**
+	 * @brief Quantized classification colour to FoliageTypes index. If the tolerances of two types overlap,
+	 * the first type wins.
+	 */
+	TMap<uint32, int32> ClassificationLUT;
+
+	/**
+	 * @brief FFoliageClassificationType::ClassID to FoliageTypes index, for ClassID8 classification buffers.
+	 */
+	TArray<int32> ClassIDLUT;
+
+	/**
+	 * @brief Creates and registers a HISM component for a geometry type.
+	 */
+	UFoliageHISM* CreateHISM(const FFoliageGeometryType& FoliageGeometryType);
+
+	/**
+	 * @brief True once every HISM with a new back component has finished filling it.
+	 */
+	bool CanFlipHISMBuffers();
+
+	/**
+	 * @brief Shows the new back components of all HISMs in one step.
+	 */
+	void FlipHISMBuffers();
+
+	/**
+	 * @brief A build has completed and its back components are waiting to be flipped.
+	 */
+	bool bFlipPending = false;
+
+	/**
+	 * @brief Recycles grid cells that left the capture, creates the cells that entered it and fills the cell
+	 * targets of the context.
+	 */
+	void UpdateGridCells(const glm::dvec4& GeographicExtents2D, FFoliageReprojectionContext& OutContext,
+	                     FFoliageBuildBuffers& Buffers);
+
+	/**
+	 * @brief Marks the cells Buffers was going to rebuild as incomplete, so the next build rebuilds them. Called if
+	 * a build fails or is dropped, or its cells were thinned out by the budget.
+	 */
+	void InvalidatePendingGridCells(const FFoliageBuildBuffers& Buffers);
+
+	/**
+	 * @brief Returns the HISMs of a grid cell to the free list and marks them for clear.
+	 */
+	void RecycleGridCell(FFoliageGridCell& Cell);
+
+	/**
+	 * @brief Grid cells with HISMs, keyed by FFoliageGridCell::FromGeographic.
+	 */
+	TMap<FIntPoint, FFoliageGridCell> GridCells;
+
+	/**
+	 * @brief Unused cell HISMs of each geometry type.
+	 */
+	TArray<TArray<UFoliageHISM*>> FreeCellHISMs;
+
+	/**
+	 * @brief Generated instances of complete grid cells, see bUseTileCache.
+	 */
+	FFoliageTileCache TileCache;
+
+	/**
+	 * @brief At least one cell of the current build was restored from the tile cache.
+	 */
+	bool bCellsRestoredFromCache = false;
+
+	/**
+	 * @brief Hash of every setting the generated instances depend on, besides the cell and capture resolution.
+	 */
+	uint32 GetTileCacheSettingsHash() const;
+
+	/**
+	 * @brief Queues the cached instances of Cell for add if they're in memory, or starts loading them if the tile
+	 * cache's directory listings have them. False if the cell isn't cached, without touching the disk.
+	 */
+	bool RestoreGridCellFromCache(const FFoliageTileCacheKey& Key, FFoliageGridCell& Cell);
+
+	/**
+	 * @brief Queues the instances of Tile for add to the HISMs of Cell, without copying them. False if the tile
+	 * doesn't match the cell.
+	 */
+	bool RestoreGridCellFromTile(const TSharedPtr<const FFoliageCachedTile, ESPMode::ThreadSafe>& Tile,
+	                             FFoliageGridCell& Cell);
+
+	/**
+	 * @brief Restores the cell of Key once its tile load finished, unless the cell was recycled since. Cells whose
+	 * tile couldn't be loaded are rebuilt by the next build.
+	 */
+	void OnGridCellTileLoaded(const FFoliageTileCacheKey& Key, int32 LoadSerial,
+	                          const TSharedPtr<const FFoliageCachedTile, ESPMode::ThreadSafe>& Tile);
+
+	/**
+	 * @brief Number of tile loads started, see FFoliageGridCell::TileLoadSerial.
+	 */
+	int32 NumTileLoadsStarted = 0;
+
+	/**
+	 * @brief Caches the instances of the complete cells the build just filled. Their HISMs then commit the
+	 * instances from the cached tiles, so the cache doesn't hold a second copy.
+	 */
+	void StoreGridCellsInCache(const FFoliageBuildBuffers& Buffers);
+
+	/**
+	 * @brief Tile cache settings hash and capture resolution of the current build.
+	 */
+	uint32 TileCacheSettingsHash = 0;
+	FIntPoint TileCacheResolution = FIntPoint::ZeroValue;
+
+	/**
+	 * @brief Size of a grid cell in degrees of longitude and latitude, fixed on the first partitioned build.
+	 */
+	FVector2D GridCellSizeInDegrees = FVector2D::ZeroVector;
+
+	/**
+	 * @brief For each static mesh, we also want to have multiple HISM components to reduce
+	 * hitches when updating instances.
+	 */
+	TMap<FFoliageGeometryType, TArray<UFoliageHISM*>> HISMFoliageMap;
+
+	/**
+	 * @brief The scene depth value is multiplied by a small value so it remains within the range of 0.0 to 1.0.
+	 * In this function it is projected back to it's (approximated) original value and then inverted.
+	 * @param Value Depth value
+	 * @return Height in metres.
+	 */
+	double GetHeightFromDepth(const double& Value) const;
+
+
+	/**
+	 * @brief Converts pixel coordinates back to geographic coordinates.
+	 */
+	FVector PixelToGeographicLocation(const double& X, const double& Y, const double& Altitude,
+	                                     UTextureRenderTarget2D* RT, const glm::dvec4& GeographicExtents) const;
+	/**
+	 * @brief Converts geographic coordinates to pixel coordinates.
+	 */
+	FIntPoint GeographicToPixelLocation(const double& Longitude, const double& Latitude, UTextureRenderTarget2D* RT,
+	                                    const glm::dvec4& GeographicExtents) const;
+
+	/**
+	 * @brief Modified version of ReadRenderColorPixels. Pixels are kept in the narrowest encoding that matches
+	 * the format of each RT (see EFoliagePixelEncoding).
+	 * @param InRects Regions to read, appended to OutImageData one after another. Reads the whole RT if empty.
+	 */
+	void ReadRenderTargetPixelsAsync(
+		FOnRenderTargetRead OnRenderTargetRead,
+		TArray<FTextureRenderTargetResource*> RTs,
+		TArray<FFoliagePixelBuffer*> OutImageData,
+		FReadSurfaceDataFlags InFlags = FReadSurfaceDataFlags(
+			RCM_MinMax,
+			CubeFace_MAX),
+		TArray<FIntRect> InRects = TArray<FIntRect>(),
+		ENamedThreads::Type ExitThread = ENamedThreads::AnyBackgroundThreadNormalTask);
+
+	/**
+	 * @brief Non-blocking version of ReadRenderTargetPixelsAsync. Copies the RTs into staging textures, which are
+	 * mapped once the readback queue finds them ready.
+	 */
+	void ReadRenderTargetPixelsWithGPUReadbackAsync(
+		FOnRenderTargetRead OnRenderTargetRead,
+		TArray<FTextureRenderTargetResource*> RTs,
+		TArray<FFoliagePixelBuffer*> OutImageData,
+		TArray<FIntRect> InRects,
+		ENamedThreads::Type ExitThread);
+
+	/**
+	 * @brief Queue the staging texture readbacks and GPU placements are polled through, polled every tick. Shared
+	 * with every other capture actor through UFoliageCaptureSubsystem, LocalReadbackQueue outside of a world.
+	 */
+	FFoliageReadbackQueue& GetReadbackQueue();
+
+	/**
+	 * @brief Readbacks of this actor alone, used when there is no UFoliageCaptureSubsystem.
+	 */
+	FFoliageReadbackQueue LocalReadbackQueue;
+
+	/**
+	 * @brief Whether the current settings can be evaluated by the placement shader.
+	 */
+	bool CanUseGPUPlacement() const;
+
+	/**
+	 * @brief Places the foliage with the placement shader instead of reading back the RTs, then hands the
+	 * instances off like the CPU path.
+	 */
+	void BuildFoliageTransformsOnGPU(UTextureRenderTarget2D* FoliageDistributionMap,
+	                                 UTextureRenderTarget2D* NormalAndDepthMap, FFoliageBuildBuffers* Buffers,
+	                                 const FFoliageReprojectionContext& Context);
+
+	/**
+	 * @brief One set per build in flight, plus one that can be handed off on the game thread while the others are
+	 * being filled.
+	 */
+	FFoliageBuildBuffers BuildBuffers[4];
+
+	/**
+	 * @brief Adds up to MaxInstances of the HISM's pending transforms, continuing from where the previous call
+	 * stopped.
+	 * @return True once all of its transforms have been added.
+	 */
+	bool CommitHISMTransforms(UFoliageHISM* FoliageHISM, int32 MaxInstances);
+
+	/**
+	 * @brief Chunk of pending instances expanded to transforms by CommitHISMTransforms, reused between commits.
+	 */
+	TArray<FTransform> CommitTransforms;
+
+	/**
+	 * @brief Moving average of the time (in milliseconds) that adding a single instance takes.
+	 */
+	double CommitCostPerInstanceMs = 0.001;
+
+	/**
+	 * @brief A HISM was only partially filled in the last update.
+	 */
+	bool bIsCommitInProgress = false;
+
+	/**
+	 * @brief Returns a set of BuildBuffers that isn't in use, or nullptr if all of them are. Callers check
+	 * CanStartBuild first, which keeps MaxBuildsInFlight sets in use at most and one spare for the hand-off.
+	 */
+	FFoliageBuildBuffers* AcquireBuildBuffers();
+
+	/**
+	 * @brief Don't run tick update if true.
+	 */
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere, Category = "Foliage Spawner")
+	bool bIsBuilding = false;
+
+	/**
+	* @brief If we are waiting to build foliage
+	*/
+	UPROPERTY(BlueprintReadOnly, VisibleAnywhere, Category = "Foliage Spawner")
+	bool bIsWaiting = false;
+
+	/**
+	 * @brief Capture actor that builds in place of this one, see MergeInto.
+	 */
+	TWeakObjectPtr<AFoliageCaptureActor> MergedInto;
+	bool bIsMerged = false;
+	bool bNeedsCapture = false;
+
+	int32 NumBuildsStarted = 0;
+	int32 NumBuildsInFlight = 0;
+
+	/**
+	 * @brief See GetCaptureStats, which fills in the live counts.
+	 */
+	FFoliageCaptureStats CaptureStats;
+
+	/**
+	 * @brief Highest generation of the builds that finished, and of the builds that were committed.
+	 */
+	int32 LastFinishedGeneration = 0;
+	int32 LastCommittedGeneration = 0;
+
+	/**
+	 * @brief Time of the OnUpdate whose build latency is being measured, negative if none is.
+	 */
+	double UpdateStartTime = -1.0;
+	int32 NumBuildsAtUpdate = 0;
+
+	/**
+	 * @brief Number of frames that have passed after updating foliage.
+	 */
+	int32 Ticks = 0;
+
+	static glm::dvec3 VectorToDVector(const FVector& InVector);
+
+	/**
+	* @brief Gets the total instance count
+	*/
+	int32 GetInstanceCount();
+
+	/**
+	* @brief Are all ISMs marked as cleared
+	*/
+	bool AllISMsMarkedAsCleared();
+
+	/**
+	* @brief Offset all instances
+	*/
+	void OffsetAllInstances(const FVector& InOffset);
+
+	/**
+	* @brief Re-expresses all instances relative to the current actor transform, keeping their world transforms.
+	*/
+	void RebaseAllInstances(const FTransform& InPreviousActorTransform);
+
+	/**
+	* @brief Actor transform before the last OnUpdate.
+	*/
+	FTransform PreviousActorTransform = FTransform::Identity;
+
+	TOptional<FVector> NewActorLocation;
+
+	bool bInstancesClearedCalled = false;
+
+	/**
+	* @brief Offset between the current world origin and the last world origin. Fixed to 0 if rebasing isn't enabled.
+	*/
+	FVector WorldOffset = FVector(0.f);
+	/**
+	* @brief Offset between last actor position and current actor position.
+	*/
+	FVector ActorOffset = FVector(0.f);
+};
+
+inline int32 AFoliageCaptureActor::GetInstanceCount()
+{
+	int32 Count = 0;
+	for (TPair<FFoliageGeometryType, TArray<UFoliageHISM*>>& FoliageHISMPair : HISMFoliageMap)
+	{
+		for (UFoliageHISM* FoliageHISM : FoliageHISMPair.Value) {
+			Count += FoliageHISM->GetFront()->GetInstanceCount();
+		}
+	}
+	return Count;
+}
+
+inline bool AFoliageCaptureActor::AllISMsMarkedAsCleared()
+{
+	bool bIsCleared = true;
+	for (TPair<FFoliageGeometryType, TArray<UFoliageHISM*>>& FoliageHISMPair : HISMFoliageMap)
+	{
+		for (UFoliageHISM* FoliageHISM : FoliageHISMPair.Value) {
+			if (!FoliageHISM->bCleared) {
+				bIsCleared = false;
+				break;
+			}
+		}
+		if (!bIsCleared) {
+			break;
+		}
+	}
+	return bIsCleared;
+}
+
+inline void AFoliageCaptureActor::OffsetAllInstances(const FVector& InOffset)
+{
+	FOLIAGE_SCOPE_CYCLE_COUNTER(STAT_FoliageOffsetInstances);
+
+	for (TPair<FFoliageGeometryType, TArray<UFoliageHISM*>>& FoliageHISMPair : HISMFoliageMap)
+	{
+		for (UFoliageHISM* Slot : FoliageHISMPair.Value) {
+			for (UFoliageHISM* FoliageHISM : {Slot, Slot->Twin}) {
+				if (FoliageHISM == nullptr) {
+					continue;
+				}
+				TArray<FTransform> WorldTransforms;
+				WorldTransforms.SetNum(FoliageHISM->GetInstanceCount());
+				ParallelFor(WorldTransforms.Num(), [&](int32 Index) {
+					FoliageHISM->GetInstanceTransform(Index, WorldTransforms[Index], true);
+					WorldTransforms[Index].SetLocation(
+						WorldTransforms[Index].GetLocation() + InOffset
+					);
+					});
+				FoliageHISM->BatchUpdateInstancesTransforms(0, WorldTransforms, true, true, true);
+			}
+		}
+	}
+}
+
+inline void AFoliageCaptureActor::RebaseAllInstances(const FTransform& InPreviousActorTransform)
+{
+	FOLIAGE_SCOPE_CYCLE_COUNTER(STAT_FoliageOffsetInstances);
+
+	const FTransform Delta = InPreviousActorTransform.GetRelativeTransform(GetActorTransform());
+
+	for (TPair<FFoliageGeometryType, TArray<UFoliageHISM*>>& FoliageHISMPair : HISMFoliageMap)
+	{
+		for (UFoliageHISM* Slot : FoliageHISMPair.Value) {
+			for (UFoliageHISM* FoliageHISM : {Slot, Slot->Twin}) {
+				if (FoliageHISM == nullptr || FoliageHISM->GetInstanceCount() == 0) {
+					continue;
+				}
+				TArray<FTransform> LocalTransforms;
+				LocalTransforms.SetNum(FoliageHISM->GetInstanceCount());
+				ParallelFor(LocalTransforms.Num(), [&](int32 Index) {
+					FoliageHISM->GetInstanceTransform(Index, LocalTransforms[Index], false);
+					LocalTransforms[Index] = LocalTransforms[Index] * Delta;
+					});
+				FoliageHISM->BatchUpdateInstancesTransforms(0, LocalTransforms, false, true, true);
+			}
+		}
+	}
+}
@@ -0,0 +1,99 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "FoliageReadbackQueue.h"
+#include "Subsystems/WorldSubsystem.h"
+
+#include "FoliageCaptureSubsystem.generated.h"
+
+class AFoliageCaptureActor;
+class APlayerCameraManager;
+class AProceduralFoliageEllipsoid;
+
+/**
+ * @brief A view that capture actors follow, one per local player.
+ */
+struct FFoliageViewer
+{
+	TWeakObjectPtr<const APlayerCameraManager> CameraManager;
+
+	FVector Location = FVector::ZeroVector;
+	FRotator Rotation = FRotator::ZeroRotator;
+	float FOVDegrees = 90.f;
+	float AspectRatio = 1.777778f;
+
+	/** Velocity measured between frames, smoothed. Used to predict capture locations. */
+	FVector Velocity = FVector::ZeroVector;
+	/** Speed reported by the camera manager. */
+	double Speed = 0.0;
+};
+
+/**
+ * @brief Drives the capture actors of every AProceduralFoliageEllipsoid in the world from every local player's view.
+ *
+ * A capture actor referenced by several tilesets is only updated once per frame, by the first tileset that
+ * registered it. A capture actor that follows several views (see AFoliageCaptureActor::ViewerIndex) is centred
+ * between them while they fit in a single capture, so split-screen players close to each other share one capture
+ * instead of recapturing it in turn.
+ *
+ * Capture actors that would build the same foliage from the same view, e.g. identical rings of overlapping
+ * tilesets, are merged (see AFoliageCaptureActor::MergeInto and foliage.MergeCaptureActors): the first one captures
+ * and instances each geometry type once, the others keep their HISMs empty until they no longer match.
+ *
+ * Builds of all capture actors share foliage.MaxSharedBuildsInFlight slots, handed out first come first served, so
+ * the readbacks and reprojection workers aren't flooded when several rings or tilesets move at once. Their readbacks
+ * go through a single FFoliageReadbackQueue, polled once per frame.
+ */
+UCLASS()
+class AIDEN_GEO_TUTORIAL_API UFoliageCaptureSubsystem : public UWorldSubsystem
+{
+	GENERATED_BODY()
+
+public:
+	void RegisterTileset(AProceduralFoliageEllipsoid* Tileset);
+	void UnregisterTileset(AProceduralFoliageEllipsoid* Tileset);
+
+	/**
+	 * @brief Updates the viewers and moves the capture actors. Only runs once per frame, however many tilesets
+	 * call it.
+	 */
+	void Update(float DeltaSeconds);
+
+	/**
+	 * @brief Whether CaptureActor may start a build now. If not, it's queued and gets the next free slot as long as
+	 * it keeps asking every frame.
+	 */
+	bool TryAcquireBuildSlot(const AFoliageCaptureActor* CaptureActor);
+
+	const TArray<FFoliageViewer>& GetViewers() const { return Viewers; }
+
+	FFoliageReadbackQueue& GetReadbackQueue() { return ReadbackQueue; }
+
+private:
+	void UpdateViewers(float DeltaSeconds);
+
+	/**
+	 * @brief View CaptureActor follows this frame, merged into OutMergedViewer if it follows several.
+	 * @return Null if there is no view to follow.
+	 */
+	const FFoliageViewer* FindViewer(const AFoliageCaptureActor* CaptureActor, FFoliageViewer& OutMergedViewer) const;
+
+	struct FBuildRequest
+	{
+		TWeakObjectPtr<const AFoliageCaptureActor> CaptureActor;
+		uint64 LastRequestFrame = 0;
+	};
+
+	TArray<TWeakObjectPtr<AProceduralFoliageEllipsoid>> Tilesets;
+
+	/** Every capture actor of the registered tilesets, without duplicates, as of the last update. */
+	TArray<TWeakObjectPtr<AFoliageCaptureActor>> CaptureActors;
+
+	TArray<FFoliageViewer> Viewers;
+	TArray<FBuildRequest> BuildQueue;
+	FFoliageReadbackQueue ReadbackQueue;
+
+	uint64 LastUpdateFrame = MAX_uint64;
+};
@@ -0,0 +1,139 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "FoliageReadbackQueue.h"
+
+// EXPERIMENTAL
+// FAidenGeoTutorialModule maps the "/FoliageShaders" virtual shader directory to the project's Shaders directory,
+// and the module loads in the PostConfigInit phase so the placement shader is registered before shaders compile.
+#ifndef FOLIAGE_GPU_PLACEMENT_ENABLED
+#define FOLIAGE_GPU_PLACEMENT_ENABLED 1
+#endif
+
+class FRDGBuilder;
+class FRHITexture;
+class FRHIGPUBufferReadback;
+class FRHICommandListImmediate;
+class FTextureRenderTargetResource;
+
+/**
+ * @brief Classification type as seen by the placement shader. Layout matches FoliagePlacement.usf.
+ */
+struct FFoliageGPUClass
+{
+	/** 8-bit classification colour in RGB, FFoliageClassificationType::ClassID in A. */
+	FIntVector4 ColourAndID;
+	uint32 FirstGeometryType = 0;
+	uint32 NumGeometryTypes = 0;
+	uint32 Pad[2] = {0, 0};
+};
+
+/**
+ * @brief Placement rules of a geometry type as seen by the placement shader. Layout matches FoliagePlacement.usf.
+ */
+struct FFoliageGPUGeometryType
+{
+	enum EFlags : uint32
+	{
+		AlignToNormal = 1 << 0,
+		RandomYaw = 1 << 1
+	};
+
+	float Density = 0.f;
+	float ScaleMin = 1.f;
+	float ScaleMax = 1.f;
+	float ZOffsetMin = 0.f;
+	float ZOffsetMax = 0.f;
+	uint32 Seed = 0;
+	uint32 Flags = 0;
+	uint32 Pad = 0;
+};
+
+/**
+ * @brief Instance written by the placement shader, relative to the capture actor. Layout matches
+ * FoliagePlacement.usf.
+ */
+struct FFoliageGPUInstance
+{
+	FVector3f Location;
+	float Scale;
+	FVector4f Rotation;
+	/** Pixel index, used to put the unordered shader output back into a deterministic order. */
+	uint32 SortKey;
+	uint32 GeometryTypeIndex;
+	uint32 Pad[2];
+};
+
+static_assert(sizeof(FFoliageGPUInstance) == 48, "FFoliageGPUInstance must match the shader layout");
+
+/**
+ * @brief Everything the placement shader needs besides the render targets, gathered on the game thread.
+ */
+struct FFoliageGPUPlacementInputs
+{
+	TArray<FFoliageGPUClass> Classes;
+	TArray<FFoliageGPUGeometryType> GeometryTypes;
+
+	/** Projection nodes across the whole RT (see FFoliageTileProjection), relative to the actor. */
+	TArray<FVector4f> NodeLocations;
+	TArray<FVector4f> NodeUpPerMetre;
+	/** World space east-south-up rotation of each node. */
+	TArray<FVector4f> NodeEastSouthUp;
+	FIntPoint NodeCount = FIntPoint::ZeroValue;
+	int32 NodeSpacing = 1;
+
+	FIntPoint TextureSize = FIntPoint::ZeroValue;
+	uint32 MaxInstances = 0;
+	bool bClassificationIsClassID = false;
+	bool bNormalDepthIsPacked = false;
+	int32 ColourTolerance = 0;
+	float CaptureElevation = 0.f;
+
+	FVector4f ActorInverseRotation = FVector4f(0.f, 0.f, 0.f, 1.f);
+	float ActorInverseScale = 1.f;
+
+	/** Placement cell of the minimum geographic extents, and the pixel to cell mapping relative to it. */
+	FIntPoint BaseCell = FIntPoint::ZeroValue;
+	FVector2f CellOrigin = FVector2f::ZeroVector;
+	FVector2f CellRange = FVector2f::ZeroVector;
+	uint32 PlacementSeedHash = 0;
+};
+
+/**
+ * @brief Evaluates the foliage placement rules on the GPU, straight from the capture RTs, and reads back only the
+ * resulting instances. Polled through FFoliageReadbackQueue once dispatched.
+ */
+struct FFoliageGPUPlacement : public FFoliageReadback
+{
+	FFoliageGPUPlacementInputs Inputs;
+
+	/**
+	 * Called on a background thread with the placed instances, in deterministic order, and the number of instances
+	 * that didn't fit in MaxInstances.
+	 */
+	TFunction<void(bool /*bSuccess*/, TArray<FFoliageGPUInstance>&& /*Instances*/, int32 /*NumDropped*/)> OnPlaced;
+
+	TUniquePtr<FRHIGPUBufferReadback> CountReadback;
+	TUniquePtr<FRHIGPUBufferReadback> InstanceReadback;
+
+	FFoliageGPUPlacement();
+	virtual ~FFoliageGPUPlacement() override;
+
+	/**
+	 * @brief Game thread: queues Placement on the render thread, reading the given capture RTs.
+	 */
+	static void Dispatch(const TSharedPtr<FFoliageGPUPlacement, ESPMode::ThreadSafe>& Placement,
+	                     FTextureRenderTargetResource* ClassificationRT, FTextureRenderTargetResource* NormalDepthRT);
+
+	/**
+	 * @brief Render thread: adds the placement pass and the readback copies to GraphBuilder.
+	 */
+	void AddPasses(FRDGBuilder& GraphBuilder, FRHITexture* ClassificationTexture, FRHITexture* NormalDepthTexture);
+
+	/**
+	 * @brief Render thread: once both readbacks have landed, copies the instances out and calls OnPlaced.
+	 */
+	virtual void Poll(FRHICommandListImmediate& RHICmdList) override;
+};
@@ -1,29 +1,112 @@
-// Fill out your copyright notice in the Description page of Project Settings.
-
-#pragma once
-
-#include "CoreMinimal.h"
-#include "Components/HierarchicalInstancedStaticMeshComponent.h"
-#include "FoliageHISM.generated.h"
-
-/**
- * 
- */
-UCLASS()
-class AIDEN_GEO_TUTORIAL_API UFoliageHISM : public UHierarchicalInstancedStaticMeshComponent
-{
-	friend class UInstancedStaticMeshComponent;
-	GENERATED_BODY()
-public:
-	UPROPERTY()
-	TArray<FTransform> Transforms;
-
-	UPROPERTY()
-	bool bMarkedForAdd = false;
-
-	UPROPERTY()
-	bool bMarkedForClear = false;
-
-	UPROPERTY()
-		bool bCleared = false;
-};
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Components/HierarchicalInstancedStaticMeshComponent.h"
+#include "FoliageInstanceBuffer.h"
+#include "FoliageHISM.generated.h"
+
+/**
+ * 
+ */
+UCLASS()
+class AIDEN_GEO_TUTORIAL_API UFoliageHISM : public UHierarchicalInstancedStaticMeshComponent
+{
+	friend class UInstancedStaticMeshComponent;
+	GENERATED_BODY()
+public:
+	/**
+	 * @brief Instances waiting to be added, expanded to transforms as they're committed.
+	 */
+	FFoliageInstanceChunks Transforms;
+
+	/**
+	 * @brief Number of Transforms that have already been added to the component, when they're committed over
+	 * several frames.
+	 */
+	UPROPERTY()
+	int32 NumTransformsCommitted = 0;
+
+	/**
+	 * @brief Actor transform of the build that produced Transforms, when the capture actor anchors its HISMs.
+	 * The component is moved there as the transforms are committed.
+	 */
+	TOptional<FTransform> PendingAnchor;
+
+	/**
+	 * @brief Build whose instances the component is waiting for, see AFoliageCaptureActor::MaxBuildsInFlight.
+	 * Instances of any other build that arrive later are stale.
+	 */
+	int32 BuildGeneration = INDEX_NONE;
+
+	UPROPERTY()
+	bool bMarkedForAdd = false;
+
+	UPROPERTY()
+	bool bMarkedForClear = false;
+
+	UPROPERTY()
+		bool bCleared = false;
+
+	/**
+	 * @brief Drops the transforms that are waiting to be added.
+	 */
+	void ResetPendingTransforms()
+	{
+		Transforms.Empty();
+		NumTransformsCommitted = 0;
+		PendingAnchor.Reset();
+	}
+
+	/**
+	 * @brief Replaces all instances with InInstances. The instance buffer and cluster tree are built on a worker
+	 * thread and swapped in on the game thread once ready, the current instances stay visible until then.
+	 * @param InAnchor World transform the component is moved to in the same step, if set.
+	 */
+	void ReplaceInstancesAsync(FFoliageInstanceChunks&& InInstances, const TOptional<FTransform>& InAnchor = {});
+
+	/**
+	 * @brief Discards the result of an in-flight ReplaceInstancesAsync.
+	 */
+	void CancelAsyncReplace()
+	{
+		++AsyncReplaceSerial;
+		bIsReplacingInstances = false;
+	}
+
+	bool IsReplacingInstances() const { return bIsReplacingInstances; }
+
+	/**
+	 * @brief Hidden second component of this pool slot, only created when the capture actor double buffers its
+	 * HISMs. Pending transforms and flags always live on the slot, the instances go to whichever is hidden.
+	 */
+	UPROPERTY()
+	UFoliageHISM* Twin = nullptr;
+
+	/** The twin is currently the visible component. */
+	bool bTwinIsFront = false;
+
+	/** The back component holds the complete result of the current build and can be flipped to the front. */
+	bool bBackReady = false;
+
+	/** The back component still holds the instances it had before the last flip. */
+	bool bBackNeedsClear = false;
+
+	UFoliageHISM* GetFront() { return Twin != nullptr && bTwinIsFront ? Twin : this; }
+	const UFoliageHISM* GetFront() const { return Twin != nullptr && bTwinIsFront ? Twin : this; }
+	UFoliageHISM* GetBack() { return Twin != nullptr && !bTwinIsFront ? Twin : this; }
+
+	/**
+	 * @brief Shows the back component and hides the front one, which is left to be cleared later.
+	 */
+	void FlipBuffers();
+
+private:
+	/**
+	 * @brief Incremented for every async replace, so results of superseded builds are ignored.
+	 */
+	int32 AsyncReplaceSerial = 0;
+
+	bool bIsReplacingInstances = false;
+};
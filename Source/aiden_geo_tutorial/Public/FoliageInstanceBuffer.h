@@ -0,0 +1,329 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+struct FFoliageCachedTile;
+
+/**
+ * @brief Foliage instances waiting to be added to a HISM, stored as separate arrays of float location, packed
+ * rotation and uniform scale (24 bytes per instance instead of 96 for an FTransform).
+ * Meant to be moved or swapped between stages, instances are only expanded to transforms when committed.
+ */
+struct FFoliageInstanceBuffer
+{
+	/** Relative to the HISM's parent. */
+	TArray<FVector3f> Locations;
+	/** Unit quaternion with each component quantized to 16 bits, see PackRotation. */
+	TArray<uint64> Rotations;
+	TArray<float> Scales;
+
+	int32 Num() const { return Locations.Num(); }
+
+	/**
+	 * @brief Empties the buffer, keeping its allocation.
+	 */
+	void Reset()
+	{
+		Locations.Reset();
+		Rotations.Reset();
+		Scales.Reset();
+	}
+
+	void Empty()
+	{
+		Locations.Empty();
+		Rotations.Empty();
+		Scales.Empty();
+	}
+
+	void Reserve(int32 Number)
+	{
+		Locations.Reserve(Number);
+		Rotations.Reserve(Number);
+		Scales.Reserve(Number);
+	}
+
+	void Add(const FVector& Location, const FQuat& Rotation, float Scale)
+	{
+		Locations.Add(FVector3f(Location));
+		Rotations.Add(PackRotation(Rotation));
+		Scales.Add(Scale);
+	}
+
+	/**
+	 * @brief Adds Transform, which is assumed to have a uniform scale.
+	 */
+	void Add(const FTransform& Transform)
+	{
+		Add(Transform.GetLocation(), Transform.GetRotation(), Transform.GetScale3D().X);
+	}
+
+	void Append(const FFoliageInstanceBuffer& Other)
+	{
+		Locations.Append(Other.Locations);
+		Rotations.Append(Other.Rotations);
+		Scales.Append(Other.Scales);
+	}
+
+	FTransform GetTransform(int32 Index) const
+	{
+		return FTransform(UnpackRotation(Rotations[Index]), FVector(Locations[Index]), FVector(Scales[Index]));
+	}
+
+	/**
+	 * @brief Appends Count instances starting at First to OutTransforms.
+	 */
+	void ExpandTransforms(int32 First, int32 Count, TArray<FTransform>& OutTransforms) const
+	{
+		OutTransforms.Reserve(OutTransforms.Num() + Count);
+		for (int32 Index = First; Index < First + Count; ++Index)
+		{
+			OutTransforms.Add(GetTransform(Index));
+		}
+	}
+
+	static uint64 PackRotation(const FQuat& Rotation);
+	static FQuat UnpackRotation(uint64 Packed);
+};
+
+inline uint64 FFoliageInstanceBuffer::PackRotation(const FQuat& Rotation)
+{
+	const FQuat Normalized = Rotation.GetNormalized();
+	const double Components[4] = {Normalized.X, Normalized.Y, Normalized.Z, Normalized.W};
+
+	uint64 Packed = 0;
+	for (int32 Index = 0; Index < 4; ++Index)
+	{
+		const int16 Quantized = static_cast<int16>(FMath::RoundToInt(FMath::Clamp(Components[Index], -1.0, 1.0) * 32767.0));
+		Packed |= static_cast<uint64>(static_cast<uint16>(Quantized)) << (Index * 16);
+	}
+	return Packed;
+}
+
+inline FQuat FFoliageInstanceBuffer::UnpackRotation(uint64 Packed)
+{
+	double Components[4];
+	for (int32 Index = 0; Index < 4; ++Index)
+	{
+		Components[Index] = static_cast<int16>(static_cast<uint16>(Packed >> (Index * 16))) / 32767.0;
+	}
+	return FQuat(Components[0], Components[1], Components[2], Components[3]).GetNormalized();
+}
+
+/**
+ * @brief Read only instances laid out like an FFoliageInstanceBuffer, in memory owned by someone else, such as the
+ * memory mapped file of a cached tile.
+ */
+struct FFoliageInstanceView
+{
+	const FVector3f* Locations = nullptr;
+	const uint64* Rotations = nullptr;
+	const float* Scales = nullptr;
+	int32 NumInstances = 0;
+
+	FFoliageInstanceView() = default;
+
+	explicit FFoliageInstanceView(const FFoliageInstanceBuffer& Buffer)
+		: Locations(Buffer.Locations.GetData())
+		, Rotations(Buffer.Rotations.GetData())
+		, Scales(Buffer.Scales.GetData())
+		, NumInstances(Buffer.Num())
+	{
+	}
+
+	int32 Num() const { return NumInstances; }
+
+	FTransform GetTransform(int32 Index) const
+	{
+		check(Index >= 0 && Index < NumInstances);
+		return FTransform(FFoliageInstanceBuffer::UnpackRotation(Rotations[Index]), FVector(Locations[Index]),
+		                  FVector(Scales[Index]));
+	}
+
+	/**
+	 * @brief Appends Count instances starting at First to OutTransforms.
+	 */
+	void ExpandTransforms(int32 First, int32 Count, TArray<FTransform>& OutTransforms) const
+	{
+		OutTransforms.Reserve(OutTransforms.Num() + Count);
+		for (int32 Index = First; Index < First + Count; ++Index)
+		{
+			OutTransforms.Add(GetTransform(Index));
+		}
+	}
+
+	/**
+	 * @brief Appends copies of the viewed instances to OutBuffer.
+	 */
+	void CopyTo(FFoliageInstanceBuffer& OutBuffer) const
+	{
+		OutBuffer.Locations.Append(Locations, NumInstances);
+		OutBuffer.Rotations.Append(Rotations, NumInstances);
+		OutBuffer.Scales.Append(Scales, NumInstances);
+	}
+};
+
+/**
+ * @brief Instances of a cached tile, which the chunk keeps alive while they're waiting to be committed.
+ */
+struct FFoliageSharedInstanceChunk
+{
+	FFoliageInstanceView View;
+	TSharedPtr<const FFoliageCachedTile, ESPMode::ThreadSafe> Tile;
+};
+
+/**
+ * @brief Instances handed from one stage to the next as a list of buffers. Large buffers are moved in whole rather
+ * than copied, so the data generated on a worker thread reaches the HISM without being duplicated. Instances of
+ * cached tiles are referenced in place, after the owned chunks.
+ */
+struct FFoliageInstanceChunks
+{
+	/** Buffers smaller than this are appended to the last chunk instead, to keep the number of chunks down. */
+	static constexpr int32 MinChunkSize = 4096;
+
+	TArray<FFoliageInstanceBuffer> Chunks;
+
+	/** Counted after every instance in Chunks. */
+	TArray<FFoliageSharedInstanceChunk> SharedChunks;
+
+	int32 Num() const { return NumInstances; }
+
+	/**
+	 * @brief Empties the list, keeping the allocation of the first chunk.
+	 */
+	void Reset()
+	{
+		Chunks.SetNum(FMath::Min(Chunks.Num(), 1));
+		if (Chunks.Num() > 0)
+		{
+			Chunks[0].Reset();
+		}
+		SharedChunks.Reset();
+		NumInstances = 0;
+	}
+
+	void Empty()
+	{
+		Chunks.Empty();
+		SharedChunks.Empty();
+		NumInstances = 0;
+	}
+
+	void Add(const FVector& Location, const FQuat& Rotation, float Scale)
+	{
+		GetLastChunk().Add(Location, Rotation, Scale);
+		++NumInstances;
+	}
+
+	void Add(const FTransform& Transform)
+	{
+		GetLastChunk().Add(Transform);
+		++NumInstances;
+	}
+
+	/**
+	 * @brief Takes over Chunk, which is left empty. Small chunks are copied and keep their allocation.
+	 */
+	void Append(FFoliageInstanceBuffer&& Chunk)
+	{
+		const int32 ChunkSize = Chunk.Num();
+		if (ChunkSize == 0)
+		{
+			return;
+		}
+		if (Chunks.Num() > 0 && Chunks.Last().Num() == 0)
+		{
+			Swap(Chunks.Last(), Chunk);
+		}
+		else if (Chunks.Num() > 0 && ChunkSize < MinChunkSize)
+		{
+			Chunks.Last().Append(Chunk);
+			Chunk.Reset();
+		}
+		else
+		{
+			Chunks.Add(MoveTemp(Chunk));
+		}
+		NumInstances += ChunkSize;
+	}
+
+	/**
+	 * @brief References the instances of View without copying them, Tile keeps the memory behind it alive.
+	 */
+	void Append(const FFoliageInstanceView& View, const TSharedPtr<const FFoliageCachedTile, ESPMode::ThreadSafe>& Tile)
+	{
+		if (View.Num() == 0)
+		{
+			return;
+		}
+		SharedChunks.Add({View, Tile});
+		NumInstances += View.Num();
+	}
+
+	/**
+	 * @brief Takes over all chunks of Other, which is left empty.
+	 */
+	void Append(FFoliageInstanceChunks&& Other)
+	{
+		for (FFoliageInstanceBuffer& Chunk : Other.Chunks)
+		{
+			Append(MoveTemp(Chunk));
+		}
+		for (FFoliageSharedInstanceChunk& Chunk : Other.SharedChunks)
+		{
+			Append(Chunk.View, Chunk.Tile);
+		}
+		Other.Reset();
+	}
+
+	/**
+	 * @brief Appends Count instances starting at First, counted across all chunks, to OutTransforms.
+	 */
+	void ExpandTransforms(int32 First, int32 Count, TArray<FTransform>& OutTransforms) const
+	{
+		ForEachChunk([&First, &Count, &OutTransforms](const auto& Chunk)
+		{
+			if (Count <= 0)
+			{
+				return;
+			}
+			if (First >= Chunk.Num())
+			{
+				First -= Chunk.Num();
+				return;
+			}
+			const int32 ChunkCount = FMath::Min(Chunk.Num() - First, Count);
+			Chunk.ExpandTransforms(First, ChunkCount, OutTransforms);
+			Count -= ChunkCount;
+			First = 0;
+		});
+	}
+
+	/**
+	 * @brief Calls Function with every owned FFoliageInstanceBuffer, then with the FFoliageInstanceView of every
+	 * shared chunk, in the order the instances are counted.
+	 */
+	template <typename FunctionType>
+	void ForEachChunk(FunctionType&& Function) const
+	{
+		for (const FFoliageInstanceBuffer& Chunk : Chunks)
+		{
+			Function(Chunk);
+		}
+		for (const FFoliageSharedInstanceChunk& Chunk : SharedChunks)
+		{
+			Function(Chunk.View);
+		}
+	}
+
+private:
+	int32 NumInstances = 0;
+
+	FFoliageInstanceBuffer& GetLastChunk()
+	{
+		return Chunks.Num() > 0 ? Chunks.Last() : Chunks.AddDefaulted_GetRef();
+	}
+};
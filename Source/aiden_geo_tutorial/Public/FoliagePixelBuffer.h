@@ -0,0 +1,169 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "PixelFormat.h"
+
+/**
+ * @brief How the pixels of a read back render target are stored.
+ */
+enum class EFoliagePixelEncoding : uint8
+{
+	/** FLinearColor, 16 bytes per pixel (RTF_RGBA32f). */
+	LinearColor,
+	/** FFloat16Color, 8 bytes per pixel (RTF_RGBA16f). */
+	Float16Color,
+	/**
+	 * FColor, 4 bytes per pixel (RTF_RGBA8). Classification RTs store the colour, normal and depth RTs store an
+	 * octahedral encoded normal in RG and 16-bit depth in BA (B is the high byte).
+	 */
+	Colour8,
+	/** One byte per pixel (RTF_R8). Only valid for classification RTs, holds FFoliageClassificationType::ClassID. */
+	ClassID8
+};
+
+/**
+ * @brief Pixels read back from a render target, kept in the narrowest encoding that matches the RT format.
+ */
+struct FFoliagePixelBuffer
+{
+	EFoliagePixelEncoding Encoding = EFoliagePixelEncoding::LinearColor;
+	TArray<uint8> Data;
+
+	static int32 GetBytesPerPixel(EFoliagePixelEncoding InEncoding);
+
+	/**
+	 * @brief Encoding of the raw texels of a pixel format, false if the format isn't supported.
+	 * PF_R8G8B8A8 maps to Colour8 but has to be swizzled with SwizzleRGBA8ToBGRA8.
+	 */
+	static bool GetEncodingForFormat(EPixelFormat Format, EFoliagePixelEncoding& OutEncoding);
+
+	int32 GetBytesPerPixel() const { return GetBytesPerPixel(Encoding); }
+	int32 Num() const { return Data.Num() / GetBytesPerPixel(); }
+
+	/**
+	 * @brief Empties the buffer, keeping its allocation.
+	 */
+	void Reset(EFoliagePixelEncoding InEncoding)
+	{
+		Encoding = InEncoding;
+		Data.Reset();
+	}
+
+	void Reserve(EFoliagePixelEncoding InEncoding, int32 NumPixels)
+	{
+		Data.Reserve(NumPixels * GetBytesPerPixel(InEncoding));
+	}
+
+	/**
+	 * @brief Converts the appended RGBA8 texels starting at pixel StartIndex to FColor (BGRA8) order.
+	 */
+	void SwizzleRGBA8ToBGRA8(int32 StartIndex);
+
+	/**
+	 * @brief Classification colour quantized to 8 bits per channel, packed as 0x00RRGGBB.
+	 */
+	uint32 GetColourKey(int32 Index) const;
+
+	/**
+	 * @brief Class ID stored in a ClassID8 buffer.
+	 */
+	uint8 GetClassID(int32 Index) const { return Data[Index]; }
+
+	/**
+	 * @brief Normal in XYZ and normalized depth in W.
+	 */
+	FVector4 GetNormalDepth(int32 Index) const;
+};
+
+inline int32 FFoliagePixelBuffer::GetBytesPerPixel(EFoliagePixelEncoding InEncoding)
+{
+	switch (InEncoding)
+	{
+	case EFoliagePixelEncoding::Float16Color: return sizeof(FFloat16Color);
+	case EFoliagePixelEncoding::Colour8: return sizeof(FColor);
+	case EFoliagePixelEncoding::ClassID8: return sizeof(uint8);
+	default: return sizeof(FLinearColor);
+	}
+}
+
+inline bool FFoliagePixelBuffer::GetEncodingForFormat(EPixelFormat Format, EFoliagePixelEncoding& OutEncoding)
+{
+	switch (Format)
+	{
+	case PF_A32B32G32R32F: OutEncoding = EFoliagePixelEncoding::LinearColor; return true;
+	case PF_FloatRGBA: OutEncoding = EFoliagePixelEncoding::Float16Color; return true;
+	case PF_B8G8R8A8:
+	case PF_R8G8B8A8: OutEncoding = EFoliagePixelEncoding::Colour8; return true;
+	case PF_G8:
+	case PF_R8: OutEncoding = EFoliagePixelEncoding::ClassID8; return true;
+	default: return false;
+	}
+}
+
+inline void FFoliagePixelBuffer::SwizzleRGBA8ToBGRA8(int32 StartIndex)
+{
+	for (int32 Offset = StartIndex * 4; Offset + 3 < Data.Num(); Offset += 4)
+	{
+		Swap(Data[Offset], Data[Offset + 2]);
+	}
+}
+
+inline uint32 FFoliagePixelBuffer::GetColourKey(int32 Index) const
+{
+	FColor Colour;
+	switch (Encoding)
+	{
+	case EFoliagePixelEncoding::Colour8:
+		Colour = reinterpret_cast<const FColor*>(Data.GetData())[Index];
+		break;
+	case EFoliagePixelEncoding::Float16Color:
+		Colour = FLinearColor(reinterpret_cast<const FFloat16Color*>(Data.GetData())[Index]).QuantizeRound();
+		break;
+	case EFoliagePixelEncoding::ClassID8:
+		Colour = FColor(Data[Index], Data[Index], Data[Index]);
+		break;
+	default:
+		Colour = reinterpret_cast<const FLinearColor*>(Data.GetData())[Index].QuantizeRound();
+		break;
+	}
+	return (static_cast<uint32>(Colour.R) << 16) | (static_cast<uint32>(Colour.G) << 8) | Colour.B;
+}
+
+inline FVector4 FFoliagePixelBuffer::GetNormalDepth(int32 Index) const
+{
+	switch (Encoding)
+	{
+	case EFoliagePixelEncoding::Colour8:
+		{
+			const FColor& Pixel = reinterpret_cast<const FColor*>(Data.GetData())[Index];
+
+			// Octahedral decode
+			const float OX = Pixel.R / 255.f * 2.f - 1.f;
+			const float OY = Pixel.G / 255.f * 2.f - 1.f;
+			FVector Normal(OX, OY, 1.f - FMath::Abs(OX) - FMath::Abs(OY));
+			if (Normal.Z < 0.f)
+			{
+				Normal.X = (1.f - FMath::Abs(OY)) * FMath::Sign(OX);
+				Normal.Y = (1.f - FMath::Abs(OX)) * FMath::Sign(OY);
+			}
+			Normal.Normalize();
+
+			const float Depth = ((static_cast<uint32>(Pixel.B) << 8) | Pixel.A) / 65535.f;
+			return FVector4(Normal, Depth);
+		}
+	case EFoliagePixelEncoding::Float16Color:
+		{
+			const FFloat16Color& Pixel = reinterpret_cast<const FFloat16Color*>(Data.GetData())[Index];
+			return FVector4(Pixel.R.GetFloat(), Pixel.G.GetFloat(), Pixel.B.GetFloat(), Pixel.A.GetFloat());
+		}
+	case EFoliagePixelEncoding::LinearColor:
+		{
+			const FLinearColor& Pixel = reinterpret_cast<const FLinearColor*>(Data.GetData())[Index];
+			return FVector4(Pixel.R, Pixel.G, Pixel.B, Pixel.A);
+		}
+	default:
+		return FVector4(0.f, 0.f, 1.f, 1.f);
+	}
+}
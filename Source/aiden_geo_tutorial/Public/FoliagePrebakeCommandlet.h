@@ -0,0 +1,47 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Commandlets/Commandlet.h"
+
+#include "FoliagePrebakeCommandlet.generated.h"
+
+/**
+ * @brief Builds the foliage of fixed regions ahead of time, so it doesn't have to be captured at runtime.
+ * Loads a map, moves its AFoliageCaptureActor across every region and runs the regular capture and build headless.
+ * Every complete grid cell is written out in the disk tile cache format, one file per cell. At runtime
+ * AFoliageCaptureActor::PrebakedTileDirectory maps the cells on a worker thread, and the HISMs read their instances
+ * straight from the mapping instead of capturing them.
+ *
+ * UnrealEditor-Cmd <Project> -run=FoliagePrebake -Map=/Game/Maps/Corridor -Regions=Corridor.txt
+ *     [-Output=<Dir>] [-Spacing=<Degrees>] [-WarmupSeconds=5] [-Timeout=60] -AllowCommandletRendering
+ *
+ * Each line of the regions file is either "Longitude,Latitude" for a single capture, or
+ * "MinLongitude,MinLatitude,MaxLongitude,MaxLatitude" for a box covered by captures Spacing degrees apart, half a
+ * capture width by default. Empty lines and lines starting with # are skipped. Output defaults to
+ * Content/FoliagePacks. The capture actor's settings and render targets must match the ones used at runtime, as
+ * they are part of every cell's file name.
+ */
+UCLASS()
+class AIDEN_GEO_TUTORIAL_API UFoliagePrebakeCommandlet : public UCommandlet
+{
+	GENERATED_BODY()
+
+public:
+	UFoliagePrebakeCommandlet();
+
+	virtual int32 Main(const FString& Params) override;
+
+private:
+	/**
+	 * @brief Reads the regions file as boxes of longitude and latitude, single captures have an empty box.
+	 */
+	static bool LoadRegions(const FString& FileName, TArray<FBox2D>& OutRegions);
+
+	/**
+	 * @brief Ticks World, the render thread and the game thread tasks until IsDone returns true, or Seconds passed.
+	 * @return False if timed out.
+	 */
+	static bool TickWorld(UWorld* World, double Seconds, TFunctionRef<bool()> IsDone);
+};
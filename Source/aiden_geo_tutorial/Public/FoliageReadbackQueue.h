@@ -0,0 +1,56 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+#include <atomic>
+
+class FRHICommandListImmediate;
+
+/**
+ * @brief GPU readback polled by FFoliageReadbackQueue until it has landed.
+ */
+struct FFoliageReadback
+{
+	virtual ~FFoliageReadback() = default;
+
+	/**
+	 * @brief Render thread: if the readback has landed, hands its data on and sets bFinished.
+	 */
+	virtual void Poll(FRHICommandListImmediate& RHICmdList) = 0;
+
+	std::atomic<bool> bFinished{false};
+};
+
+/**
+ * @brief Readbacks waiting for the GPU, polled together from a single render command per frame.
+ *
+ * UFoliageCaptureSubsystem owns the queue every capture actor in its world reads back through, so the actors don't
+ * each queue polls of their own, and at most foliage.MaxReadbacksFinishedPerFrame readbacks hand their data on in
+ * the same frame when several captures land at once.
+ */
+class AIDEN_GEO_TUTORIAL_API FFoliageReadbackQueue
+{
+public:
+	/**
+	 * @brief Game thread: polls Readback until it has finished. Its copies must already be queued on the render thread.
+	 */
+	void Add(const TSharedRef<FFoliageReadback, ESPMode::ThreadSafe>& Readback);
+
+	/**
+	 * @brief Game thread: polls the pending readbacks. Only runs once per frame, however many actors call it.
+	 */
+	void Poll();
+
+	int32 Num() const { return Pending.Num(); }
+
+private:
+	TArray<TSharedRef<FFoliageReadback, ESPMode::ThreadSafe>> Pending;
+
+	/** Set while a poll is queued on the render thread, so polls don't pile up behind a slow render thread. */
+	TSharedRef<std::atomic<bool>, ESPMode::ThreadSafe> bPolling =
+		MakeShared<std::atomic<bool>, ESPMode::ThreadSafe>(false);
+
+	uint64 LastPollFrame = MAX_uint64;
+};
@@ -0,0 +1,37 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "ProfilingDebugging/CpuProfilerTrace.h"
+#include "Stats/Stats.h"
+
+DECLARE_STATS_GROUP(TEXT("Foliage Capture"), STATGROUP_FoliageCapture, STATCAT_Advanced);
+
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Capture Actor Tick"), STAT_FoliageCaptureTick, STATGROUP_FoliageCapture, AIDEN_GEO_TUTORIAL_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Ellipsoid Tick"), STAT_FoliageEllipsoidTick, STATGROUP_FoliageCapture, AIDEN_GEO_TUTORIAL_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Build Setup"), STAT_FoliageBuildSetup, STATGROUP_FoliageCapture, AIDEN_GEO_TUTORIAL_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Readback"), STAT_FoliageReadback, STATGROUP_FoliageCapture, AIDEN_GEO_TUTORIAL_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Reprojection"), STAT_FoliageReprojection, STATGROUP_FoliageCapture, AIDEN_GEO_TUTORIAL_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Reproject Tile"), STAT_FoliageReprojectTile, STATGROUP_FoliageCapture, AIDEN_GEO_TUTORIAL_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Surface Traces"), STAT_FoliageSurfaceTraces, STATGROUP_FoliageCapture, AIDEN_GEO_TUTORIAL_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Commit Build"), STAT_FoliageCommitBuild, STATGROUP_FoliageCapture, AIDEN_GEO_TUTORIAL_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("HISM Add"), STAT_FoliageHISMAdd, STATGROUP_FoliageCapture, AIDEN_GEO_TUTORIAL_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Cluster Tree Build"), STAT_FoliageClusterTreeBuild, STATGROUP_FoliageCapture, AIDEN_GEO_TUTORIAL_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Flip HISMs"), STAT_FoliageFlipHISMs, STATGROUP_FoliageCapture, AIDEN_GEO_TUTORIAL_API);
+DECLARE_CYCLE_STAT_EXTERN(TEXT("Offset Instances"), STAT_FoliageOffsetInstances, STATGROUP_FoliageCapture, AIDEN_GEO_TUTORIAL_API);
+
+DECLARE_DWORD_COUNTER_STAT_EXTERN(TEXT("Pixels Processed"), STAT_FoliagePixelsProcessed, STATGROUP_FoliageCapture, AIDEN_GEO_TUTORIAL_API);
+DECLARE_DWORD_COUNTER_STAT_EXTERN(TEXT("Bytes Read Back"), STAT_FoliageBytesReadBack, STATGROUP_FoliageCapture, AIDEN_GEO_TUTORIAL_API);
+DECLARE_DWORD_COUNTER_STAT_EXTERN(TEXT("Surface Traces Issued"), STAT_FoliageTracesIssued, STATGROUP_FoliageCapture, AIDEN_GEO_TUTORIAL_API);
+DECLARE_DWORD_COUNTER_STAT_EXTERN(TEXT("Instances Generated"), STAT_FoliageInstancesGenerated, STATGROUP_FoliageCapture, AIDEN_GEO_TUTORIAL_API);
+DECLARE_DWORD_COUNTER_STAT_EXTERN(TEXT("Instances Committed"), STAT_FoliageInstancesCommitted, STATGROUP_FoliageCapture, AIDEN_GEO_TUTORIAL_API);
+DECLARE_DWORD_ACCUMULATOR_STAT_EXTERN(TEXT("Builds In Flight"), STAT_FoliageBuildsInFlight, STATGROUP_FoliageCapture, AIDEN_GEO_TUTORIAL_API);
+
+/**
+ * @brief Cycle counter for "stat FoliageCapture" that also shows up as a CPU event in Unreal Insights, without
+ * having to enable stat named events.
+ */
+#define FOLIAGE_SCOPE_CYCLE_COUNTER(Stat) \
+	SCOPE_CYCLE_COUNTER(Stat); \
+	TRACE_CPUPROFILER_EVENT_SCOPE(Stat)
@@ -0,0 +1,179 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Containers/LruCache.h"
+#include "HAL/ThreadSafeCounter.h"
+#include "FoliageInstanceBuffer.h"
+
+class IMappedFileHandle;
+class IMappedFileRegion;
+
+/**
+ * @brief Identifies the generated foliage of one grid cell. Besides the cell, the key covers everything the result
+ * depends on: the capture resolution and the placement settings of the capture actor.
+ */
+struct FFoliageTileCacheKey
+{
+	FIntPoint Cell = FIntPoint::ZeroValue;
+	/** Size of the classification RT. */
+	FIntPoint Resolution = FIntPoint::ZeroValue;
+	/** Hash of the foliage types, grid and capture settings, see AFoliageCaptureActor::GetTileCacheSettingsHash. */
+	uint32 SettingsHash = 0;
+
+	friend bool operator==(const FFoliageTileCacheKey& A, const FFoliageTileCacheKey& B)
+	{
+		return A.Cell == B.Cell && A.Resolution == B.Resolution && A.SettingsHash == B.SettingsHash;
+	}
+
+	friend uint32 GetTypeHash(const FFoliageTileCacheKey& Key)
+	{
+		return HashCombine(HashCombine(GetTypeHash(Key.Cell), GetTypeHash(Key.Resolution)), Key.SettingsHash);
+	}
+
+	/**
+	 * @brief File name of the tile in a disk cache directory.
+	 */
+	FString GetFileName() const;
+};
+
+/**
+ * @brief Generated instances of one grid cell, independent of where the capture actor was at the time.
+ * Instances are relative to an anchor that is stored geographically, so it can be placed again after the
+ * georeference origin or the world origin moved. Tiles loaded from disk keep their file mapped and read the
+ * instances straight out of it.
+ */
+struct FFoliageCachedTile
+{
+	/** Longitude, latitude and height of the anchor. */
+	FVector AnchorLongitudeLatitudeHeight = FVector::ZeroVector;
+	/** Anchor rotation relative to east-south-up at the anchor. */
+	FQuat AnchorRotation = FQuat::Identity;
+	FVector AnchorScale = FVector::OneVector;
+
+	FFoliageCachedTile();
+	~FFoliageCachedTile();
+
+	/**
+	 * @brief Instances of each geometry type, indexed like FFoliageGridCell::HISMs. Only valid while the tile is.
+	 */
+	const TArray<FFoliageInstanceView>& GetGeometryTypes() const { return GeometryTypes; }
+
+	/**
+	 * @brief Takes over the instances of each geometry type.
+	 */
+	void SetGeometryTypes(TArray<FFoliageInstanceBuffer>&& InBuffers);
+
+	/**
+	 * @brief Writes the tile in the disk cache format.
+	 */
+	void Serialize(TArray<uint8>& OutData) const;
+
+	/**
+	 * @brief Points the geometry types into Data, a tile written by Serialize that has to outlive the tile. False if
+	 * the data is truncated, misaligned or from another version.
+	 */
+	bool Deserialize(const uint8* Data, int64 Size);
+
+	/**
+	 * @brief Maps FileName and reads the tile from the mapping, which stays open for as long as the tile exists.
+	 */
+	bool LoadMapped(const FString& FileName);
+
+private:
+	TArray<FFoliageInstanceView> GeometryTypes;
+
+	/** Backs GeometryTypes for tiles that weren't loaded from disk. */
+	TArray<FFoliageInstanceBuffer> Buffers;
+
+	/** Backs GeometryTypes for tiles loaded from disk, the region is released before the file. */
+	TUniquePtr<IMappedFileHandle> MappedFile;
+	TUniquePtr<IMappedFileRegion> MappedRegion;
+};
+
+/**
+ * @brief Called on the game thread once a tile load finished, with null if there is no valid tile.
+ */
+using FOnFoliageTileLoaded = TFunction<void(const TSharedPtr<const FFoliageCachedTile, ESPMode::ThreadSafe>&)>;
+
+/**
+ * @brief Generated foliage of recently built grid cells, so revisited cells can be restored without capturing
+ * and reprojecting them again. Keeps the most recently used tiles in memory, and optionally every tile in files on
+ * disk. Files are memory mapped on a worker thread, and their instances are read from the mapping without copying.
+ * Each directory is listed once when it's configured, so tiles that aren't on disk are known without touching it.
+ * Game thread only, disk reads and writes run in the background.
+ */
+class AIDEN_GEO_TUTORIAL_API FFoliageTileCache
+{
+public:
+	FFoliageTileCache();
+
+	/**
+	 * @brief Sets the capacity of the memory cache, the directory of the disk cache (empty to disable it), and a read
+	 * only directory of pre-baked tiles that is searched before the disk cache (empty to disable it).
+	 * Changing the capacity drops the tiles held in memory, changing a directory lists the files in it again.
+	 */
+	void Configure(int32 InMaxTiles, const FString& InDiskDirectory, const FString& InPrebakedDirectory = FString());
+
+	/**
+	 * @brief The tile stored under Key if it's held in memory, null otherwise. Never touches the disk.
+	 */
+	TSharedPtr<const FFoliageCachedTile, ESPMode::ThreadSafe> Find(const FFoliageTileCacheKey& Key);
+
+	/**
+	 * @brief Whether a file for Key is in the pre-baked tiles or the disk cache, answered from the directory listings.
+	 */
+	bool IsOnDisk(const FFoliageTileCacheKey& Key) const;
+
+	/**
+	 * @brief Loads the tile stored under Key from the pre-baked tiles or the disk cache on a worker thread, and adds
+	 * it to memory. OnLoaded is called on the game thread, and not at all if the cache is destroyed first.
+	 * Loads of a key that is already loading share its result. A file that turns out invalid isn't tried again.
+	 */
+	void LoadAsync(const FFoliageTileCacheKey& Key, FOnFoliageTileLoaded&& OnLoaded);
+
+	/**
+	 * @brief Stores Tile in memory, evicting the least recently used tile if full, and writes it to disk if enabled.
+	 */
+	void Add(const FFoliageTileCacheKey& Key, const TSharedRef<const FFoliageCachedTile, ESPMode::ThreadSafe>& Tile);
+
+	/**
+	 * @brief Drops the tiles held in memory, the disk cache is left alone.
+	 */
+	void Empty();
+
+	/**
+	 * @brief Blocks until every tile passed to Add has been written to disk.
+	 */
+	void WaitForPendingWrites() const;
+
+private:
+	/**
+	 * @brief Worker thread: maps the tile written to FileName, null if there is no valid tile.
+	 */
+	static TSharedPtr<const FFoliageCachedTile, ESPMode::ThreadSafe> LoadFromDisk(const FString& FileName);
+
+	/**
+	 * @brief Names of the tile files in Directory.
+	 */
+	static TSet<FString> ListTileFiles(const FString& Directory);
+
+	TLruCache<FFoliageTileCacheKey, TSharedPtr<const FFoliageCachedTile, ESPMode::ThreadSafe>> MemoryCache;
+
+	FString DiskDirectory;
+	FString PrebakedDirectory;
+
+	/** File names in each directory, tiles passed to Add join the disk cache's once their write is queued. */
+	TSet<FString> DiskFiles;
+	TSet<FString> PrebakedFiles;
+
+	/** Callbacks of the loads in flight. */
+	TMap<FFoliageTileCacheKey, TArray<FOnFoliageTileLoaded>> PendingLoads;
+
+	/** Shared with the write tasks, which may outlive the cache. */
+	TSharedRef<FThreadSafeCounter, ESPMode::ThreadSafe> NumPendingWrites;
+
+	/** Load tasks only call back into the cache while this is alive. */
+	TSharedRef<bool, ESPMode::ThreadSafe> LifetimeToken;
+};
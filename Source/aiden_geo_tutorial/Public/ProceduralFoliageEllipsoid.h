@@ -1,28 +1,47 @@
-// Fill out your copyright notice in the Description page of Project Settings.
-
-#pragma once
-
-#include "CoreMinimal.h"
-#include "Cesium3DTileset.h"
-#include "FoliageCaptureActor.h"
-
-#include "ProceduralFoliageEllipsoid.generated.h"
-
-/**
- * 
- */
-UCLASS()
-class AIDEN_GEO_TUTORIAL_API AProceduralFoliageEllipsoid : public ACesium3DTileset
-{
-	GENERATED_BODY()
-
-public:
-	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage")
-		AFoliageCaptureActor* FoliageCaptureActor;
-
-	virtual void Tick(float DeltaSeconds) override;
-
-protected:
-	// Initial spawn
-	bool bHasFoliageSpawned = false;
-};
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Cesium3DTileset.h"
+#include "FoliageCaptureActor.h"
+
+#include "ProceduralFoliageEllipsoid.generated.h"
+
+struct FFoliageViewer;
+
+/**
+ * @brief Tileset that spawns foliage on its surface. Its capture actors are moved to the camera by the
+ * UFoliageCaptureSubsystem, which it registers with.
+ */
+UCLASS()
+class AIDEN_GEO_TUTORIAL_API AProceduralFoliageEllipsoid : public ACesium3DTileset
+{
+	GENERATED_BODY()
+
+public:
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage")
+		AFoliageCaptureActor* FoliageCaptureActor;
+
+	/**
+	 * @brief Additional capture actors centred on the same camera, e.g. a small high resolution ring for grass and a
+	 * wide coarse ring for trees. Each ring has its own capture width, render targets, foliage types and HISM
+	 * pools, and is recaptured on its own (see AFoliageCaptureActor::UpdateDistanceFraction).
+	 */
+	UPROPERTY(BlueprintReadWrite, EditAnywhere, Category = "Foliage")
+		TArray<AFoliageCaptureActor*> FoliageCaptureRings;
+
+	virtual void Tick(float DeltaSeconds) override;
+
+	/**
+	 * @brief Moves the capture actor to the viewer if the viewer has left its capture.
+	 */
+	void UpdateCaptureActor(AFoliageCaptureActor* CaptureActor, ACesiumGeoreference* Geo, const FFoliageViewer& Viewer);
+
+protected:
+	virtual void BeginPlay() override;
+	virtual void EndPlay(const EEndPlayReason::Type EndPlayReason) override;
+
+	// Initial spawn, per capture actor
+	TSet<const AFoliageCaptureActor*> SpawnedCaptureActors;
+};
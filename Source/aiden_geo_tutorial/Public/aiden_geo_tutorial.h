@@ -0,0 +1,21 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Modules/ModuleInterface.h"
+
+class FAidenGeoTutorialModule : public IModuleInterface
+{
+public:
+	/**
+	 * @brief Maps the "/FoliageShaders" virtual shader directory to the project's Shaders directory. The module loads
+	 * in PostConfigInit, so it runs before the global shaders are compiled.
+	 */
+	virtual void StartupModule() override;
+
+	virtual bool IsGameModule() const override
+	{
+		return true;
+	}
+};